@@ -37,7 +37,8 @@ bool is_empty_box(struct grim_box *box) {
 	return box->width <= 0 || box->height <= 0;
 }
 
-bool intersect_box(struct grim_box *a, struct grim_box *b) {
+bool get_box_intersection(struct grim_box *a, struct grim_box *b,
+		struct grim_box *intersection) {
 	if (is_empty_box(a) || is_empty_box(b)) {
 		return false;
 	}
@@ -47,11 +48,31 @@ bool intersect_box(struct grim_box *a, struct grim_box *b) {
 	int x2 = fmin(a->x + a->width, b->x + b->width);
 	int y2 = fmin(a->y + a->height, b->y + b->height);
 
-	struct grim_box box = {
+	*intersection = (struct grim_box){
+		.x = x1,
+		.y = y1,
+		.width = x2 - x1,
+		.height = y2 - y1,
+	};
+	return !is_empty_box(intersection);
+}
+
+bool intersect_box(struct grim_box *a, struct grim_box *b) {
+	struct grim_box intersection;
+	return get_box_intersection(a, b, &intersection);
+}
+
+void get_box_union(struct grim_box *a, struct grim_box *b,
+		struct grim_box *result) {
+	int x1 = fmin(a->x, b->x);
+	int y1 = fmin(a->y, b->y);
+	int x2 = fmax(a->x + a->width, b->x + b->width);
+	int y2 = fmax(a->y + a->height, b->y + b->height);
+
+	*result = (struct grim_box){
 		.x = x1,
 		.y = y1,
 		.width = x2 - x1,
 		.height = y2 - y1,
 	};
-	return !is_empty_box(&box);
 }
@@ -1,5 +1,9 @@
+#if HAVE_MEMFD_CREATE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +13,7 @@
 
 #include "buffer.h"
 
+#if !HAVE_MEMFD_CREATE
 static void randname(char *buf) {
 	struct timespec ts;
 	clock_gettime(CLOCK_REALTIME, &ts);
@@ -18,8 +23,12 @@ static void randname(char *buf) {
 		r >>= 5;
 	}
 }
+#endif
 
 static int anonymous_shm_open(void) {
+#if HAVE_MEMFD_CREATE
+	return memfd_create("grim", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
 	char name[] = "/grim-XXXXXX";
 	int retries = 100;
 
@@ -36,60 +45,166 @@ static int anonymous_shm_open(void) {
 	} while (retries > 0 && errno == EEXIST);
 
 	return -1;
+#endif
 }
 
-static int create_shm_file(off_t size) {
-	int fd = anonymous_shm_open();
-	if (fd < 0) {
-		return fd;
+struct grim_shm_pool *create_shm_pool(struct wl_shm *shm, size_t size) {
+	struct grim_shm_pool *pool = calloc(1, sizeof(struct grim_shm_pool));
+	if (pool == NULL) {
+		return NULL;
 	}
+	pool->shm = shm;
+	pool->data = MAP_FAILED;
+	wl_list_init(&pool->buffers);
 
-	if (ftruncate(fd, size) < 0) {
-		close(fd);
-		return -1;
+	pool->fd = anonymous_shm_open();
+	if (pool->fd < 0) {
+		free(pool);
+		return NULL;
 	}
 
-	return fd;
+	if (size > 0 && !shm_pool_reserve(pool, size)) {
+		destroy_shm_pool(pool);
+		return NULL;
+	}
+	return pool;
 }
 
-struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
-		int32_t width, int32_t height, int32_t stride) {
-	size_t size = stride * height;
+bool shm_pool_reserve(struct grim_shm_pool *pool, size_t size) {
+	if (size <= pool->size) {
+		return true;
+	}
+	if (size > INT32_MAX) {
+		fprintf(stderr, "shm pool too large: %zu bytes\n", size);
+		return false;
+	}
 
-	int fd = create_shm_file(size);
-	if (fd == -1) {
-		return NULL;
+	if (ftruncate(pool->fd, size) < 0) {
+		return false;
 	}
+#if HAVE_MEMFD_CREATE
+	// The compositor maps the pool too, don't let it shrink under its feet
+	fcntl(pool->fd, F_ADD_SEALS, F_SEAL_SHRINK);
+#endif
 
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		pool->fd, 0);
 	if (data == MAP_FAILED) {
-		close(fd);
-		return NULL;
+		return false;
+	}
+	if (pool->data != MAP_FAILED) {
+		munmap(pool->data, pool->size);
+	}
+	pool->data = data;
+
+	// Existing buffers keep their offset in the file
+	struct grim_buffer *buffer;
+	wl_list_for_each(buffer, &pool->buffers, link) {
+		buffer->data = (unsigned char *)pool->data + buffer->offset;
+	}
+
+	if (pool->wl_pool == NULL) {
+		pool->wl_pool = wl_shm_create_pool(pool->shm, pool->fd, size);
+	} else {
+		wl_shm_pool_resize(pool->wl_pool, size);
+	}
+	pool->size = size;
+	return true;
+}
+
+void destroy_shm_pool(struct grim_shm_pool *pool) {
+	if (pool == NULL) {
+		return;
 	}
+	struct grim_buffer *buffer, *buffer_tmp;
+	wl_list_for_each_safe(buffer, buffer_tmp, &pool->buffers, link) {
+		destroy_buffer(buffer);
+	}
+	if (pool->wl_pool != NULL) {
+		wl_shm_pool_destroy(pool->wl_pool);
+	}
+	if (pool->data != MAP_FAILED) {
+		munmap(pool->data, pool->size);
+	}
+	close(pool->fd);
+	free(pool);
+}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	struct wl_buffer *wl_buffer =
-		wl_shm_pool_create_buffer(pool, 0, width, height, stride, format);
-	wl_shm_pool_destroy(pool);
+static size_t align_size(size_t size) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	return (size + page_size - 1) / page_size * page_size;
+}
 
-	close(fd);
+struct grim_buffer *create_buffer(struct grim_shm_pool *pool,
+		enum wl_shm_format format, int32_t width, int32_t height,
+		int32_t stride) {
+	size_t size = (size_t)stride * height;
+	size_t aligned_size = align_size(size);
+
+	// Take the first gap left by destroyed buffers which is large enough,
+	// the end of the pool otherwise
+	size_t offset = 0;
+	struct wl_list *next = &pool->buffers;
+	struct grim_buffer *other;
+	wl_list_for_each(other, &pool->buffers, link) {
+		if (other->offset - offset >= aligned_size) {
+			next = &other->link;
+			break;
+		}
+		offset = other->offset + align_size(other->size);
+	}
+	size_t end = offset + aligned_size;
+	if (end > pool->size) {
+		size_t new_size = 2 * pool->size;
+		if (new_size > INT32_MAX) {
+			new_size = INT32_MAX;
+		}
+		if (new_size < end) {
+			new_size = end;
+		}
+		if (!shm_pool_reserve(pool, new_size)) {
+			return NULL;
+		}
+	}
 
 	struct grim_buffer *buffer = calloc(1, sizeof(struct grim_buffer));
-	buffer->wl_buffer = wl_buffer;
-	buffer->data = data;
+	if (buffer == NULL) {
+		return NULL;
+	}
+	buffer->wl_buffer = wl_shm_pool_create_buffer(pool->wl_pool, offset,
+		width, height, stride, format);
+	buffer->pool = pool;
+	buffer->offset = offset;
+	buffer->data = (unsigned char *)pool->data + offset;
 	buffer->width = width;
 	buffer->height = height;
 	buffer->stride = stride;
 	buffer->size = size;
 	buffer->format = format;
+	wl_list_insert(next->prev, &buffer->link);
 	return buffer;
 }
 
+void discard_buffer_data(struct grim_buffer *buffer) {
+#ifdef MADV_REMOVE
+	// Unmapping would keep the pages of the shm file around, they must be
+	// removed from it. Buffers start on a page, only whole pages go.
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t size = buffer->size / page_size * page_size;
+	if (size > 0) {
+		madvise(buffer->data, size, MADV_REMOVE);
+	}
+#else
+	(void)buffer;
+#endif
+}
+
 void destroy_buffer(struct grim_buffer *buffer) {
 	if (buffer == NULL) {
 		return;
 	}
-	munmap(buffer->data, buffer->size);
+	// Its space is a gap create_buffer can reuse from now on
+	wl_list_remove(&buffer->link);
 	wl_buffer_destroy(buffer->wl_buffer);
 	free(buffer);
 }
@@ -6,7 +6,10 @@ _grim() {
 	PREV="${COMP_WORDS[COMP_CWORD-1]}"
 
 	if [[ "$PREV" == "-t" ]]; then
-		COMPREPLY=($(compgen -W "png ppm jpeg" -- "$CUR"))
+		COMPREPLY=($(compgen -W "png ppm jpeg qoi raw y4m" -- "$CUR"))
+		return
+	elif [[ "$PREV" == "-F" ]]; then
+		COMPREPLY=($(compgen -W "fast quality" -- "$CUR"))
 		return
 	elif [[ "$PREV" == "-o" ]]; then
 		local OUTPUTS
@@ -18,7 +21,7 @@ _grim() {
 	fi
 
 	if [[ "$CUR" == -* ]]; then
-		COMPREPLY=($(compgen -W "-h -s -g -t -q -o -c" -- "$CUR"))
+		COMPREPLY=($(compgen -W "-h -s -F -b -g -t -q -l -Y -R -o -O -e -c -T -A -n -r -j -D -C" -- "$CUR"))
 		return
 	fi
 
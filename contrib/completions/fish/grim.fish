@@ -6,10 +6,23 @@ function complete_outputs
     end
 end
 
-complete -c grim -s t --exclusive --arguments 'png ppm jpeg' -d 'Output image format'
+complete -c grim -s t --exclusive --arguments 'png ppm jpeg qoi raw y4m' -d 'Output image format'
 complete -c grim -s q --exclusive -d 'Output jpeg quality (default 80)'
+complete -c grim -s Y --exclusive --arguments '420 444' -d 'Output y4m chroma subsampling'
+complete -c grim -s R --exclusive --arguments 'limited full' -d 'Output y4m color range'
 complete -c grim -s g --exclusive -d 'Region to capture: <x>,<y> <w>x<h>'
 complete -c grim -s s --exclusive -d 'Output image scale factor'
+complete -c grim -s F --exclusive --arguments 'fast quality' -d 'Downscaling filter'
+complete -c grim -s b --exclusive -d 'Render and encode in bands of this many rows'
 complete -c grim -s c -d 'Include cursors in the screenshot'
 complete -c grim -s h -d 'Show help and exit'
 complete -c grim -s o --exclusive --arguments '(complete_outputs)' -d 'Output name to capture'
+complete -c grim -s O -d 'Write each output to its own file'
+complete -c grim -s e --exclusive -d 'Also write the image with other options'
+complete -c grim -s T --exclusive -d 'Toplevel identifier to capture'
+complete -c grim -s A -d 'Write each toplevel to its own file'
+complete -c grim -s n --exclusive -d 'Number of frames to record (0 until interrupted)'
+complete -c grim -s r --exclusive -d 'Recording frame rate'
+complete -c grim -s j --exclusive -d 'Number of threads'
+complete -c grim -s D -d 'Run as a capture daemon'
+complete -c grim -s C -d 'Send the capture request to the daemon'
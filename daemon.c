@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "write_png.h"
+
+/*
+ * Requests are sent as "key value" lines terminated by an empty line, along
+ * with the destination file descriptor. The daemon replies with a single
+ * "ok" or "error <message>" line once the image has been written.
+ */
+
+static const char *const filetype_names[] = {
+	[GRIM_FILETYPE_PNG] = "png",
+	[GRIM_FILETYPE_PPM] = "ppm",
+	[GRIM_FILETYPE_JPEG] = "jpeg",
+	[GRIM_FILETYPE_QOI] = "qoi",
+	[GRIM_FILETYPE_RAW] = "raw",
+	[GRIM_FILETYPE_Y4M] = "y4m",
+};
+
+char *get_daemon_socket_path(void) {
+	const char *socket_path = getenv("GRIM_SOCKET");
+	if (socket_path != NULL && socket_path[0] != '\0') {
+		return strdup(socket_path);
+	}
+
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL || runtime_dir[0] == '\0') {
+		return NULL;
+	}
+	const char *display = getenv("WAYLAND_DISPLAY");
+	if (display == NULL || display[0] == '\0') {
+		display = "wayland-0";
+	}
+	const char *display_name = strrchr(display, '/');
+	display_name = display_name != NULL ? display_name + 1 : display;
+
+	int len = snprintf(NULL, 0, "%s/grim-%s.sock", runtime_dir, display_name);
+	if (len < 0) {
+		return NULL;
+	}
+	char *path = malloc(len + 1);
+	if (path == NULL) {
+		return NULL;
+	}
+	snprintf(path, len + 1, "%s/grim-%s.sock", runtime_dir, display_name);
+	return path;
+}
+
+static bool get_socket_addr(struct sockaddr_un *addr, const char *socket_path) {
+	*addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "socket path '%s' is too long\n", socket_path);
+		return false;
+	}
+	strcpy(addr->sun_path, socket_path);
+	return true;
+}
+
+static int create_socket(void) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+static int bind_socket(int fd, const struct sockaddr_un *addr) {
+	// Whoever can connect gets screenshots, only let the user in even if
+	// the socket is in a shared directory
+	mode_t mask = umask(0077);
+	int ret = bind(fd, (const struct sockaddr *)addr, sizeof(*addr));
+	umask(mask);
+	return ret;
+}
+
+int daemon_listen(const char *socket_path) {
+	struct sockaddr_un addr;
+	if (!get_socket_addr(&addr, socket_path)) {
+		return -1;
+	}
+	int fd = create_socket();
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (bind_socket(fd, &addr) < 0) {
+		if (errno != EADDRINUSE) {
+			perror("bind");
+			close(fd);
+			return -1;
+		}
+
+		// Take over the socket left behind by a daemon which is gone
+		int other_fd = create_socket();
+		if (other_fd >= 0 && connect(other_fd, (struct sockaddr *)&addr,
+				sizeof(addr)) == 0) {
+			fprintf(stderr, "a daemon is already listening on '%s'\n",
+				socket_path);
+			close(other_fd);
+			close(fd);
+			return -1;
+		}
+		if (other_fd >= 0) {
+			close(other_fd);
+		}
+		unlink(socket_path);
+		if (bind_socket(fd, &addr) < 0) {
+			perror("bind");
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (listen(fd, 16) < 0) {
+		perror("listen");
+		close(fd);
+		unlink(socket_path);
+		return -1;
+	}
+	return fd;
+}
+
+int daemon_accept(int listen_fd) {
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+			cred.uid != getuid()) {
+		fprintf(stderr, "rejected a daemon client of another user\n");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+struct daemon_dest {
+	int fd;
+	bool failed;
+};
+
+static ssize_t write_dest(void *cookie, const char *buf, size_t size) {
+	struct daemon_dest *dest = cookie;
+	size_t written = 0;
+	while (written < size && !dest->failed) {
+		// A destination nobody reads would block the daemon for good.
+		// Once it polls writable, a pipe takes PIPE_BUF bytes at least.
+		struct pollfd pfd = { .fd = dest->fd, .events = POLLOUT };
+		int ret = poll(&pfd, 1, DAEMON_WRITE_TIMEOUT_MS);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret == 0) {
+			fprintf(stderr, "daemon destination stalled\n");
+		}
+		if (ret <= 0) {
+			dest->failed = true;
+			break;
+		}
+
+		size_t n = size - written;
+		if (n > PIPE_BUF) {
+			n = PIPE_BUF;
+		}
+		ssize_t n_written = write(dest->fd, buf + written, n);
+		if (n_written < 0 && errno != EINTR) {
+			dest->failed = true;
+		} else if (n_written > 0) {
+			written += n_written;
+		}
+	}
+	// Short writes are errors, negative values aren't allowed
+	return written;
+}
+
+static int close_dest(void *cookie) {
+	struct daemon_dest *dest = cookie;
+	int ret = close(dest->fd);
+	free(dest);
+	return ret;
+}
+
+FILE *daemon_open_dest(int dest_fd) {
+	struct daemon_dest *dest = calloc(1, sizeof(*dest));
+	if (dest == NULL) {
+		return NULL;
+	}
+	dest->fd = dest_fd;
+	FILE *file = fopencookie(dest, "w", (cookie_io_functions_t){
+		.write = write_dest,
+		.close = close_dest,
+	});
+	if (file == NULL) {
+		free(dest);
+	}
+	return file;
+}
+
+static bool parse_int(const char *str, int min, int max, int *out) {
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
+	if (*end != '\0' || errno || value < min || value > max) {
+		return false;
+	}
+	*out = value;
+	return true;
+}
+
+bool parse_request_line(struct grim_request *request, char *line) {
+	char *value = strchr(line, ' ');
+	if (value != NULL) {
+		*value = '\0';
+		value++;
+	}
+
+	if (strcmp(line, "cursor") == 0) {
+		request->with_cursor = true;
+		return value == NULL;
+	}
+	if (value == NULL) {
+		return false;
+	}
+
+	if (strcmp(line, "scale") == 0) {
+		char *end = NULL;
+		request->use_greatest_scale = false;
+		request->scale = strtod(value, &end);
+		return *end == '\0' && request->scale > 0;
+	} else if (strcmp(line, "geometry") == 0) {
+		request->has_geometry = true;
+		return parse_box(&request->geometry, value);
+	} else if (strcmp(line, "output") == 0) {
+		request->output_name = value;
+		return true;
+	} else if (strcmp(line, "toplevel") == 0) {
+		request->toplevel_identifier = value;
+		return true;
+	} else if (strcmp(line, "type") == 0) {
+		for (size_t i = 0; i < sizeof(filetype_names) / sizeof(filetype_names[0]); i++) {
+			if (filetype_names[i] != NULL && strcmp(filetype_names[i], value) == 0) {
+#if !HAVE_JPEG
+				if (i == GRIM_FILETYPE_JPEG) {
+					return false;
+				}
+#endif
+				request->filetype = i;
+				return true;
+			}
+		}
+		return false;
+	} else if (strcmp(line, "quality") == 0) {
+		return parse_int(value, 0, 100, &request->jpeg_quality);
+	} else if (strcmp(line, "level") == 0) {
+		if (strcmp(value, "fast") == 0) {
+			request->png_level = GRIM_PNG_LEVEL_FAST;
+			return true;
+		} else if (strcmp(value, "auto") == 0) {
+			request->png_level = GRIM_PNG_LEVEL_AUTO;
+			return true;
+		}
+		return parse_int(value, 0, 9, &request->png_level);
+	} else if (strcmp(line, "chroma") == 0) {
+		request->y4m_format.chroma_444 = strcmp(value, "444") == 0;
+		return request->y4m_format.chroma_444 || strcmp(value, "420") == 0;
+	} else if (strcmp(line, "filter") == 0) {
+		request->filter = strcmp(value, "fast") == 0 ?
+			GRIM_FILTER_FAST : GRIM_FILTER_QUALITY;
+		return request->filter == GRIM_FILTER_FAST ||
+			strcmp(value, "quality") == 0;
+	} else if (strcmp(line, "bands") == 0) {
+		return parse_int(value, 1, INT_MAX, &request->band_rows);
+	} else if (strcmp(line, "range") == 0) {
+		request->y4m_format.full_range = strcmp(value, "full") == 0;
+		return request->y4m_format.full_range ||
+			strcmp(value, "limited") == 0;
+	}
+	return false;
+}
+
+static void receive_fds(struct msghdr *msg, int *dest_fd) {
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < n_fds; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (*dest_fd < 0) {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				*dest_fd = fd;
+			} else {
+				close(fd);
+			}
+		}
+	}
+}
+
+bool daemon_read_request(int fd, char *buf, size_t buf_size,
+		struct grim_request *request, int *dest_fd) {
+	*dest_fd = -1;
+
+	size_t len = 0;
+	char *end = NULL;
+	while (end == NULL) {
+		if (len + 1 >= buf_size) {
+			fprintf(stderr, "daemon request too large\n");
+			return false;
+		}
+
+		char control[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = {
+			.iov_base = buf + len,
+			.iov_len = buf_size - 1 - len,
+		};
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		ssize_t n = recvmsg(fd, &msg, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			fprintf(stderr, "failed to read daemon request\n");
+			return false;
+		}
+		receive_fds(&msg, dest_fd);
+
+		len += n;
+		buf[len] = '\0';
+		end = strstr(buf, "\n\n");
+	}
+	end[1] = '\0';
+
+	if (*dest_fd < 0) {
+		fprintf(stderr, "daemon request without a destination\n");
+		return false;
+	}
+
+	*request = (struct grim_request){
+		.scale = 1.0,
+		.use_greatest_scale = true,
+		.filetype = GRIM_FILETYPE_PNG,
+		.jpeg_quality = 80,
+		.png_level = 6,
+	};
+	char *line = buf;
+	while (line[0] != '\0') {
+		char *line_end = strchr(line, '\n');
+		*line_end = '\0';
+		if (!parse_request_line(request, line)) {
+			fprintf(stderr, "invalid daemon request line '%s'\n", line);
+			return false;
+		}
+		line = line_end + 1;
+	}
+	return true;
+}
+
+void daemon_send_reply(int fd, const char *error) {
+	if (error == NULL) {
+		dprintf(fd, "ok\n");
+	} else {
+		dprintf(fd, "error %s\n", error);
+	}
+}
+
+int daemon_connect(const char *socket_path) {
+	struct sockaddr_un addr;
+	if (!get_socket_addr(&addr, socket_path)) {
+		return -1;
+	}
+	int fd = create_socket();
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "failed to connect to the daemon at '%s': %s\n",
+			socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool write_request_string(FILE *stream, const char *key,
+		const char *value) {
+	if (strchr(value, '\n') != NULL) {
+		fprintf(stderr, "invalid %s '%s'\n", key, value);
+		return false;
+	}
+	fprintf(stream, "%s %s\n", key, value);
+	return true;
+}
+
+bool daemon_send_request(int fd, const struct grim_request *request,
+		int dest_fd) {
+	char *data = NULL;
+	size_t len = 0;
+	FILE *stream = open_memstream(&data, &len);
+	if (stream == NULL) {
+		perror("open_memstream");
+		return false;
+	}
+
+	bool ok = true;
+	if (!request->use_greatest_scale) {
+		fprintf(stream, "scale %.17g\n", request->scale);
+	}
+	if (request->has_geometry) {
+		fprintf(stream, "geometry %d,%d %dx%d\n", request->geometry.x,
+			request->geometry.y, request->geometry.width,
+			request->geometry.height);
+	}
+	if (request->output_name != NULL) {
+		ok = ok && write_request_string(stream, "output", request->output_name);
+	}
+	if (request->toplevel_identifier != NULL) {
+		ok = ok && write_request_string(stream, "toplevel",
+			request->toplevel_identifier);
+	}
+	if (request->with_cursor) {
+		fprintf(stream, "cursor\n");
+	}
+	fprintf(stream, "type %s\n", filetype_names[request->filetype]);
+	fprintf(stream, "quality %d\n", request->jpeg_quality);
+	if (request->png_level == GRIM_PNG_LEVEL_FAST) {
+		fprintf(stream, "level fast\n");
+	} else if (request->png_level == GRIM_PNG_LEVEL_AUTO) {
+		fprintf(stream, "level auto\n");
+	} else {
+		fprintf(stream, "level %d\n", request->png_level);
+	}
+	fprintf(stream, "chroma %s\n", request->y4m_format.chroma_444 ? "444" : "420");
+	fprintf(stream, "range %s\n",
+		request->y4m_format.full_range ? "full" : "limited");
+	fprintf(stream, "filter %s\n",
+		request->filter == GRIM_FILTER_QUALITY ? "quality" : "fast");
+	if (request->band_rows > 0) {
+		fprintf(stream, "bands %d\n", request->band_rows);
+	}
+	fprintf(stream, "\n");
+	fclose(stream);
+	if (!ok) {
+		free(data);
+		return false;
+	}
+
+	// The destination is sent along with the first chunk
+	char control[CMSG_SPACE(sizeof(int))] = {0};
+	struct iovec iov = { .iov_base = data, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &dest_fd, sizeof(int));
+
+	size_t written = 0;
+	while (written < len) {
+		ssize_t n = sendmsg(fd, &msg, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			perror("failed to send request to the daemon");
+			free(data);
+			return false;
+		}
+		written += n;
+		iov.iov_base = data + written;
+		iov.iov_len = len - written;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+	}
+	free(data);
+	return true;
+}
+
+bool daemon_read_reply(int fd) {
+	char buf[256];
+	size_t len = 0;
+	while (len + 1 < sizeof(buf) && memchr(buf, '\n', len) == NULL) {
+		ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+	}
+	buf[len] = '\0';
+
+	char *line_end = strchr(buf, '\n');
+	if (line_end == NULL) {
+		fprintf(stderr, "invalid reply from the daemon\n");
+		return false;
+	}
+	*line_end = '\0';
+
+	if (strcmp(buf, "ok") == 0) {
+		return true;
+	}
+	const char prefix[] = "error ";
+	if (strncmp(buf, prefix, strlen(prefix)) == 0) {
+		fprintf(stderr, "daemon: %s\n", buf + strlen(prefix));
+	} else {
+		fprintf(stderr, "invalid reply from the daemon\n");
+	}
+	return false;
+}
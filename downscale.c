@@ -0,0 +1,416 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "downscale.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#else
+#define HAVE_NEON_KERNELS 0
+#endif
+
+// Area filter weights of a destination pixel sum to 1 << WEIGHT_BITS
+#define WEIGHT_BITS 14
+// Larger boxes go through the area filter, where their rounding is exact
+#define BOX_MAX_PIXELS 64
+
+bool is_downscale_format_supported(pixman_format_code_t format) {
+	return PIXMAN_FORMAT_BPP(format) == 32 &&
+		PIXMAN_FORMAT_R(format) == 8 && PIXMAN_FORMAT_G(format) == 8 &&
+		PIXMAN_FORMAT_B(format) == 8 &&
+		(PIXMAN_FORMAT_A(format) == 8 || PIXMAN_FORMAT_A(format) == 0);
+}
+
+/**
+ * Source pixels covered by each destination pixel along an axis, with
+ * their weights.
+ */
+struct grim_area_axis {
+	int max_taps;
+	int *first, *n_taps;
+	uint32_t *weights; // max_taps per destination pixel
+};
+
+static void sum_rows_scalar(uint16_t *sums, const uint8_t *const *rows,
+		int n_rows, size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) {
+		sums[i] = rows[0][i];
+	}
+	for (int r = 1; r < n_rows; r++) {
+		for (size_t i = from; i < to; i++) {
+			sums[i] += rows[r][i];
+		}
+	}
+}
+
+static void accumulate_row_scalar(uint32_t *acc, const uint8_t *row,
+		uint16_t weight, size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) {
+		acc[i] += (uint32_t)weight * row[i];
+	}
+}
+
+/**
+ * Filters a row of vertically filtered pixels horizontally. They are
+ * brought down to 8 fractional bits first, so that the sums fit in 32 bits.
+ */
+static void area_row_scalar(uint8_t *out, const uint32_t *col,
+		const struct grim_area_axis *axis, int from, int to) {
+	for (int x = from; x < to; x++) {
+		const uint32_t *p = col + 4 * axis->first[x];
+		const uint32_t *w = &axis->weights[(size_t)x * axis->max_taps];
+		uint32_t c[4] = {0};
+		for (int t = 0; t < axis->n_taps[x]; t++) {
+			for (int i = 0; i < 4; i++) {
+				c[i] += w[t] * ((p[4 * t + i] + (1 << (WEIGHT_BITS - 9))) >>
+					(WEIGHT_BITS - 8));
+			}
+		}
+		for (int i = 0; i < 4; i++) {
+			out[4 * x + i] = (c[i] + (1 << (WEIGHT_BITS + 7))) >>
+				(WEIGHT_BITS + 8);
+		}
+	}
+}
+
+#if HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static void sum_rows_avx2(uint16_t *sums, const uint8_t *const *rows,
+		int n_rows, size_t from, size_t to) {
+	size_t i = from;
+	for (; i + 16 <= to; i += 16) {
+		__m256i acc = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i *)(rows[0] + i)));
+		for (int r = 1; r < n_rows; r++) {
+			acc = _mm256_add_epi16(acc, _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((const __m128i *)(rows[r] + i))));
+		}
+		_mm256_storeu_si256((__m256i *)(sums + i), acc);
+	}
+	sum_rows_scalar(sums, rows, n_rows, i, to);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_row_avx2(uint32_t *acc, const uint8_t *row,
+		uint16_t weight, size_t from, size_t to) {
+	// The high halves of both operands are zero, so each 32-bit lane gets
+	// a single product
+	const __m256i w = _mm256_set1_epi32(weight);
+	size_t i = from;
+	for (; i + 8 <= to; i += 8) {
+		__m256i v = _mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i *)(row + i)));
+		__m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+		a = _mm256_add_epi32(a, _mm256_madd_epi16(v, w));
+		_mm256_storeu_si256((__m256i *)(acc + i), a);
+	}
+	accumulate_row_scalar(acc, row, weight, i, to);
+}
+
+__attribute__((target("avx2")))
+static void area_row_avx2(uint8_t *out, const uint32_t *col,
+		const struct grim_area_axis *axis, int from, int to) {
+	const __m128i round_col = _mm_set1_epi32(1 << (WEIGHT_BITS - 9));
+	const __m128i round_out = _mm_set1_epi32(1 << (WEIGHT_BITS + 7));
+	for (int x = from; x < to; x++) {
+		const uint32_t *p = col + 4 * axis->first[x];
+		const uint32_t *w = &axis->weights[(size_t)x * axis->max_taps];
+		__m128i c = _mm_setzero_si128();
+		for (int t = 0; t < axis->n_taps[x]; t++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + 4 * t));
+			v = _mm_srli_epi32(_mm_add_epi32(v, round_col), WEIGHT_BITS - 8);
+			c = _mm_add_epi32(c, _mm_mullo_epi32(v, _mm_set1_epi32(w[t])));
+		}
+		c = _mm_srli_epi32(_mm_add_epi32(c, round_out), WEIGHT_BITS + 8);
+		c = _mm_packus_epi16(_mm_packus_epi32(c, c), c);
+		int32_t pixel = _mm_cvtsi128_si32(c);
+		memcpy(out + 4 * x, &pixel, sizeof(pixel));
+	}
+}
+
+// Each pixel of out is the sum of two pixels of sums, divided by 1 << shift
+__attribute__((target("avx2")))
+static int reduce_pairs_avx2(uint8_t *out, const uint16_t *sums, int width,
+		int shift) {
+	const __m256i round = _mm256_set1_epi16(1 << (shift - 1));
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(sums + 8 * x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(sums + 8 * x + 16));
+		// The low half of each lane gets the sum of its two pixels
+		a = _mm256_add_epi16(a, _mm256_srli_si256(a, 8));
+		b = _mm256_add_epi16(b, _mm256_srli_si256(b, 8));
+		__m256i s = _mm256_unpacklo_epi64(a, b);
+		s = _mm256_srl_epi16(_mm256_add_epi16(s, round), count);
+		s = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(s, s), order);
+		_mm_storeu_si128((__m128i *)(out + 4 * x), _mm256_castsi256_si128(s));
+	}
+	return x;
+}
+#endif
+
+#if HAVE_NEON_KERNELS
+static void sum_rows_neon(uint16_t *sums, const uint8_t *const *rows,
+		int n_rows, size_t from, size_t to) {
+	size_t i = from;
+	for (; i + 16 <= to; i += 16) {
+		uint8x16_t v = vld1q_u8(rows[0] + i);
+		uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+		uint16x8_t hi = vmovl_high_u8(v);
+		for (int r = 1; r < n_rows; r++) {
+			v = vld1q_u8(rows[r] + i);
+			lo = vaddw_u8(lo, vget_low_u8(v));
+			hi = vaddw_high_u8(hi, v);
+		}
+		vst1q_u16(sums + i, lo);
+		vst1q_u16(sums + i + 8, hi);
+	}
+	sum_rows_scalar(sums, rows, n_rows, i, to);
+}
+
+static void accumulate_row_neon(uint32_t *acc, const uint8_t *row,
+		uint16_t weight, size_t from, size_t to) {
+	size_t i = from;
+	for (; i + 8 <= to; i += 8) {
+		uint16x8_t v = vmovl_u8(vld1_u8(row + i));
+		uint32x4_t lo = vmlal_n_u16(vld1q_u32(acc + i), vget_low_u16(v), weight);
+		uint32x4_t hi = vmlal_high_n_u16(vld1q_u32(acc + i + 4), v, weight);
+		vst1q_u32(acc + i, lo);
+		vst1q_u32(acc + i + 4, hi);
+	}
+	accumulate_row_scalar(acc, row, weight, i, to);
+}
+#endif
+
+static struct {
+	void (*sum_rows)(uint16_t *sums, const uint8_t *const *rows,
+		int n_rows, size_t from, size_t to);
+	// Returns how many pixels were written, NULL if not accelerated
+	int (*reduce_pairs)(uint8_t *out, const uint16_t *sums, int width,
+		int shift);
+	void (*accumulate_row)(uint32_t *acc, const uint8_t *row,
+		uint16_t weight, size_t from, size_t to);
+	void (*area_row)(uint8_t *out, const uint32_t *col,
+		const struct grim_area_axis *axis, int from, int to);
+} downscale_funcs = {
+	.sum_rows = sum_rows_scalar,
+	.accumulate_row = accumulate_row_scalar,
+	.area_row = area_row_scalar,
+};
+static pthread_once_t downscale_funcs_once = PTHREAD_ONCE_INIT;
+
+static void init_downscale_funcs(void) {
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		downscale_funcs.sum_rows = sum_rows_avx2;
+		downscale_funcs.reduce_pairs = reduce_pairs_avx2;
+		downscale_funcs.accumulate_row = accumulate_row_avx2;
+		downscale_funcs.area_row = area_row_avx2;
+	}
+#elif HAVE_NEON_KERNELS
+	downscale_funcs.sum_rows = sum_rows_neon;
+	downscale_funcs.accumulate_row = accumulate_row_neon;
+#endif
+}
+
+/**
+ * Averages blocks of kx by the number of summed rows pixels, n in total.
+ * mul is 2^24 / n rounded up, so that halves round up like the shifts of
+ * the SIMD kernels.
+ */
+static void reduce_row(uint8_t *out, const uint16_t *sums, int kx, int width,
+		uint32_t mul, int from) {
+	for (int x = from; x < width; x++) {
+		const uint16_t *p = sums + 4 * x * kx;
+		uint32_t c[4] = {0};
+		for (int t = 0; t < kx; t++) {
+			for (int i = 0; i < 4; i++) {
+				c[i] += p[4 * t + i];
+			}
+		}
+		for (int i = 0; i < 4; i++) {
+			out[4 * x + i] = ((uint64_t)c[i] * mul + (1 << 23)) >> 24;
+		}
+	}
+}
+
+static bool box_rows(const uint8_t *src, int src_stride,
+		uint8_t *dest, int dest_width, int dest_stride, int kx, int ky,
+		int y1, int y2) {
+	size_t len = (size_t)4 * dest_width * kx;
+	uint16_t *sums = malloc(len * sizeof(uint16_t));
+	if (sums == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	int n = kx * ky;
+	uint32_t mul = ((1 << 24) + n - 1) / n;
+	// Sums of 2 pixels are divided by a shift if n is a power of two
+	int shift = -1;
+	if (kx == 2 && (ky & (ky - 1)) == 0) {
+		shift = 1;
+		while ((1 << shift) < n) {
+			shift++;
+		}
+	}
+
+	const uint8_t *rows[BOX_MAX_PIXELS];
+	for (int y = y1; y < y2; y++) {
+		for (int r = 0; r < ky; r++) {
+			rows[r] = src + (size_t)(y * ky + r) * src_stride;
+		}
+		downscale_funcs.sum_rows(sums, rows, ky, 0, len);
+
+		uint8_t *out = dest + (size_t)y * dest_stride;
+		int x = 0;
+		if (shift > 0 && downscale_funcs.reduce_pairs != NULL) {
+			x = downscale_funcs.reduce_pairs(out, sums, dest_width, shift);
+		}
+		reduce_row(out, sums, kx, dest_width, mul, x);
+	}
+
+	free(sums);
+	return true;
+}
+
+static void get_area_taps(const struct grim_area_axis *axis, double ratio,
+		int src_size, int i, int *first, int *n_taps, uint32_t *weights) {
+	double x0 = i * ratio;
+	double x1 = fmin((i + 1) * ratio, src_size);
+	int a = floor(x0);
+	int b = ceil(x1);
+	if (b - a > axis->max_taps) {
+		b = a + axis->max_taps;
+	}
+
+	int32_t total = 0;
+	int largest = 0;
+	for (int j = a; j < b; j++) {
+		double overlap = fmin(x1, j + 1) - fmax(x0, j);
+		weights[j - a] = lround(overlap / (x1 - x0) * (1 << WEIGHT_BITS));
+		total += weights[j - a];
+		if (weights[j - a] > weights[largest]) {
+			largest = j - a;
+		}
+	}
+	// Don't let rounding brighten or darken the image
+	weights[largest] += (1 << WEIGHT_BITS) - total;
+
+	*first = a;
+	*n_taps = b - a;
+}
+
+static bool init_area_axis(struct grim_area_axis *axis, int src_size,
+		int dest_size, int from, int to) {
+	double ratio = (double)src_size / dest_size;
+	axis->max_taps = (int)ceil(ratio) + 1;
+	axis->first = calloc(to - from, sizeof(int));
+	axis->n_taps = calloc(to - from, sizeof(int));
+	axis->weights = calloc((size_t)(to - from) * axis->max_taps,
+		sizeof(uint32_t));
+	if (axis->first == NULL || axis->n_taps == NULL ||
+			axis->weights == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+	for (int i = from; i < to; i++) {
+		get_area_taps(axis, ratio, src_size, i, &axis->first[i - from],
+			&axis->n_taps[i - from],
+			&axis->weights[(size_t)(i - from) * axis->max_taps]);
+	}
+	return true;
+}
+
+static void finish_area_axis(struct grim_area_axis *axis) {
+	free(axis->first);
+	free(axis->n_taps);
+	free(axis->weights);
+}
+
+static bool area_rows(const uint8_t *src, int src_width, int src_height,
+		int src_stride, uint8_t *dest, int dest_width, int dest_height,
+		int dest_stride, int y1, int y2) {
+	struct grim_area_axis x_axis = {0}, y_axis = {0};
+	size_t len = (size_t)4 * src_width;
+	uint32_t *col = malloc(len * sizeof(uint32_t));
+	bool ok = col != NULL &&
+		init_area_axis(&x_axis, src_width, dest_width, 0, dest_width) &&
+		init_area_axis(&y_axis, src_height, dest_height, y1, y2);
+	if (!ok) {
+		if (col == NULL) {
+			fprintf(stderr, "allocation failed\n");
+		}
+		goto out;
+	}
+
+	// Filtering vertically first goes through the source once, in wide
+	// rows, and leaves a single row per destination row to filter
+	// horizontally
+	for (int y = y1; y < y2; y++) {
+		int i = y - y1;
+		const uint32_t *w = &y_axis.weights[(size_t)i * y_axis.max_taps];
+		for (size_t j = 0; j < len; j++) {
+			col[j] = 0;
+		}
+		for (int t = 0; t < y_axis.n_taps[i]; t++) {
+			if (w[t] == 0) {
+				continue;
+			}
+			downscale_funcs.accumulate_row(col,
+				src + (size_t)(y_axis.first[i] + t) * src_stride, w[t],
+				0, len);
+		}
+		downscale_funcs.area_row(dest + (size_t)y * dest_stride, col,
+			&x_axis, 0, dest_width);
+	}
+
+out:
+	finish_area_axis(&x_axis);
+	finish_area_axis(&y_axis);
+	free(col);
+	return ok;
+}
+
+bool downscale_rows(pixman_image_t *src, pixman_image_t *dest,
+		int y1, int y2) {
+	pthread_once(&downscale_funcs_once, init_downscale_funcs);
+
+	int src_width = pixman_image_get_width(src);
+	int src_height = pixman_image_get_height(src);
+	int src_stride = pixman_image_get_stride(src);
+	const uint8_t *src_data = (const uint8_t *)pixman_image_get_data(src);
+	int dest_width = pixman_image_get_width(dest);
+	int dest_height = pixman_image_get_height(dest);
+	int dest_stride = pixman_image_get_stride(dest);
+	uint8_t *dest_data = (uint8_t *)pixman_image_get_data(dest);
+	if (y1 >= y2 || dest_width == 0) {
+		return true;
+	}
+
+	if (src_width % dest_width == 0 && src_height % dest_height == 0) {
+		int kx = src_width / dest_width;
+		int ky = src_height / dest_height;
+		if (kx * ky <= BOX_MAX_PIXELS) {
+			return box_rows(src_data, src_stride, dest_data,
+				dest_width, dest_stride, kx, ky, y1, y2);
+		}
+	}
+	return area_rows(src_data, src_width, src_height, src_stride,
+		dest_data, dest_width, dest_height, dest_stride, y1, y2);
+}
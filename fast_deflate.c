@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fast_deflate.h"
+
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_BITS 15
+#define MAX_CL_BITS 7
+#define N_LITLEN 286
+#define N_DIST 30
+#define N_CL 19
+#define BLOCK_SYMBOLS (1 << 16)
+
+// Symbols are stored as literals, or as match lengths with a flag telling
+// which of the two distances is used
+#define SYMBOL_MATCH (1u << 31)
+#define SYMBOL_ROW (1u << 30)
+
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[N_DIST] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+	16385, 24577,
+};
+static const uint8_t dist_extra[N_DIST] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+static const uint8_t cl_order[N_CL] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+struct bit_writer {
+	uint8_t *data;
+	size_t len;
+	uint64_t bits;
+	int n_bits;
+};
+
+static inline void put_bits(struct bit_writer *w, uint32_t value, int n) {
+	w->bits |= (uint64_t)value << w->n_bits;
+	w->n_bits += n;
+	if (w->n_bits >= 32) {
+		uint32_t v = w->bits;
+		w->data[w->len++] = v;
+		w->data[w->len++] = v >> 8;
+		w->data[w->len++] = v >> 16;
+		w->data[w->len++] = v >> 24;
+		w->bits >>= 32;
+		w->n_bits -= 32;
+	}
+}
+
+static void align_bits(struct bit_writer *w) {
+	while (w->n_bits > 0) {
+		w->data[w->len++] = w->bits;
+		w->bits >>= 8;
+		w->n_bits = w->n_bits > 8 ? w->n_bits - 8 : 0;
+	}
+	w->bits = 0;
+}
+
+struct huffman {
+	uint8_t lengths[N_LITLEN];
+	uint16_t codes[N_LITLEN]; // bit-reversed, deflate writes them LSB first
+};
+
+struct tree_node {
+	uint32_t freq;
+	int16_t left, right; // negative for leaves
+};
+
+static int compare_freq(const void *a, const void *b) {
+	const struct tree_node *na = a, *nb = b;
+	return (na->freq > nb->freq) - (na->freq < nb->freq);
+}
+
+static void get_depths(const struct tree_node *nodes, int node, int depth,
+		uint8_t *lengths) {
+	if (nodes[node].left < 0) {
+		lengths[-nodes[node].left - 1] = depth;
+		return;
+	}
+	get_depths(nodes, nodes[node].left, depth + 1, lengths);
+	get_depths(nodes, nodes[node].right, depth + 1, lengths);
+}
+
+/**
+ * Computes Huffman code lengths of at most max_bits. Frequencies are
+ * flattened until the tree is shallow enough, which is good enough for
+ * the few blocks where that's needed.
+ */
+static void build_lengths(const uint32_t *freqs, int n, int max_bits,
+		uint8_t *lengths) {
+	uint32_t scaled[N_LITLEN];
+	memcpy(scaled, freqs, n * sizeof(uint32_t));
+
+	// Decoders expect at least two codes
+	int n_used = 0;
+	for (int i = 0; i < n; i++) {
+		n_used += scaled[i] != 0;
+	}
+	for (int i = 0; i < n && n_used < 2; i++) {
+		if (scaled[i] == 0) {
+			scaled[i] = 1;
+			n_used++;
+		}
+	}
+
+	while (true) {
+		// Leaves sorted by frequency, then internal nodes which are
+		// created in increasing frequency order: two queues are enough
+		struct tree_node nodes[2 * N_LITLEN];
+		int n_leaves = 0;
+		for (int i = 0; i < n; i++) {
+			if (scaled[i] != 0) {
+				nodes[n_leaves++] = (struct tree_node){
+					.freq = scaled[i],
+					.left = -i - 1,
+					.right = -i - 1,
+				};
+			}
+		}
+		qsort(nodes, n_leaves, sizeof(struct tree_node), compare_freq);
+
+		int leaf = 0, internal = n_leaves, n_nodes = n_leaves;
+		while (n_nodes - internal + n_leaves - leaf > 1) {
+			int children[2];
+			for (int c = 0; c < 2; c++) {
+				if (leaf < n_leaves && (internal == n_nodes ||
+						nodes[leaf].freq <= nodes[internal].freq)) {
+					children[c] = leaf++;
+				} else {
+					children[c] = internal++;
+				}
+			}
+			nodes[n_nodes++] = (struct tree_node){
+				.freq = nodes[children[0]].freq + nodes[children[1]].freq,
+				.left = children[0],
+				.right = children[1],
+			};
+		}
+
+		memset(lengths, 0, n);
+		get_depths(nodes, n_nodes - 1, 0, lengths);
+
+		int max_len = 0;
+		for (int i = 0; i < n; i++) {
+			max_len = lengths[i] > max_len ? lengths[i] : max_len;
+		}
+		if (max_len <= max_bits) {
+			return;
+		}
+		for (int i = 0; i < n; i++) {
+			if (scaled[i] != 0) {
+				scaled[i] = (scaled[i] >> 1) | 1;
+			}
+		}
+	}
+}
+
+static void build_codes(struct huffman *h, int n) {
+	uint16_t bl_count[MAX_BITS + 1] = {0};
+	for (int i = 0; i < n; i++) {
+		bl_count[h->lengths[i]]++;
+	}
+	bl_count[0] = 0;
+
+	uint16_t next_code[MAX_BITS + 1] = {0};
+	uint16_t code = 0;
+	for (int bits = 1; bits <= MAX_BITS; bits++) {
+		code = (code + bl_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+
+	for (int i = 0; i < n; i++) {
+		int len = h->lengths[i];
+		if (len == 0) {
+			continue;
+		}
+		uint16_t c = next_code[len]++;
+		uint16_t reversed = 0;
+		for (int b = 0; b < len; b++) {
+			reversed = (reversed << 1) | ((c >> b) & 1);
+		}
+		h->codes[i] = reversed;
+	}
+}
+
+static int get_length_code(size_t len) {
+	int code = 0;
+	while (code < 28 && length_base[code + 1] <= len) {
+		code++;
+	}
+	return code;
+}
+
+static int get_dist_code(size_t dist) {
+	int code = 0;
+	while (code < N_DIST - 1 && dist_base[code + 1] <= dist) {
+		code++;
+	}
+	return code;
+}
+
+struct fast_deflate {
+	struct bit_writer writer;
+	uint32_t *symbols;
+	size_t n_symbols;
+	size_t row_len;
+	int row_dist_code;
+	uint8_t length_codes[MAX_MATCH + 1];
+};
+
+static void write_block_header(struct fast_deflate *d, struct huffman *litlen,
+		int n_litlen, struct huffman *dist, int n_dist, bool final) {
+	struct bit_writer *w = &d->writer;
+
+	// Run-length encode both sets of code lengths together
+	uint8_t lengths[N_LITLEN + N_DIST];
+	memcpy(lengths, litlen->lengths, n_litlen);
+	memcpy(lengths + n_litlen, dist->lengths, n_dist);
+	int n_lengths = n_litlen + n_dist;
+
+	uint16_t cl_symbols[N_LITLEN + N_DIST]; // symbol | extra << 8
+	int n_cl_symbols = 0;
+	uint32_t cl_freqs[N_CL] = {0};
+	for (int i = 0; i < n_lengths;) {
+		int run = 1;
+		while (i + run < n_lengths && lengths[i + run] == lengths[i]) {
+			run++;
+		}
+		int used;
+		uint16_t symbol;
+		if (lengths[i] == 0 && run >= 11) {
+			used = run > 138 ? 138 : run;
+			symbol = 18 | (used - 11) << 8;
+		} else if (lengths[i] == 0 && run >= 3) {
+			used = run;
+			symbol = 17 | (used - 3) << 8;
+		} else if (i > 0 && lengths[i - 1] == lengths[i] && run >= 3) {
+			used = run > 6 ? 6 : run;
+			symbol = 16 | (used - 3) << 8;
+		} else {
+			used = 1;
+			symbol = lengths[i];
+		}
+		cl_symbols[n_cl_symbols++] = symbol;
+		cl_freqs[symbol & 0xff]++;
+		i += used;
+	}
+
+	struct huffman cl = {0};
+	build_lengths(cl_freqs, N_CL, MAX_CL_BITS, cl.lengths);
+	build_codes(&cl, N_CL);
+	int n_cl = N_CL;
+	while (n_cl > 4 && cl.lengths[cl_order[n_cl - 1]] == 0) {
+		n_cl--;
+	}
+
+	put_bits(w, final, 1);
+	put_bits(w, 2, 2); // dynamic Huffman codes
+	put_bits(w, n_litlen - 257, 5);
+	put_bits(w, n_dist - 1, 5);
+	put_bits(w, n_cl - 4, 4);
+	for (int i = 0; i < n_cl; i++) {
+		put_bits(w, cl.lengths[cl_order[i]], 3);
+	}
+	for (int i = 0; i < n_cl_symbols; i++) {
+		int symbol = cl_symbols[i] & 0xff;
+		int extra = cl_symbols[i] >> 8;
+		put_bits(w, cl.codes[symbol], cl.lengths[symbol]);
+		if (symbol == 16) {
+			put_bits(w, extra, 2);
+		} else if (symbol == 17) {
+			put_bits(w, extra, 3);
+		} else if (symbol == 18) {
+			put_bits(w, extra, 7);
+		}
+	}
+}
+
+static void flush_block(struct fast_deflate *d, bool final) {
+	uint32_t litlen_freqs[N_LITLEN] = {0};
+	uint32_t dist_freqs[N_DIST] = {0};
+	for (size_t i = 0; i < d->n_symbols; i++) {
+		uint32_t symbol = d->symbols[i];
+		if (symbol & SYMBOL_MATCH) {
+			size_t len = symbol & 0xffff;
+			litlen_freqs[257 + d->length_codes[len]]++;
+			dist_freqs[symbol & SYMBOL_ROW ? d->row_dist_code : 0]++;
+		} else {
+			litlen_freqs[symbol]++;
+		}
+	}
+	litlen_freqs[256] = 1; // end of block
+
+	struct huffman litlen = {0}, dist = {0};
+	build_lengths(litlen_freqs, N_LITLEN, MAX_BITS, litlen.lengths);
+	build_codes(&litlen, N_LITLEN);
+	build_lengths(dist_freqs, N_DIST, MAX_BITS, dist.lengths);
+	build_codes(&dist, N_DIST);
+
+	int n_litlen = N_LITLEN;
+	while (n_litlen > 257 && litlen.lengths[n_litlen - 1] == 0) {
+		n_litlen--;
+	}
+	int n_dist = N_DIST;
+	while (n_dist > 1 && dist.lengths[n_dist - 1] == 0) {
+		n_dist--;
+	}
+	write_block_header(d, &litlen, n_litlen, &dist, n_dist, final);
+
+	struct bit_writer *w = &d->writer;
+	int row_dist_code = d->row_dist_code;
+	uint32_t row_dist_extra = d->row_len - dist_base[row_dist_code];
+	for (size_t i = 0; i < d->n_symbols; i++) {
+		uint32_t symbol = d->symbols[i];
+		if (!(symbol & SYMBOL_MATCH)) {
+			put_bits(w, litlen.codes[symbol], litlen.lengths[symbol]);
+			continue;
+		}
+
+		size_t len = symbol & 0xffff;
+		int code = d->length_codes[len];
+		put_bits(w, litlen.codes[257 + code], litlen.lengths[257 + code]);
+		put_bits(w, len - length_base[code], length_extra[code]);
+		if (symbol & SYMBOL_ROW) {
+			put_bits(w, dist.codes[row_dist_code], dist.lengths[row_dist_code]);
+			put_bits(w, row_dist_extra, dist_extra[row_dist_code]);
+		} else {
+			put_bits(w, dist.codes[0], dist.lengths[0]);
+		}
+	}
+	put_bits(w, litlen.codes[256], litlen.lengths[256]);
+
+	d->n_symbols = 0;
+}
+
+static inline size_t get_match_length(const uint8_t *a, const uint8_t *b,
+		size_t max) {
+	size_t n = 0;
+	while (n + 8 <= max) {
+		uint64_t va, vb;
+		memcpy(&va, a + n, 8);
+		memcpy(&vb, b + n, 8);
+		uint64_t diff = va ^ vb;
+		if (diff != 0) {
+#if GRIM_LITTLE_ENDIAN
+			return n + (__builtin_ctzll(diff) >> 3);
+#else
+			return n + (__builtin_clzll(diff) >> 3);
+#endif
+		}
+		n += 8;
+	}
+	while (n < max && a[n] == b[n]) {
+		n++;
+	}
+	return n;
+}
+
+bool fast_deflate(const uint8_t *data, size_t len, size_t dict_len,
+		size_t row_len, bool last, uint8_t **out, size_t *out_len) {
+	struct fast_deflate d = {
+		.row_len = row_len,
+		.row_dist_code = get_dist_code(row_len),
+	};
+	for (size_t i = MIN_MATCH; i <= MAX_MATCH; i++) {
+		d.length_codes[i] = get_length_code(i);
+	}
+
+	// Literals take at most 15 bits, plus a header per block
+	size_t n_blocks = len / BLOCK_SYMBOLS + 1;
+	size_t capacity = 2 * len + 512 * n_blocks + 64;
+	d.writer.data = malloc(capacity);
+	d.symbols = malloc(BLOCK_SYMBOLS * sizeof(uint32_t));
+	if (d.writer.data == NULL || d.symbols == NULL) {
+		fprintf(stderr, "failed to allocate deflate buffers\n");
+		free(d.writer.data);
+		free(d.symbols);
+		return false;
+	}
+
+	bool use_rows = row_len <= WINDOW_SIZE;
+	size_t i = 0;
+	while (i < len) {
+		size_t max = len - i < MAX_MATCH ? len - i : MAX_MATCH;
+		size_t best = 0;
+		uint32_t symbol = 0;
+		if (use_rows && i + dict_len >= row_len) {
+			best = get_match_length(data + i, data + i - row_len, max);
+			symbol = SYMBOL_ROW;
+		}
+		if (best < max && i + dict_len >= 1) {
+			size_t run = get_match_length(data + i, data + i - 1, max);
+			if (run > best) {
+				best = run;
+				symbol = 0;
+			}
+		}
+
+		if (best >= MIN_MATCH) {
+			d.symbols[d.n_symbols++] = SYMBOL_MATCH | symbol | best;
+			i += best;
+		} else {
+			d.symbols[d.n_symbols++] = data[i];
+			i++;
+		}
+
+		if (d.n_symbols == BLOCK_SYMBOLS) {
+			flush_block(&d, last && i == len);
+		}
+	}
+	if (d.n_symbols > 0 || (last && len == 0)) {
+		flush_block(&d, last);
+	}
+
+	if (!last) {
+		// Empty stored block, which ends on a byte boundary
+		put_bits(&d.writer, 0, 3);
+		align_bits(&d.writer);
+		d.writer.data[d.writer.len++] = 0x00;
+		d.writer.data[d.writer.len++] = 0x00;
+		d.writer.data[d.writer.len++] = 0xff;
+		d.writer.data[d.writer.len++] = 0xff;
+	} else {
+		align_bits(&d.writer);
+	}
+
+	free(d.symbols);
+	*out = d.writer.data;
+	*out_len = d.writer.len;
+	return true;
+}
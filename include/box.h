@@ -12,5 +12,9 @@ struct grim_box {
 bool parse_box(struct grim_box *box, const char *str);
 bool is_empty_box(struct grim_box *box);
 bool intersect_box(struct grim_box *a, struct grim_box *b);
+bool get_box_intersection(struct grim_box *a, struct grim_box *b,
+	struct grim_box *intersection);
+void get_box_union(struct grim_box *a, struct grim_box *b,
+	struct grim_box *result);
 
 #endif
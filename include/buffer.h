@@ -1,9 +1,27 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
 
+#include <stdbool.h>
 #include <wayland-client.h>
 
+/**
+ * A single anonymous shared memory file, from which the buffers of all
+ * captures are sub-allocated.
+ */
+struct grim_shm_pool {
+	struct wl_shm *shm;
+	struct wl_shm_pool *wl_pool;
+	int fd;
+	void *data;
+	size_t size; // mapped size
+	struct wl_list buffers; // grim_buffer.link, ordered by offset
+};
+
 struct grim_buffer {
+	struct grim_shm_pool *pool;
+	struct wl_list link;
+	size_t offset;
+
 	struct wl_buffer *wl_buffer;
 	void *data;
 	int32_t width, height, stride;
@@ -11,8 +29,22 @@ struct grim_buffer {
 	enum wl_shm_format format;
 };
 
-struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
-	int32_t width, int32_t height, int32_t stride);
+struct grim_shm_pool *create_shm_pool(struct wl_shm *shm, size_t size);
+/**
+ * Grow the pool to at least `size` bytes. Buffers already allocated from the
+ * pool are remapped.
+ */
+bool shm_pool_reserve(struct grim_shm_pool *pool, size_t size);
+void destroy_shm_pool(struct grim_shm_pool *pool);
+
+struct grim_buffer *create_buffer(struct grim_shm_pool *pool,
+	enum wl_shm_format format, int32_t width, int32_t height, int32_t stride);
+/**
+ * Frees the memory backing the contents of a buffer which won't be read
+ * again, without destroying it. The contents read as zeroes afterwards,
+ * until the compositor copies a frame into it again.
+ */
+void discard_buffer_data(struct grim_buffer *buffer);
 void destroy_buffer(struct grim_buffer *buffer);
 
 #endif
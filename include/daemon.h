@@ -0,0 +1,50 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "grim.h"
+
+/**
+ * Returns the path of the daemon socket: $GRIM_SOCKET, or a socket named
+ * after the Wayland display in $XDG_RUNTIME_DIR.
+ */
+char *get_daemon_socket_path(void);
+
+/**
+ * Parses a "key value" line of a request. The strings of the request point
+ * into line.
+ */
+bool parse_request_line(struct grim_request *request, char *line);
+
+// How long a destination may refuse data before the daemon gives up on it
+#define DAEMON_WRITE_TIMEOUT_MS 5000
+
+int daemon_listen(const char *socket_path);
+/**
+ * Accepts a client, or returns -1 if it fails or the client belongs to
+ * another user.
+ */
+int daemon_accept(int listen_fd);
+/**
+ * Reads a request from a client. The strings of the request point into buf,
+ * the file descriptor to write the image to is returned in dest_fd.
+ */
+bool daemon_read_request(int fd, char *buf, size_t buf_size,
+	struct grim_request *request, int *dest_fd);
+void daemon_send_reply(int fd, const char *error);
+/**
+ * Opens the destination of a request for writing. Writes fail once it
+ * accepts no data for DAEMON_WRITE_TIMEOUT_MS. Closing the stream closes
+ * dest_fd.
+ */
+FILE *daemon_open_dest(int dest_fd);
+
+int daemon_connect(const char *socket_path);
+bool daemon_send_request(int fd, const struct grim_request *request,
+	int dest_fd);
+bool daemon_read_reply(int fd);
+
+#endif
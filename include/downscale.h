@@ -0,0 +1,27 @@
+#ifndef _DOWNSCALE_H
+#define _DOWNSCALE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+
+/**
+ * Returns whether images of this format can be downscaled: 32-bit pixels
+ * with 8-bit channels, which are averaged independently. That is right for
+ * premultiplied alpha, and padding bytes are left meaningless.
+ */
+bool is_downscale_format_supported(pixman_format_code_t format);
+
+/**
+ * Fills the rows [y1, y2) of dest with the average of the src pixels each
+ * dest pixel covers. The ratio on each axis is given by the image sizes,
+ * and dest must not be larger than src on either. Exact integer ratios use
+ * a box filter, other ratios an area filter weighting the partially
+ * covered pixels.
+ *
+ * Both images must have the same supported format. Separate calls may fill
+ * separate rows of the same image concurrently.
+ */
+bool downscale_rows(pixman_image_t *src, pixman_image_t *dest,
+	int y1, int y2);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _FAST_DEFLATE_H
+#define _FAST_DEFLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compresses data to raw deflate blocks, looking for matches only at a
+ * distance of 1 byte (runs) and of row_len bytes (the previous row), which
+ * is where filtered screenshot rows repeat. Up to dict_len bytes before data
+ * may be referenced.
+ *
+ * Unless last is set, the final block isn't marked as such and the output
+ * ends with an empty stored block, like a zlib sync flush, so that it can be
+ * followed by more blocks.
+ */
+bool fast_deflate(const uint8_t *data, size_t len, size_t dict_len,
+	size_t row_len, bool last, uint8_t **out, size_t *out_len);
+
+#endif
@@ -1,20 +1,35 @@
 #ifndef _GRIM_H
 #define _GRIM_H
 
+#include <pixman.h>
+#include <time.h>
 #include <wayland-client.h>
 
 #include "box.h"
+#include "write_y4m.h"
 
 enum grim_filetype {
 	GRIM_FILETYPE_PNG,
 	GRIM_FILETYPE_PPM,
 	GRIM_FILETYPE_JPEG,
+	GRIM_FILETYPE_QOI,
+	GRIM_FILETYPE_RAW,
+	GRIM_FILETYPE_Y4M,
 };
 
+enum grim_filter {
+	GRIM_FILTER_QUALITY, // Lanczos when downscaling
+	GRIM_FILTER_FAST, // area average when downscaling
+};
+
+struct grim_capture;
+
 struct grim_state {
 	struct wl_display *display;
 	struct wl_registry *registry;
 	struct wl_shm *shm;
+	struct grim_shm_pool *shm_pool;
+	struct grim_pool *pool; // worker threads, NULL if single-threaded
 	struct zxdg_output_manager_v1 *xdg_output_manager;
 	struct ext_output_image_capture_source_manager_v1 *ext_output_image_capture_source_manager;
 	struct ext_foreign_toplevel_image_capture_source_manager_v1 *ext_foreign_toplevel_image_capture_source_manager;
@@ -27,6 +42,31 @@ struct grim_state {
 
 	struct wl_list captures;
 	size_t n_done;
+	bool failed;
+	// Called from the dispatch loop when a capture is ready, if set
+	void (*capture_ready)(struct grim_capture *capture, void *data);
+	void *capture_ready_data;
+};
+
+/**
+ * What to capture and how to encode it, from the command line or from a
+ * daemon client.
+ */
+struct grim_request {
+	double scale;
+	bool use_greatest_scale;
+	bool has_geometry;
+	struct grim_box geometry;
+	const char *output_name;
+	const char *toplevel_identifier;
+	bool with_cursor;
+
+	enum grim_filetype filetype;
+	int jpeg_quality;
+	int png_level;
+	struct grim_y4m_format y4m_format;
+	enum grim_filter filter;
+	int band_rows; // render and encode in bands of rows if > 0
 };
 
 struct grim_buffer;
@@ -35,6 +75,7 @@ struct grim_output {
 	struct grim_state *state;
 	struct wl_output *wl_output;
 	struct zxdg_output_v1 *xdg_output;
+	uint32_t global_name;
 	struct wl_list link;
 
 	int32_t fallback_x, fallback_y; // legacy position from wl_output.geometry
@@ -49,13 +90,17 @@ struct grim_output {
 
 struct grim_capture {
 	struct grim_state *state;
-	struct grim_output *output;
+	struct grim_output *output; // NULL for toplevels
+	bool output_removed; // output is NULL because it was removed
 	struct wl_list link;
 
 	enum wl_output_transform transform;
 	struct grim_box logical_geometry;
+	bool with_cursor;
 
 	struct grim_buffer *buffer;
+	pixman_region32_t damage; // buffer-local, since the previous frame
+	struct timespec presentation_time; // zero if not reported
 
 	struct ext_image_copy_capture_session_v1 *ext_image_copy_capture_session;
 	struct ext_image_copy_capture_frame_v1 *ext_image_copy_capture_frame;
@@ -72,6 +117,7 @@ struct grim_toplevel {
 	struct wl_list link;
 
 	char *identifier;
+	char *title, *app_id; // NULL if not sent
 };
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef _PACK_H
+#define _PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Kernels converting rows of native-endian premultiplied ARGB pixels, as
+ * rendered by grim, to the byte order of image files.
+ */
+struct grim_pack_funcs {
+	bool (*is_opaque)(const uint32_t *row, size_t width);
+	void (*pack_rgb)(uint8_t *out, const uint32_t *row, size_t width);
+	// Unpremultiplies pixels with a fractional alpha
+	void (*pack_rgba)(uint8_t *out, const uint32_t *row, size_t width);
+};
+
+/**
+ * Returns the fastest kernels supported by the CPU.
+ */
+const struct grim_pack_funcs *get_pack_funcs(void);
+
+/**
+ * Sets funcs to every kernel set supported by the CPU and returns their
+ * count. The first one is the scalar reference, the last one is what
+ * get_pack_funcs() returns.
+ */
+size_t get_supported_pack_funcs(const struct grim_pack_funcs ***funcs);
+
+#endif
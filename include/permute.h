@@ -0,0 +1,19 @@
+#ifndef _PERMUTE_H
+#define _PERMUTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Copies a block of 32-bit pixels where each destination pixel comes from a
+ * single source pixel, like outputs rotated by a multiple of 90 degrees or
+ * flipped, at a unit scale. Destination pixel (x, y) is
+ * src[x * x_step + y * y_step], where one of the steps is 1 or -1 and the
+ * other a row stride, in pixels. alpha is ORed into each pixel, to fill the
+ * padding of formats without alpha.
+ */
+void copy_permuted(uint32_t *dest, ptrdiff_t dest_stride,
+	const uint32_t *src, ptrdiff_t x_step, ptrdiff_t y_step,
+	int width, int height, uint32_t alpha);
+
+#endif
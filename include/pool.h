@@ -0,0 +1,38 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*grim_task_func_t)(void *data);
+
+struct grim_pool;
+
+/**
+ * A set of tasks which can be waited on together.
+ */
+struct grim_task_group {
+	struct grim_pool *pool;
+	size_t pending;
+};
+
+/**
+ * Creates a pool running tasks on n_threads threads, including the waiting
+ * thread. Returns NULL if n_threads is 1 or less, in which case tasks run
+ * synchronously.
+ */
+struct grim_pool *create_pool(int n_threads);
+void destroy_pool(struct grim_pool *pool);
+int pool_get_threads(struct grim_pool *pool);
+int get_default_threads(void);
+
+void task_group_init(struct grim_task_group *group, struct grim_pool *pool);
+void task_group_submit(struct grim_task_group *group, grim_task_func_t func,
+	void *data);
+/**
+ * Waits for all tasks of the group, running queued tasks in the meantime.
+ * Tasks may submit and wait for groups of their own.
+ */
+void task_group_wait(struct grim_task_group *group);
+
+#endif
@@ -9,7 +9,61 @@
 bool is_format_supported(enum wl_shm_format fmt);
 uint32_t get_format_min_stride(enum wl_shm_format fmt, uint32_t width);
 
+/**
+ * Returns an image referencing the buffer of the only capture if it can be
+ * encoded as is, without rendering, or NULL otherwise. The image is only
+ * valid until the buffer is reused or destroyed.
+ *
+ * If transform isn't NULL, a buffer with a transform is also accepted, and
+ * its transform is stored there.
+ */
+pixman_image_t *get_capture_view(struct grim_state *state,
+	struct grim_box *geometry, double scale,
+	enum wl_output_transform *transform);
+/**
+ * Like get_capture_view(), for one capture among several, over its own
+ * logical geometry.
+ */
+pixman_image_t *get_single_capture_view(struct grim_capture *capture,
+	double scale, enum wl_output_transform *transform);
+/**
+ * Gets the size of the image render() makes for geometry and scale.
+ */
+void get_render_size(struct grim_box *geometry, double scale,
+	int *width, int *height);
+/**
+ * Renders the captures over geometry. filter picks how captures are
+ * downscaled, other scales always use a bilinear filter.
+ */
 pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
-	double scale);
+	double scale, enum grim_filter filter);
+/**
+ * Renders a single capture over its own logical geometry, leaving out the
+ * others.
+ */
+pixman_image_t *render_capture(struct grim_state *state,
+	struct grim_capture *capture, double scale, enum grim_filter filter);
+/**
+ * Receives a band of rows of the common image, in order. The image is only
+ * valid during the call. Returns false to stop rendering.
+ */
+typedef bool (*grim_band_func)(pixman_image_t *band, void *data);
+/**
+ * Like render(), but renders band_height rows at a time into a few band
+ * images, each passed to func while the next one is rendered, so that the
+ * common image is never held in memory as a whole. The buffers of the
+ * captures are discarded as soon as the remaining bands don't need them,
+ * their contents can't be used again.
+ */
+bool render_bands(struct grim_state *state, struct grim_box *geometry,
+	double scale, enum grim_filter filter, int band_height,
+	grim_band_func func, void *data);
+/**
+ * Re-render only the parts of a previously rendered common image covered by
+ * the captures' damage. `changed` is set to false if nothing was damaged.
+ */
+bool render_damage(struct grim_state *state, struct grim_box *geometry,
+	double scale, enum grim_filter filter, pixman_image_t *common_image,
+	bool *changed);
 
 #endif
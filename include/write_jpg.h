@@ -4,6 +4,25 @@
 #include <pixman.h>
 #include <stdio.h>
 
-int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality);
+#include "pool.h"
+
+struct grim_jpeg_writer;
+
+int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality,
+	struct grim_pool *pool);
+
+/**
+ * Starts writing an image whose rows are then passed to
+ * jpeg_writer_write_rows(), top to bottom, so that it needn't be held in
+ * memory as a whole. Rows are encoded on the calling thread.
+ */
+struct grim_jpeg_writer *create_jpeg_writer(FILE *stream,
+	pixman_format_code_t format, int width, int height, int quality);
+int jpeg_writer_write_rows(struct grim_jpeg_writer *writer,
+	pixman_image_t *image);
+/**
+ * Ends the image and frees the writer. Fails if not all rows were written.
+ */
+int finish_jpeg_writer(struct grim_jpeg_writer *writer);
 
 #endif
@@ -4,6 +4,14 @@
 #include <pixman.h>
 #include <stdio.h>
 
-int write_to_png_stream(pixman_image_t *image, FILE *stream, int comp_level);
+#include "pool.h"
+
+// Use the built-in encoder tuned for speed instead of zlib
+#define GRIM_PNG_LEVEL_FAST -1
+// Pick the filters and the zlib strategy from the image content
+#define GRIM_PNG_LEVEL_AUTO -2
+
+int write_to_png_stream(pixman_image_t *image, FILE *stream, int comp_level,
+	struct grim_pool *pool);
 
 #endif
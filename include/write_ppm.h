@@ -5,5 +5,12 @@
 #include <stdio.h>
 
 int write_to_ppm_stream(pixman_image_t *image, FILE *stream);
+/**
+ * Writes the header of an image whose rows are then written with
+ * write_ppm_rows(), top to bottom, so that it needn't be held in memory as a
+ * whole.
+ */
+int write_ppm_header(FILE *stream, int width, int height);
+int write_ppm_rows(pixman_image_t *image, FILE *stream);
 
 #endif
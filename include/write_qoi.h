@@ -0,0 +1,28 @@
+#ifndef _WRITE_QOI_H
+#define _WRITE_QOI_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+struct grim_qoi_writer;
+
+int write_to_qoi_stream(pixman_image_t *image, FILE *stream);
+
+/**
+ * Starts writing an image whose rows are then passed to
+ * qoi_writer_write_rows(), top to bottom, so that it needn't be held in
+ * memory as a whole. If fully_opaque, the alpha channel is left out.
+ * Otherwise, the header still declares 3 channels if every row turns out
+ * opaque, provided it is still buffered or the stream can seek.
+ */
+struct grim_qoi_writer *create_qoi_writer(FILE *stream, int width, int height,
+	bool fully_opaque);
+int qoi_writer_write_rows(struct grim_qoi_writer *writer,
+	pixman_image_t *image);
+/**
+ * Ends the image and frees the writer, even if writing failed.
+ */
+int finish_qoi_writer(struct grim_qoi_writer *writer);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _WRITE_RAW_H
+#define _WRITE_RAW_H
+
+#include <pixman.h>
+#include <stdio.h>
+#include <time.h>
+#include <wayland-client.h>
+
+// Size of the header, the pixel rows follow it
+#define GRIM_RAW_HEADER_SIZE 64
+
+/**
+ * Writes the header followed by the pixel rows of the image as they sit in
+ * memory, stride included. transform is the buffer transform the pixels
+ * are still subject to. time may be NULL if unknown.
+ */
+int write_to_raw_stream(pixman_image_t *image, FILE *stream,
+	enum wl_output_transform transform, const struct timespec *time);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _WRITE_Y4M_H
+#define _WRITE_Y4M_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+struct grim_pool;
+
+/**
+ * How pixels are turned into BT.709 YCbCr samples.
+ */
+struct grim_y4m_format {
+	bool chroma_444; // else 4:2:0
+	bool full_range; // else limited (16-235, 16-240)
+};
+
+/**
+ * Writes the stream header, which must come once before the frames. A
+ * frame_rate of 0 means unknown.
+ */
+int write_y4m_header(FILE *stream, int width, int height, double frame_rate,
+	const struct grim_y4m_format *format);
+/**
+ * Converts the image and writes it as a frame. Translucent pixels end up
+ * over black.
+ */
+int write_y4m_frame(pixman_image_t *image, FILE *stream,
+	const struct grim_y4m_format *format, struct grim_pool *pool);
+
+#endif
@@ -1,24 +1,34 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <pixman.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 
 #include "buffer.h"
+#include "daemon.h"
 #include "grim.h"
 #include "output-layout.h"
+#include "pool.h"
 #include "render.h"
 #include "write_ppm.h"
 #if HAVE_JPEG
 #include "write_jpg.h"
 #endif
 #include "write_png.h"
+#include "write_qoi.h"
+#include "write_raw.h"
+#include "write_y4m.h"
 
 #include "ext-foreign-toplevel-list-v1-protocol.h"
 #include "ext-image-capture-source-v1-protocol.h"
@@ -26,18 +36,37 @@
 #include "wlr-screencopy-unstable-v1-protocol.h"
 #include "xdg-output-unstable-v1-protocol.h"
 
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int sig) {
+	stop_requested = 1;
+}
+
 static void screencopy_frame_handle_buffer(void *data,
 		struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width,
 		uint32_t height, uint32_t stride) {
 	struct grim_capture *capture = data;
 
-	capture->buffer =
-		create_buffer(capture->state->shm, format, width, height, stride);
-	if (capture->buffer == NULL) {
-		fprintf(stderr, "failed to create buffer\n");
-		exit(EXIT_FAILURE);
+	// When recording, keep the buffer from the previous frame if the
+	// compositor still wants the same one
+	struct grim_buffer *buffer = capture->buffer;
+	if (buffer == NULL || buffer->format != format ||
+			buffer->width != (int32_t)width || buffer->height != (int32_t)height ||
+			buffer->stride != (int32_t)stride) {
+		destroy_buffer(capture->buffer);
+		capture->buffer =
+			create_buffer(capture->state->shm_pool, format, width, height, stride);
+		if (capture->buffer == NULL) {
+			fprintf(stderr, "failed to create buffer\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
+	// This version of the protocol doesn't report damage
+	pixman_region32_clear(&capture->damage);
+	pixman_region32_union_rect(&capture->damage, &capture->damage,
+		0, 0, width, height);
+
 	zwlr_screencopy_frame_v1_copy(frame, capture->buffer->wl_buffer);
 }
 
@@ -47,18 +76,40 @@ static void screencopy_frame_handle_flags(void *data,
 	capture->screencopy_frame_flags = flags;
 }
 
+static void capture_ready(struct grim_capture *capture) {
+	struct grim_state *state = capture->state;
+	++state->n_done;
+	if (state->capture_ready != NULL) {
+		state->capture_ready(capture, state->capture_ready_data);
+	}
+}
+
 static void screencopy_frame_handle_ready(void *data,
 		struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
 		uint32_t tv_sec_lo, uint32_t tv_nsec) {
 	struct grim_capture *capture = data;
-	++capture->state->n_done;
+	capture->presentation_time = (struct timespec){
+		.tv_sec = (int64_t)tv_sec_hi << 32 | tv_sec_lo,
+		.tv_nsec = tv_nsec,
+	};
+	capture_ready(capture);
+}
+
+static void capture_failed(struct grim_capture *capture) {
+	if (capture->output != NULL) {
+		fprintf(stderr, "failed to copy output %s\n", capture->output->name);
+	} else if (capture->output_removed) {
+		// Already reported by destroy_output
+	} else {
+		fprintf(stderr, "failed to copy toplevel\n");
+	}
+	capture->state->failed = true;
 }
 
 static void screencopy_frame_handle_failed(void *data,
 		struct zwlr_screencopy_frame_v1 *frame) {
 	struct grim_capture *capture = data;
-	fprintf(stderr, "failed to copy output %s\n", capture->output->name);
-	exit(EXIT_FAILURE);
+	capture_failed(capture);
 }
 
 static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener = {
@@ -77,28 +128,33 @@ static void ext_image_copy_capture_frame_handle_transform(void *data,
 
 static void ext_image_copy_capture_frame_handle_damage(void *data,
 		struct ext_image_copy_capture_frame_v1 *frame, int32_t x, int32_t y,
-		int32_t wdth, int32_t height) {
-	// No-op
+		int32_t width, int32_t height) {
+	struct grim_capture *capture = data;
+	pixman_region32_union_rect(&capture->damage, &capture->damage,
+		x, y, width, height);
 }
 
 static void ext_image_copy_capture_frame_handle_presentation_time(void *data,
 		struct ext_image_copy_capture_frame_v1 *frame, uint32_t tv_sec_hi,
 		uint32_t tv_sec_lo, uint32_t tv_nsec) {
-	// No-op
+	struct grim_capture *capture = data;
+	capture->presentation_time = (struct timespec){
+		.tv_sec = (int64_t)tv_sec_hi << 32 | tv_sec_lo,
+		.tv_nsec = tv_nsec,
+	};
 }
 
 static void ext_image_copy_capture_frame_handle_ready(void *data,
 		struct ext_image_copy_capture_frame_v1 *frame) {
 	struct grim_capture *capture = data;
-	++capture->state->n_done;
+	capture_ready(capture);
 }
 
 static void ext_image_copy_capture_frame_handle_failed(void *data,
 		struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason) {
 	// TODO: retry depending on reason
 	struct grim_capture *capture = data;
-	fprintf(stderr, "failed to copy output %s\n", capture->output->name);
-	exit(EXIT_FAILURE);
+	capture_failed(capture);
 }
 
 static const struct ext_image_copy_capture_frame_v1_listener ext_image_copy_capture_frame_listener = {
@@ -115,7 +171,7 @@ static void ext_image_copy_capture_session_handle_buffer_size(void *data,
 	capture->buffer_width = width;
 	capture->buffer_height = height;
 
-	if (capture->output == NULL) {
+	if (capture->output == NULL && !capture->output_removed) {
 		// TODO: improve this
 		capture->logical_geometry.width = width;
 		capture->logical_geometry.height = height;
@@ -145,11 +201,50 @@ static void ext_image_copy_capture_session_handle_dmabuf_format(void *data,
 	// No-op
 }
 
+static void ext_image_copy_capture_frame_start(struct grim_capture *capture) {
+	// The buffer constraints may have changed since the previous frame
+	struct grim_buffer *buffer = capture->buffer;
+	bool new_buffer = buffer == NULL || buffer->format != capture->shm_format ||
+		buffer->width != (int32_t)capture->buffer_width ||
+		buffer->height != (int32_t)capture->buffer_height;
+	if (new_buffer) {
+		destroy_buffer(capture->buffer);
+		int32_t stride = get_format_min_stride(capture->shm_format, capture->buffer_width);
+		capture->buffer =
+			create_buffer(capture->state->shm_pool, capture->shm_format, capture->buffer_width, capture->buffer_height, stride);
+		if (capture->buffer == NULL) {
+			fprintf(stderr, "failed to create buffer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pixman_region32_clear(&capture->damage);
+	if (new_buffer) {
+		pixman_region32_union_rect(&capture->damage, &capture->damage,
+			0, 0, capture->buffer->width, capture->buffer->height);
+	}
+
+	capture->ext_image_copy_capture_frame = ext_image_copy_capture_session_v1_create_frame(
+		capture->ext_image_copy_capture_session);
+	ext_image_copy_capture_frame_v1_add_listener(capture->ext_image_copy_capture_frame,
+		&ext_image_copy_capture_frame_listener, capture);
+
+	ext_image_copy_capture_frame_v1_attach_buffer(capture->ext_image_copy_capture_frame, capture->buffer->wl_buffer);
+	// We never write to the buffer ourselves, so a buffer reused from the
+	// previous frame only needs the compositor-side damage to be copied
+	if (new_buffer) {
+		ext_image_copy_capture_frame_v1_damage_buffer(capture->ext_image_copy_capture_frame,
+			0, 0, INT32_MAX, INT32_MAX);
+	}
+	ext_image_copy_capture_frame_v1_capture(capture->ext_image_copy_capture_frame);
+}
+
 static void ext_image_copy_capture_session_handle_done(void *data,
 		struct ext_image_copy_capture_session_v1 *session) {
 	struct grim_capture *capture = data;
 
-	if (capture->ext_image_copy_capture_frame != NULL) {
+	if (capture->buffer != NULL) {
+		// Constraints for the next frame, picked up when it is started
 		return;
 	}
 
@@ -158,22 +253,7 @@ static void ext_image_copy_capture_session_handle_done(void *data,
 		exit(EXIT_FAILURE);
 	}
 
-	int32_t stride = get_format_min_stride(capture->shm_format, capture->buffer_width);
-	capture->buffer =
-		create_buffer(capture->state->shm, capture->shm_format, capture->buffer_width, capture->buffer_height, stride);
-	if (capture->buffer == NULL) {
-		fprintf(stderr, "failed to create buffer\n");
-		exit(EXIT_FAILURE);
-	}
-
-	capture->ext_image_copy_capture_frame = ext_image_copy_capture_session_v1_create_frame(session);
-	ext_image_copy_capture_frame_v1_add_listener(capture->ext_image_copy_capture_frame,
-		&ext_image_copy_capture_frame_listener, capture);
-
-	ext_image_copy_capture_frame_v1_attach_buffer(capture->ext_image_copy_capture_frame, capture->buffer->wl_buffer);
-	ext_image_copy_capture_frame_v1_damage_buffer(capture->ext_image_copy_capture_frame,
-		0, 0, INT32_MAX, INT32_MAX);
-	ext_image_copy_capture_frame_v1_capture(capture->ext_image_copy_capture_frame);
+	ext_image_copy_capture_frame_start(capture);
 }
 
 static void ext_image_copy_capture_session_handle_stopped(void *data,
@@ -191,9 +271,19 @@ static const struct ext_image_copy_capture_session_v1_listener ext_image_copy_ca
 };
 
 
+static void destroy_toplevel(struct grim_toplevel *toplevel) {
+	wl_list_remove(&toplevel->link);
+	free(toplevel->identifier);
+	free(toplevel->title);
+	free(toplevel->app_id);
+	ext_foreign_toplevel_handle_v1_destroy(toplevel->handle);
+	free(toplevel);
+}
+
 static void foreign_toplevel_handle_closed(void *data,
 		struct ext_foreign_toplevel_handle_v1 *toplevel_handle) {
-	// No-op
+	struct grim_toplevel *toplevel = data;
+	destroy_toplevel(toplevel);
 }
 
 static void foreign_toplevel_handle_done(void *data,
@@ -203,12 +293,16 @@ static void foreign_toplevel_handle_done(void *data,
 
 static void foreign_toplevel_handle_title(void *data,
 		struct ext_foreign_toplevel_handle_v1 *toplevel_handle, const char *title) {
-	// No-op
+	struct grim_toplevel *toplevel = data;
+	free(toplevel->title);
+	toplevel->title = strdup(title);
 }
 
 static void foreign_toplevel_handle_app_id(void *data,
 		struct ext_foreign_toplevel_handle_v1 *toplevel_handle, const char *app_id) {
-	// No-op
+	struct grim_toplevel *toplevel = data;
+	free(toplevel->app_id);
+	toplevel->app_id = strdup(app_id);
 }
 
 static void foreign_toplevel_handle_identifier(void *data,
@@ -321,7 +415,10 @@ static void output_handle_mode(void *data, struct wl_output *wl_output,
 }
 
 static void output_handle_done(void *data, struct wl_output *wl_output) {
-	// No-op
+	struct grim_output *output = data;
+	if (output->state->xdg_output_manager == NULL) {
+		guess_output_logical_geometry(output);
+	}
 }
 
 static void output_handle_scale(void *data, struct wl_output *wl_output,
@@ -351,6 +448,35 @@ static const struct wl_output_listener output_listener = {
 };
 
 
+static void output_get_xdg_output(struct grim_output *output) {
+	output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
+		output->state->xdg_output_manager, output->wl_output);
+	zxdg_output_v1_add_listener(output->xdg_output,
+		&xdg_output_listener, output);
+}
+
+static void destroy_output(struct grim_output *output) {
+	// Captures of a removed output can't complete anymore
+	struct grim_capture *capture;
+	wl_list_for_each(capture, &output->state->captures, link) {
+		if (capture->output == output) {
+			fprintf(stderr, "failed to copy output %s: output removed\n",
+				output->name);
+			capture->output = NULL;
+			capture->output_removed = true;
+			output->state->failed = true;
+		}
+	}
+
+	wl_list_remove(&output->link);
+	free(output->name);
+	if (output->xdg_output != NULL) {
+		zxdg_output_v1_destroy(output->xdg_output);
+	}
+	wl_output_release(output->wl_output);
+	free(output);
+}
+
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct grim_state *state = data;
@@ -361,15 +487,26 @@ static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t bind_version = (version > 2) ? 2 : version;
 		state->xdg_output_manager = wl_registry_bind(registry, name,
 			&zxdg_output_manager_v1_interface, bind_version);
+
+		struct grim_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			output_get_xdg_output(output);
+		}
 	} else if (strcmp(interface, wl_output_interface.name) == 0) {
 		uint32_t bind_version = (version >= 4) ? 4 : 3;
 		struct grim_output *output = calloc(1, sizeof(struct grim_output));
 		output->state = state;
+		output->global_name = name;
 		output->scale = 1;
 		output->wl_output =  wl_registry_bind(registry, name,
 			&wl_output_interface, bind_version);
 		wl_output_add_listener(output->wl_output, &output_listener, output);
 		wl_list_insert(&state->outputs, &output->link);
+
+		// Outputs hotplugged while running as a daemon
+		if (state->xdg_output_manager != NULL) {
+			output_get_xdg_output(output);
+		}
 	} else if (strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name) == 0) {
 		state->ext_output_image_capture_source_manager = wl_registry_bind(registry, name,
 			&ext_output_image_capture_source_manager_v1_interface, 1);
@@ -392,7 +529,14 @@ static void handle_global(void *data, struct wl_registry *registry,
 
 static void handle_global_remove(void *data, struct wl_registry *registry,
 		uint32_t name) {
-	// who cares
+	struct grim_state *state = data;
+
+	struct grim_output *output, *output_tmp;
+	wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
+		if (output->global_name == name) {
+			destroy_output(output);
+		}
+	}
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -400,7 +544,12 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = handle_global_remove,
 };
 
-static bool default_filename(char *filename, size_t n, int filetype) {
+/**
+ * Generates a timestamped filename. suffix is appended before the
+ * extension, with "%%" standing for "%".
+ */
+static bool default_filename(char *filename, size_t n, int filetype,
+		const char *suffix) {
 	time_t time_epoch = time(NULL);
 	struct tm *time = localtime(&time_epoch);
 	if (time == NULL) {
@@ -417,6 +566,15 @@ static bool default_filename(char *filename, size_t n, int filetype) {
 	case GRIM_FILETYPE_PPM:
 		ext = "ppm";
 		break;
+	case GRIM_FILETYPE_QOI:
+		ext = "qoi";
+		break;
+	case GRIM_FILETYPE_RAW:
+		ext = "raw";
+		break;
+	case GRIM_FILETYPE_Y4M:
+		ext = "y4m";
+		break;
 	case GRIM_FILETYPE_JPEG:
 #if HAVE_JPEG
 		ext = "jpeg";
@@ -426,8 +584,10 @@ static bool default_filename(char *filename, size_t n, int filetype) {
 #endif
 	}
 	assert(ext != NULL);
-	char tmpstr[32];
-	sprintf(tmpstr, "%%Y%%m%%d_%%Hh%%Mm%%Ss_grim.%s", ext);
+	char tmpstr[64];
+	// strftime turns "%%" into the conversions of the suffix
+	snprintf(tmpstr, sizeof(tmpstr), "%%Y%%m%%d_%%Hh%%Mm%%Ss_grim%s.%s",
+		suffix, ext);
 	format_str = tmpstr;
 	if (strftime(filename, n, format_str, time) == 0) {
 		fprintf(stderr, "failed to format datetime with strftime(3)\n");
@@ -436,6 +596,35 @@ static bool default_filename(char *filename, size_t n, int filetype) {
 	return true;
 }
 
+/**
+ * Checks that a frame filename pattern contains exactly one integer
+ * conversion ("%d", optionally zero-padded like "%04d"), so that it can be
+ * safely passed to snprintf.
+ */
+static bool check_frame_pattern(const char *pattern) {
+	int n_conversions = 0;
+	for (const char *p = pattern; *p != '\0'; p++) {
+		if (*p != '%') {
+			continue;
+		}
+		p++;
+		if (*p == '%') {
+			continue;
+		}
+		if (*p == '0') {
+			p++;
+		}
+		while (*p >= '0' && *p <= '9') {
+			p++;
+		}
+		if (*p != 'd') {
+			return false;
+		}
+		n_conversions++;
+	}
+	return n_conversions == 1;
+}
+
 static bool path_exists(const char *path) {
 	return path && access(path, R_OK) != -1;
 }
@@ -522,15 +711,87 @@ char *get_output_dir(void) {
 	return strdup(".");
 }
 
-static void create_output_capture(struct grim_state *state, struct grim_output *output, bool with_cursor) {
+/**
+ * Checks whether only part of an output needs to be captured, and if so which
+ * part, in layout coordinates: the bounding box of the regions on it. Only
+ * wlr-screencopy can capture a region of an output, so it is preferred over
+ * ext-image-copy-capture in that case.
+ */
+static bool get_output_capture_region(struct grim_state *state,
+		struct grim_output *output, struct grim_box *regions,
+		size_t n_regions, struct grim_box *region) {
+	if (n_regions == 0 || state->screencopy_manager == NULL) {
+		return false;
+	}
+	bool found = false;
+	for (size_t i = 0; i < n_regions; i++) {
+		struct grim_box part;
+		if (!get_box_intersection(&regions[i], &output->logical_geometry,
+				&part)) {
+			continue;
+		}
+		if (found) {
+			get_box_union(region, &part, region);
+		} else {
+			*region = part;
+			found = true;
+		}
+	}
+	return found && (region->width < output->logical_geometry.width ||
+		region->height < output->logical_geometry.height);
+}
+
+static bool output_intersects_regions(struct grim_output *output,
+		struct grim_box *regions, size_t n_regions) {
+	if (n_regions == 0) {
+		return true;
+	}
+	for (size_t i = 0; i < n_regions; i++) {
+		if (intersect_box(&regions[i], &output->logical_geometry)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void screencopy_capture_output(struct grim_capture *capture) {
+	struct grim_state *state = capture->state;
+	struct grim_output *output = capture->output;
+	struct grim_box *region = &capture->logical_geometry;
+
+	if (memcmp(region, &output->logical_geometry, sizeof(*region)) == 0) {
+		capture->screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
+			state->screencopy_manager, capture->with_cursor, output->wl_output);
+	} else {
+		capture->screencopy_frame = zwlr_screencopy_manager_v1_capture_output_region(
+			state->screencopy_manager, capture->with_cursor, output->wl_output,
+			region->x - output->logical_geometry.x,
+			region->y - output->logical_geometry.y,
+			region->width, region->height);
+	}
+	zwlr_screencopy_frame_v1_add_listener(capture->screencopy_frame,
+		&screencopy_frame_listener, capture);
+}
+
+static void create_output_capture(struct grim_state *state, struct grim_output *output,
+		struct grim_box *regions, size_t n_regions, bool with_cursor) {
 	struct grim_capture *capture = calloc(1, sizeof(*capture));
 	capture->state = state;
 	capture->output = output;
 	capture->transform = output->transform;
 	capture->logical_geometry = output->logical_geometry;
+	capture->with_cursor = with_cursor;
+	pixman_region32_init(&capture->damage);
 	wl_list_insert(&state->captures, &capture->link);
 
-	if (state->ext_output_image_capture_source_manager != NULL) {
+	struct grim_box region;
+	if (get_output_capture_region(state, output, regions, n_regions,
+			&region)) {
+		// The buffer will only contain the region, which render() then
+		// places at the region's position instead of the output's
+		capture->logical_geometry = region;
+		screencopy_capture_output(capture);
+	} else if (state->ext_output_image_capture_source_manager != NULL) {
 		uint32_t options = 0;
 		if (with_cursor) {
 			options |= EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS;
@@ -543,16 +804,15 @@ static void create_output_capture(struct grim_state *state, struct grim_output *
 			&ext_image_copy_capture_session_listener, capture);
 		ext_image_capture_source_v1_destroy(source);
 	} else {
-		capture->screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
-			state->screencopy_manager, with_cursor, output->wl_output);
-		zwlr_screencopy_frame_v1_add_listener(capture->screencopy_frame,
-			&screencopy_frame_listener, capture);
+		screencopy_capture_output(capture);
 	}
 }
 
 static void create_toplevel_capture(struct grim_state *state, struct grim_toplevel *toplevel, bool with_cursor) {
 	struct grim_capture *capture = calloc(1, sizeof(*capture));
 	capture->state = state;
+	capture->with_cursor = with_cursor;
+	pixman_region32_init(&capture->damage);
 	wl_list_insert(&state->captures, &capture->link);
 
 	uint32_t options = 0;
@@ -561,404 +821,2122 @@ static void create_toplevel_capture(struct grim_state *state, struct grim_toplev
 	}
 	struct ext_image_capture_source_v1 *source = ext_foreign_toplevel_image_capture_source_manager_v1_create_source(
 		state->ext_foreign_toplevel_image_capture_source_manager, toplevel->handle);
-	struct ext_image_copy_capture_session_v1 *session = ext_image_copy_capture_manager_v1_create_session(
+	capture->ext_image_copy_capture_session = ext_image_copy_capture_manager_v1_create_session(
 		state->ext_image_copy_capture_manager, source, options);
-	ext_image_copy_capture_session_v1_add_listener(session,
+	ext_image_copy_capture_session_v1_add_listener(capture->ext_image_copy_capture_session,
 		&ext_image_copy_capture_session_listener, capture);
 	ext_image_capture_source_v1_destroy(source);
 }
 
+static void capture_next_frame(struct grim_capture *capture) {
+	if (capture->ext_image_copy_capture_session != NULL) {
+		// Keep the session and its buffer, only a new frame is needed
+		ext_image_copy_capture_frame_v1_destroy(capture->ext_image_copy_capture_frame);
+		capture->ext_image_copy_capture_frame = NULL;
+		ext_image_copy_capture_frame_start(capture);
+	} else {
+		zwlr_screencopy_frame_v1_destroy(capture->screencopy_frame);
+		capture->screencopy_frame = NULL;
+		capture->screencopy_frame_flags = 0;
+		if (capture->output != NULL) {
+			screencopy_capture_output(capture);
+		}
+	}
+}
+
 static const char usage[] =
 	"Usage: grim [options...] [output-file]\n"
 	"\n"
 	"  -h              Show help message and quit.\n"
 	"  -s <factor>     Set the output image scale factor. Defaults to the\n"
 	"                  greatest output scale factor.\n"
-	"  -g <geometry>   Set the region to capture.\n"
-	"  -t png|ppm|jpeg Set the output filetype. Defaults to png.\n"
+	"  -F <filter>     Set the downscaling filter: fast or quality. Defaults\n"
+	"                  to quality.\n"
+	"  -b <rows>       Render and encode a single ppm, qoi or jpeg image in\n"
+	"                  bands of this many rows, to use less memory.\n"
+	"  -g <geometry>   Set the region to capture, optionally followed by its\n"
+	"                  own output file. Can be given several times.\n"
+	"  -t <type>       Set the output filetype: png, ppm, jpeg, qoi, raw or\n"
+	"                  y4m. Defaults to png.\n"
 	"  -q <quality>    Set the JPEG filetype quality 0-100. Defaults to 80.\n"
-	"  -l <level>      Set the PNG filetype compression level 0-9. Defaults to 6.\n"
-	"  -o <output>     Set the output name to capture.\n"
+	"  -l <level>      Set the PNG filetype compression level 0-9, fast\n"
+	"                  or auto. Defaults to 6.\n"
+	"  -Y <chroma>     Set the Y4M chroma subsampling: 420 or 444. Defaults\n"
+	"                  to 420.\n"
+	"  -R <range>      Set the Y4M color range: limited or full. Defaults to\n"
+	"                  limited.\n"
+	"  -o <output>     Set the output name to capture. Can be given several\n"
+	"                  times, implying -O.\n"
+	"  -O              Write each output to its own file, named after it.\n"
+	"  -e <options>    Also write the image with other options, e.g.\n"
+	"                  type=jpeg,scale=0.5,file=thumb.jpeg. Can be given\n"
+	"                  several times.\n"
 	"  -T <identifier> Set the identifier of a foreign toplevel handle to capture.\n"
-	"  -c              Include cursors in the screenshot.\n";
+	"                  Can be given several times, implying -A.\n"
+	"  -A              Write each toplevel to its own file, named after its\n"
+	"                  identifier. Captures all toplevels unless -T is given.\n"
+	"  -c              Include cursors in the screenshot.\n"
+	"  -n <frames>     Record this many frames, 0 records until interrupted.\n"
+	"  -r <fps>        Set the recording frame rate. Defaults to as fast as\n"
+	"                  possible.\n"
+	"  -j <threads>    Set the number of threads. Defaults to the number of\n"
+	"                  CPUs.\n"
+	"  -D              Run as a daemon serving capture requests.\n"
+	"  -C              Send the capture request to a running daemon.\n";
+
+/**
+ * Checks that a filename pattern contains at least one of the conversions
+ * listed in convs, e.g. "o" for "%o", and no other conversion but "%%".
+ */
+static bool check_name_pattern(const char *pattern, const char *convs) {
+	bool found = false;
+	for (const char *p = pattern; *p != '\0'; p++) {
+		if (*p != '%') {
+			continue;
+		}
+		p++;
+		if (*p != '\0' && strchr(convs, *p) != NULL) {
+			found = true;
+		} else if (*p != '%') {
+			return false;
+		}
+	}
+	return found;
+}
 
-int main(int argc, char *argv[]) {
-	double scale = 1.0;
-	bool use_greatest_scale = true;
-	struct grim_box *geometry = NULL;
-	const char *geometry_output = NULL;
-	enum grim_filetype output_filetype = GRIM_FILETYPE_PNG;
-	int jpeg_quality = 80;
-	int png_level = 6; // current default png/zlib compression level
-	bool with_cursor = false;
-	const char *toplevel_identifier = NULL;
-	int opt;
-	while ((opt = getopt(argc, argv, "hs:g:t:q:l:o:cT:")) != -1) {
-		switch (opt) {
-		case 'h':
-			printf("%s", usage);
-			return EXIT_SUCCESS;
-		case 's':
-			use_greatest_scale = false;
-			scale = strtod(optarg, NULL);
-			break;
-		case 'g':;
-			char *geometry_str = NULL;
-			if (strcmp(optarg, "-") == 0) {
-				size_t n = 0;
-				ssize_t nread = getline(&geometry_str, &n, stdin);
-				if (nread < 0) {
-					free(geometry_str);
-					fprintf(stderr, "failed to read a line from stdin\n");
-					return EXIT_FAILURE;
-				}
+/**
+ * Replaces the conversions of a pattern accepted by check_name_pattern()
+ * with the values in the same order as convs, and "%%" with "%". Slashes in
+ * the values are replaced, so that they stay in a single path component.
+ */
+static char *format_name_filename(const char *pattern, const char *convs,
+		const char *const values[]) {
+	size_t len = 0;
+	for (const char *p = pattern; *p != '\0'; p++) {
+		const char *conv = p[0] == '%' && p[1] != '\0' ?
+			strchr(convs, p[1]) : NULL;
+		if (conv != NULL) {
+			len += strlen(values[conv - convs]);
+			p++;
+		} else {
+			len++;
+			p += p[0] == '%' && p[1] == '%';
+		}
+	}
 
-				if (nread > 0 && geometry_str[nread - 1] == '\n') {
-					geometry_str[nread - 1] = '\0';
-				}
-			} else {
-				geometry_str = strdup(optarg);
+	char *filename = malloc(len + 1);
+	if (filename == NULL) {
+		return NULL;
+	}
+	char *out = filename;
+	for (const char *p = pattern; *p != '\0'; p++) {
+		const char *conv = p[0] == '%' && p[1] != '\0' ?
+			strchr(convs, p[1]) : NULL;
+		if (conv != NULL) {
+			for (const char *v = values[conv - convs]; *v != '\0'; v++) {
+				*out++ = *v == '/' ? '_' : *v;
 			}
+			p++;
+		} else {
+			*out++ = *p;
+			p += p[0] == '%' && p[1] == '%';
+		}
+	}
+	*out = '\0';
+	return filename;
+}
 
-			free(geometry);
-			geometry = calloc(1, sizeof(struct grim_box));
-			if (!parse_box(geometry, geometry_str)) {
-				fprintf(stderr, "invalid geometry\n");
-				return EXIT_FAILURE;
-			}
+static char *format_frame_filename(const char *pattern, int frame) {
+	int len = snprintf(NULL, 0, pattern, frame);
+	if (len < 0) {
+		return NULL;
+	}
+	char *filename = malloc(len + 1);
+	if (filename == NULL) {
+		return NULL;
+	}
+	snprintf(filename, len + 1, pattern, frame);
+	return filename;
+}
 
-			free(geometry_str);
-			break;
-		case 't':
-			if (strcmp(optarg, "png") == 0) {
-				output_filetype = GRIM_FILETYPE_PNG;
-			} else if (strcmp(optarg, "ppm") == 0) {
-				output_filetype = GRIM_FILETYPE_PPM;
-			} else if (strcmp(optarg, "jpeg") == 0) {
-#if HAVE_JPEG
-				output_filetype = GRIM_FILETYPE_JPEG;
-#else
-				fprintf(stderr, "jpeg support disabled\n");
-				return EXIT_FAILURE;
-#endif
-			} else {
-				fprintf(stderr, "invalid filetype\n");
-				return EXIT_FAILURE;
-			}
-			break;
-		case 'q':
-			if (output_filetype != GRIM_FILETYPE_JPEG) {
-				fprintf(stderr, "quality is used only for jpeg files\n");
-				return EXIT_FAILURE;
-			} else {
-				char *endptr = NULL;
-				errno = 0;
-				jpeg_quality = strtol(optarg, &endptr, 10);
-				if (*endptr != '\0' || errno) {
-					fprintf(stderr, "quality must be a integer\n");
-					return EXIT_FAILURE;
-				}
-				if (jpeg_quality < 0 || jpeg_quality > 100) {
-					fprintf(stderr, "quality valid values are between 0-100\n");
-					return EXIT_FAILURE;
-				}
-			}
-			break;
-		case 'l':
-			if (output_filetype != GRIM_FILETYPE_PNG) {
-				fprintf(stderr, "compression level is used only for png files\n");
-				return EXIT_FAILURE;
-			} else {
-				char *endptr = NULL;
-				errno = 0;
-				png_level = strtol(optarg, &endptr, 10);
-				if (*endptr != '\0' || errno) {
-					fprintf(stderr, "level must be a integer\n");
-					return EXIT_FAILURE;
-				}
-				if (png_level < 0 || png_level > 9) {
-					fprintf(stderr, "compression level valid values are between 0-9\n");
-					return EXIT_FAILURE;
-				}
-			}
-			break;
-		case 'o':
-			geometry_output = optarg;
-			break;
-		case 'c':
-			with_cursor = true;
-			break;
-		case 'T':
-			toplevel_identifier = optarg;
-			break;
-		default:
-			return EXIT_FAILURE;
-		}
+/**
+ * Writes the frame previously written to prev_path again to path: as a hard
+ * link, or as a copy where links aren't supported.
+ */
+static bool reuse_frame_file(const char *prev_path, const char *path) {
+	if (unlink(path) != 0 && errno != ENOENT) {
+		fprintf(stderr, "Failed to replace file '%s': %s\n", path,
+			strerror(errno));
+		return false;
+	}
+	if (link(prev_path, path) == 0) {
+		return true;
 	}
 
-	if (geometry_output != NULL && geometry != NULL) {
-		fprintf(stderr, "-o and -g are mutually exclusive\n");
-		return EXIT_FAILURE;
+	FILE *src = fopen(prev_path, "r");
+	FILE *dest = fopen(path, "w");
+	bool ok = src != NULL && dest != NULL;
+	char buf[64 * 1024];
+	size_t n;
+	while (ok && (n = fread(buf, 1, sizeof(buf), src)) > 0) {
+		ok = fwrite(buf, 1, n, dest) == n;
 	}
-	if (geometry_output != NULL && toplevel_identifier != NULL) {
-		fprintf(stderr, "-o and -T are mutually exclusive\n");
-		return EXIT_FAILURE;
+	ok = ok && !ferror(src);
+	if (src != NULL) {
+		fclose(src);
 	}
+	if (dest != NULL && fclose(dest) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "Failed to copy frame '%s' to '%s'\n", prev_path,
+			path);
+	}
+	return ok;
+}
 
-	const char *output_filename;
-	char *output_filepath;
-	char tmp[64];
-	if (optind >= argc) {
-		if (!default_filename(tmp, sizeof(tmp), output_filetype)) {
-			fprintf(stderr, "failed to generate default filename\n");
-			return EXIT_FAILURE;
-		}
-		output_filename = tmp;
+static void advance_frame_time(struct timespec *time, double frame_rate) {
+	long long nsec = time->tv_nsec + (long long)(1000000000.0 / frame_rate);
+	time->tv_sec += nsec / 1000000000;
+	time->tv_nsec = nsec % 1000000000;
+}
 
-		char *output_dir = get_output_dir();
-		int len = snprintf(NULL, 0, "%s/%s", output_dir, output_filename);
-		if (len < 0) {
-			perror("snprintf failed");
-			return EXIT_FAILURE;
+/**
+ * Gets the presentation time of a single capture, or returns false if the
+ * compositor didn't report it.
+ */
+static bool get_capture_time(struct grim_capture *capture,
+		struct timespec *time) {
+	const struct timespec *t = &capture->presentation_time;
+	if (t->tv_sec == 0 && t->tv_nsec == 0) {
+		return false;
+	}
+	*time = *t;
+	return true;
+}
+
+/**
+ * Returns the latest presentation time of the captures, or false if the
+ * compositor didn't report any.
+ */
+static bool get_captures_time(struct grim_state *state, struct timespec *time) {
+	bool found = false;
+	struct grim_capture *capture;
+	wl_list_for_each(capture, &state->captures, link) {
+		struct timespec t;
+		if (!get_capture_time(capture, &t)) {
+			continue;
 		}
-		output_filepath = malloc(len + 1);
-		snprintf(output_filepath, len + 1, "%s/%s", output_dir, output_filename);
-		free(output_dir);
-	} else if (optind < argc - 1) {
-		printf("%s", usage);
-		return EXIT_FAILURE;
-	} else {
-		output_filename = argv[optind];
-		output_filepath = strdup(output_filename);
+		if (!found || t.tv_sec > time->tv_sec ||
+				(t.tv_sec == time->tv_sec && t.tv_nsec > time->tv_nsec)) {
+			*time = t;
+			found = true;
+		}
+	}
+	return found;
+}
+
+/**
+ * Encodes an image. transform and time are only used for raw images, the
+ * others must be rendered upright. time may be NULL if unknown. Y4M frames
+ * must follow a stream header.
+ */
+static int write_image(pixman_image_t *image, enum wl_output_transform transform,
+		const struct timespec *time, FILE *file,
+		const struct grim_request *request, struct grim_state *state) {
+	struct grim_pool *pool = state->pool;
+	switch (request->filetype) {
+	case GRIM_FILETYPE_PPM:
+		return write_to_ppm_stream(image, file);
+	case GRIM_FILETYPE_QOI:
+		return write_to_qoi_stream(image, file);
+	case GRIM_FILETYPE_RAW:
+		return write_to_raw_stream(image, file, transform, time);
+	case GRIM_FILETYPE_Y4M:
+		return write_y4m_frame(image, file, &request->y4m_format, pool);
+	case GRIM_FILETYPE_PNG:
+		return write_to_png_stream(image, file, request->png_level, pool);
+	case GRIM_FILETYPE_JPEG:
+#if HAVE_JPEG
+		return write_to_jpeg_stream(image, file, request->jpeg_quality,
+			pool);
+#else
+		abort();
+#endif
 	}
+	abort();
+}
 
-	struct grim_state state = {0};
-	wl_list_init(&state.outputs);
-	wl_list_init(&state.toplevels);
-	wl_list_init(&state.captures);
+static bool init_state(struct grim_state *state, int n_threads) {
+	*state = (struct grim_state){0};
+	wl_list_init(&state->outputs);
+	wl_list_init(&state->toplevels);
+	wl_list_init(&state->captures);
 
-	state.display = wl_display_connect(NULL);
-	if (state.display == NULL) {
+	state->display = wl_display_connect(NULL);
+	if (state->display == NULL) {
 		fprintf(stderr, "failed to create display\n");
-		return EXIT_FAILURE;
+		return false;
 	}
 
-	state.registry = wl_display_get_registry(state.display);
-	wl_registry_add_listener(state.registry, &registry_listener, &state);
-	if (wl_display_roundtrip(state.display) < 0) {
+	state->registry = wl_display_get_registry(state->display);
+	wl_registry_add_listener(state->registry, &registry_listener, state);
+	if (wl_display_roundtrip(state->display) < 0) {
 		fprintf(stderr, "wl_display_roundtrip() failed\n");
-		return EXIT_FAILURE;
+		return false;
 	}
 
-	if (state.shm == NULL) {
+	if (state->shm == NULL) {
 		fprintf(stderr, "compositor doesn't support wl_shm\n");
-		return EXIT_FAILURE;
+		return false;
 	}
-	bool can_capture;
-	if (toplevel_identifier != NULL) {
-		can_capture = state.ext_foreign_toplevel_image_capture_source_manager != NULL && state.ext_image_copy_capture_manager;
-	} else {
-		can_capture = state.screencopy_manager != NULL ||
-			(state.ext_output_image_capture_source_manager != NULL && state.ext_image_copy_capture_manager != NULL);;
+	if (state->xdg_output_manager == NULL) {
+		fprintf(stderr, "warning: zxdg_output_manager_v1 isn't available, "
+			"guessing the output layout\n");
 	}
-	if (!can_capture) {
-		fprintf(stderr, "compositor doesn't support the screen capture protocol\n");
-		return EXIT_FAILURE;
+
+	// Wait for the output, xdg-output and toplevel events
+	if (wl_display_roundtrip(state->display) < 0) {
+		fprintf(stderr, "wl_display_roundtrip() failed\n");
+		return false;
 	}
-	if (toplevel_identifier == NULL && wl_list_empty(&state.outputs)) {
-		fprintf(stderr, "no wl_output\n");
-		return EXIT_FAILURE;
+
+	state->shm_pool = create_shm_pool(state->shm, 0);
+	if (state->shm_pool == NULL) {
+		fprintf(stderr, "failed to create shm pool\n");
+		return false;
 	}
 
-	if (state.xdg_output_manager != NULL) {
-		struct grim_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
-				state.xdg_output_manager, output->wl_output);
-			zxdg_output_v1_add_listener(output->xdg_output,
-				&xdg_output_listener, output);
-		}
-	} else {
-		fprintf(stderr, "warning: zxdg_output_manager_v1 isn't available, "
-			"guessing the output layout\n");
+	state->pool = create_pool(n_threads);
+	return true;
+}
 
-		struct grim_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			guess_output_logical_geometry(output);
-		}
+static bool check_request(const struct grim_request *request) {
+	if (request->output_name != NULL && request->has_geometry) {
+		fprintf(stderr, "-o and -g are mutually exclusive\n");
+		return false;
+	}
+	if (request->output_name != NULL && request->toplevel_identifier != NULL) {
+		fprintf(stderr, "-o and -T are mutually exclusive\n");
+		return false;
 	}
+	return true;
+}
 
-	if (state.xdg_output_manager != NULL || toplevel_identifier != NULL) {
-		if (wl_display_roundtrip(state.display) < 0) {
-			fprintf(stderr, "wl_display_roundtrip() failed\n");
-			return EXIT_FAILURE;
+static bool can_capture_toplevels(struct grim_state *state) {
+	return state->ext_foreign_toplevel_image_capture_source_manager != NULL &&
+		state->ext_image_copy_capture_manager != NULL;
+}
+
+static bool check_capture_support(struct grim_state *state,
+		const struct grim_request *request) {
+	bool can_capture;
+	if (request->toplevel_identifier != NULL) {
+		can_capture = can_capture_toplevels(state);
+	} else {
+		can_capture = state->screencopy_manager != NULL ||
+			(state->ext_output_image_capture_source_manager != NULL &&
+			state->ext_image_copy_capture_manager != NULL);
+	}
+	if (!can_capture) {
+		fprintf(stderr, "compositor doesn't support the screen capture protocol\n");
+		return false;
+	}
+	if (request->toplevel_identifier == NULL && wl_list_empty(&state->outputs)) {
+		fprintf(stderr, "no wl_output\n");
+		return false;
+	}
+	return true;
+}
+
+static struct grim_toplevel *find_toplevel(struct grim_state *state,
+		const char *identifier) {
+	struct grim_toplevel *toplevel;
+	wl_list_for_each(toplevel, &state->toplevels, link) {
+		if (toplevel->identifier != NULL &&
+				strcmp(toplevel->identifier, identifier) == 0) {
+			return toplevel;
 		}
 	}
+	return NULL;
+}
 
-	if (geometry_output != NULL) {
+/**
+ * Creates the captures for a request. The geometry to render is stored in
+ * geometry, unless it depends on the captured buffers, in which case
+ * use_layout_extents is set.
+ *
+ * If n_regions isn't zero, the outputs covering any of the regions are
+ * captured instead of the request's geometry, and geometry is left unset.
+ */
+static bool start_captures(struct grim_state *state,
+		const struct grim_request *request, struct grim_box *regions,
+		size_t n_regions, struct grim_box *geometry, bool *use_layout_extents,
+		double *scale) {
+	if (n_regions > 0) {
+		*geometry = (struct grim_box){0};
+	} else if (request->has_geometry) {
+		*geometry = request->geometry;
+		regions = geometry;
+		n_regions = 1;
+	} else if (request->output_name != NULL) {
 		struct grim_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			if (output->name != NULL && strcmp(output->name, geometry_output) == 0) {
-				geometry = calloc(1, sizeof(struct grim_box));
-				memcpy(geometry, &output->logical_geometry,
-					sizeof(struct grim_box));
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->name != NULL &&
+					strcmp(output->name, request->output_name) == 0) {
+				*geometry = output->logical_geometry;
+				regions = geometry;
+				n_regions = 1;
+				break;
 			}
 		}
 
-		if (geometry == NULL) {
-			fprintf(stderr, "unknown output '%s'\n", geometry_output);
-			return EXIT_FAILURE;
+		if (n_regions == 0) {
+			fprintf(stderr, "unknown output '%s'\n", request->output_name);
+			return false;
 		}
+	} else {
+		*geometry = (struct grim_box){0};
 	}
+	*use_layout_extents = n_regions == 0;
+	*scale = request->use_greatest_scale ? 1.0 : request->scale;
 
-	if (toplevel_identifier != NULL) {
-		bool found = false;
-		struct grim_toplevel *toplevel;
-		wl_list_for_each(toplevel, &state.toplevels, link) {
-			if (strcmp(toplevel->identifier, toplevel_identifier) == 0) {
-				found = true;
-				break;
-			}
-		}
-		if (!found) {
+	state->n_done = 0;
+	state->failed = false;
+
+	if (request->toplevel_identifier != NULL) {
+		struct grim_toplevel *found =
+			find_toplevel(state, request->toplevel_identifier);
+		if (found == NULL) {
 			fprintf(stderr, "cannot find toplevel\n");
-			return EXIT_FAILURE;
+			return false;
 		}
 
-		create_toplevel_capture(&state, toplevel, with_cursor);
-	} else {
-		struct grim_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			if (geometry != NULL &&
-					!intersect_box(geometry, &output->logical_geometry)) {
-				continue;
-			}
-			if (use_greatest_scale && output->logical_scale > scale) {
-				scale = output->logical_scale;
-			}
+		create_toplevel_capture(state, found, request->with_cursor);
+		return true;
+	}
 
-			create_output_capture(&state, output, with_cursor);
+	// Size the shared memory pool for all captures up front, assuming
+	// 32-bit pixels; it grows if the compositor asks for more
+	size_t pool_size = 0;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		struct grim_box region;
+		if (get_output_capture_region(state, output, regions, n_regions,
+				&region)) {
+			pool_size += (size_t)ceil(region.width * output->logical_scale) *
+				ceil(region.height * output->logical_scale) * 4;
+		} else if (output_intersects_regions(output, regions, n_regions)) {
+			pool_size += (size_t)output->mode_width * output->mode_height * 4;
 		}
+	}
+	if (!shm_pool_reserve(state->shm_pool, pool_size)) {
+		fprintf(stderr, "failed to allocate shm pool\n");
+		return false;
+	}
 
-		if (wl_list_empty(&state.captures)) {
-			fprintf(stderr, "supplied geometry did not intersect with any outputs\n");
-			return EXIT_FAILURE;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output_intersects_regions(output, regions, n_regions)) {
+			continue;
+		}
+		if (request->use_greatest_scale && output->logical_scale > *scale) {
+			*scale = output->logical_scale;
 		}
+
+		create_output_capture(state, output, regions, n_regions,
+			request->with_cursor);
+	}
+
+	if (wl_list_empty(&state->captures)) {
+		fprintf(stderr, "supplied geometry did not intersect with any outputs\n");
+		return false;
 	}
+	return true;
+}
 
-	size_t n_pending = wl_list_length(&state.captures);
+static bool wait_captures(struct grim_state *state) {
+	size_t n_pending = wl_list_length(&state->captures);
 	bool done = false;
-	while (!done && wl_display_dispatch(state.display) != -1) {
-		done = (state.n_done == n_pending);
+	while (!done && !state->failed &&
+			wl_display_dispatch(state->display) != -1) {
+		done = (state->n_done == n_pending);
 	}
 	if (!done) {
 		fprintf(stderr, "failed to screenshoot all sources\n");
-		return EXIT_FAILURE;
 	}
+	return done;
+}
 
-	if (geometry == NULL) {
-		geometry = calloc(1, sizeof(struct grim_box));
-		get_capture_layout_extents(&state, geometry);
+static void destroy_captures(struct grim_state *state) {
+	struct grim_capture *capture, *capture_tmp;
+	wl_list_for_each_safe(capture, capture_tmp, &state->captures, link) {
+		wl_list_remove(&capture->link);
+		if (capture->ext_image_copy_capture_frame != NULL) {
+			ext_image_copy_capture_frame_v1_destroy(capture->ext_image_copy_capture_frame);
+		}
+		if (capture->ext_image_copy_capture_session != NULL) {
+			ext_image_copy_capture_session_v1_destroy(capture->ext_image_copy_capture_session);
+		}
+		if (capture->screencopy_frame != NULL) {
+			zwlr_screencopy_frame_v1_destroy(capture->screencopy_frame);
+		}
+		destroy_buffer(capture->buffer);
+		pixman_region32_fini(&capture->damage);
+		free(capture);
 	}
+}
 
-	pixman_image_t *image = render(&state, geometry, scale);
-	if (image == NULL) {
-		return EXIT_FAILURE;
+static void finish_state(struct grim_state *state) {
+	destroy_captures(state);
+	struct grim_output *output, *output_tmp;
+	wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
+		destroy_output(output);
+	}
+	struct grim_toplevel *toplevel, *toplevel_tmp;
+	wl_list_for_each_safe(toplevel, toplevel_tmp, &state->toplevels, link) {
+		destroy_toplevel(toplevel);
+	}
+	if (state->foreign_toplevel_list != NULL) {
+		ext_foreign_toplevel_list_v1_destroy(state->foreign_toplevel_list);
+	}
+	if (state->ext_output_image_capture_source_manager != NULL) {
+		ext_output_image_capture_source_manager_v1_destroy(state->ext_output_image_capture_source_manager);
+	}
+	if (state->ext_foreign_toplevel_image_capture_source_manager != NULL) {
+		ext_foreign_toplevel_image_capture_source_manager_v1_destroy(state->ext_foreign_toplevel_image_capture_source_manager);
+	}
+	if (state->ext_image_copy_capture_manager != NULL) {
+		ext_image_copy_capture_manager_v1_destroy(state->ext_image_copy_capture_manager);
+	}
+	if (state->screencopy_manager != NULL) {
+		zwlr_screencopy_manager_v1_destroy(state->screencopy_manager);
+	}
+	if (state->xdg_output_manager != NULL) {
+		zxdg_output_manager_v1_destroy(state->xdg_output_manager);
 	}
+	destroy_pool(state->pool);
+	destroy_shm_pool(state->shm_pool);
+	if (state->shm != NULL) {
+		wl_shm_destroy(state->shm);
+	}
+	if (state->registry != NULL) {
+		wl_registry_destroy(state->registry);
+	}
+	if (state->display != NULL) {
+		wl_display_disconnect(state->display);
+	}
+}
+
+/**
+ * Writes an image on its own, preceded by a stream header for Y4M.
+ */
+static int write_single_image(pixman_image_t *image,
+		enum wl_output_transform transform, const struct timespec *time,
+		FILE *file, const struct grim_request *request,
+		struct grim_state *state) {
+	if (request->filetype == GRIM_FILETYPE_Y4M &&
+			write_y4m_header(file, pixman_image_get_width(image),
+				pixman_image_get_height(image), 0,
+				&request->y4m_format) == -1) {
+		return -1;
+	}
+	return write_image(image, transform, time, file, request, state);
+}
+
+static bool can_write_bands(const struct grim_request *request) {
+	return request->band_rows > 0 &&
+		(request->filetype == GRIM_FILETYPE_PPM ||
+		request->filetype == GRIM_FILETYPE_QOI ||
+		request->filetype == GRIM_FILETYPE_JPEG);
+}
 
+struct grim_band_writer {
+	const struct grim_request *request;
 	FILE *file;
-	if (strcmp(output_filename, "-") == 0) {
-		file = stdout;
-	} else {
-		file = fopen(output_filepath, "w");
-		if (!file) {
-			fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
-				output_filepath, strerror(errno));
-			return EXIT_FAILURE;
-		}
+	struct grim_qoi_writer *qoi;
+#if HAVE_JPEG
+	struct grim_jpeg_writer *jpeg;
+#endif
+};
+
+static bool write_band(pixman_image_t *band, void *data) {
+	struct grim_band_writer *writer = data;
+	switch (writer->request->filetype) {
+	case GRIM_FILETYPE_PPM:
+		return write_ppm_rows(band, writer->file) == 0;
+	case GRIM_FILETYPE_QOI:
+		return qoi_writer_write_rows(writer->qoi, band) == 0;
+	case GRIM_FILETYPE_JPEG:
+#if HAVE_JPEG
+		return jpeg_writer_write_rows(writer->jpeg, band) == 0;
+#endif
+	default:
+		abort();
 	}
+}
 
-	int ret = 0;
-	switch (output_filetype) {
+/**
+ * Renders the captures and encodes the image band by band, see
+ * render_bands(). The buffers of the captures can't be used afterwards.
+ */
+static int write_bands(struct grim_state *state, struct grim_box *geometry,
+		double scale, FILE *file, const struct grim_request *request) {
+	int width, height;
+	get_render_size(geometry, scale, &width, &height);
+
+	struct grim_band_writer writer = {
+		.request = request,
+		.file = file,
+	};
+	bool ok = true;
+	switch (request->filetype) {
 	case GRIM_FILETYPE_PPM:
-		ret = write_to_ppm_stream(image, file);
+		ok = write_ppm_header(file, width, height) == 0;
 		break;
-	case GRIM_FILETYPE_PNG:
-		ret = write_to_png_stream(image, file, png_level);
+	case GRIM_FILETYPE_QOI:
+		// Whether the image is opaque isn't known before it's rendered,
+		// the writer fixes the header up afterwards
+		writer.qoi = create_qoi_writer(file, width, height, false);
+		ok = writer.qoi != NULL;
 		break;
 	case GRIM_FILETYPE_JPEG:
 #if HAVE_JPEG
-		ret = write_to_jpeg_stream(image, file, jpeg_quality);
+		writer.jpeg = create_jpeg_writer(file, PIXMAN_a8r8g8b8, width,
+			height, request->jpeg_quality);
+		ok = writer.jpeg != NULL;
 		break;
-#else
+#endif
+	default:
 		abort();
+	}
+	if (!ok) {
+		return -1;
+	}
+
+	ok = render_bands(state, geometry, scale, request->filter,
+		request->band_rows, write_band, &writer);
+
+	if (writer.qoi != NULL) {
+		ok = finish_qoi_writer(writer.qoi) == 0 && ok;
+	}
+#if HAVE_JPEG
+	if (writer.jpeg != NULL) {
+		ok = finish_jpeg_writer(writer.jpeg) == 0 && ok;
+	}
 #endif
+	return ok ? 0 : -1;
+}
+
+/**
+ * Captures a single image and writes it to file. Returns an error message
+ * for the daemon client, or NULL on success.
+ */
+static const char *capture_to_file(struct grim_state *state,
+		const struct grim_request *request, FILE *file) {
+	if (!check_capture_support(state, request)) {
+		return "screen capture not supported";
+	}
+
+	const char *error = NULL;
+	struct grim_box geometry;
+	bool use_layout_extents;
+	double scale;
+	if (!start_captures(state, request, NULL, 0, &geometry,
+			&use_layout_extents, &scale) ||
+			!wait_captures(state)) {
+		error = "capture failed";
+	} else {
+		if (use_layout_extents) {
+			get_capture_layout_extents(state, &geometry);
+		}
+		// Raw images can be written as the compositor handed them out
+		enum wl_output_transform transform = WL_OUTPUT_TRANSFORM_NORMAL;
+		pixman_image_t *image = get_capture_view(state, &geometry, scale,
+			request->filetype == GRIM_FILETYPE_RAW ? &transform : NULL);
+		if (image == NULL && can_write_bands(request)) {
+			if (write_bands(state, &geometry, scale, file, request) == -1) {
+				error = "failed to write image";
+			}
+		} else {
+			if (image == NULL) {
+				image = render(state, &geometry, scale, request->filter);
+			}
+			if (image == NULL) {
+				error = "render failed";
+			} else {
+				struct timespec time;
+				if (write_single_image(image, transform,
+						get_captures_time(state, &time) ? &time : NULL,
+						file, request, state) == -1) {
+					error = "failed to write image";
+				}
+				pixman_image_unref(image);
+			}
+		}
+	}
+
+	// Keep the pool, its memory is reused by the next request
+	destroy_captures(state);
+	return error;
+}
+
+static void handle_daemon_client(struct grim_state *state, int fd) {
+	// Don't let a stuck client block the daemon, writing the destination
+	// times out as well
+	struct timeval timeout = { .tv_sec = 1 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char buf[4096];
+	struct grim_request request;
+	int dest_fd = -1;
+	if (!daemon_read_request(fd, buf, sizeof(buf), &request, &dest_fd) ||
+			!check_request(&request)) {
+		if (dest_fd >= 0) {
+			close(dest_fd);
+		}
+		daemon_send_reply(fd, "invalid request");
+		return;
+	}
+
+	FILE *file = daemon_open_dest(dest_fd);
+	if (file == NULL) {
+		close(dest_fd);
+		daemon_send_reply(fd, "invalid destination");
+		return;
 	}
-	if (ret == -1) {
-		// Error messages will be printed at the source
+	const char *error = capture_to_file(state, &request, file);
+	// A stalled destination only sets the error flag of the stream
+	bool write_failed = ferror(file);
+	if ((fclose(file) != 0 || write_failed) && error == NULL) {
+		error = "failed to write image";
+	}
+	daemon_send_reply(fd, error);
+}
+
+static int run_daemon(int n_threads) {
+	char *socket_path = get_daemon_socket_path();
+	if (socket_path == NULL) {
+		fprintf(stderr, "failed to get the daemon socket path, "
+			"set GRIM_SOCKET or XDG_RUNTIME_DIR\n");
 		return EXIT_FAILURE;
 	}
 
-	if (strcmp(output_filename, "-") != 0) {
-		fclose(file);
+	struct grim_state state;
+	if (!init_state(&state, n_threads)) {
+		return EXIT_FAILURE;
 	}
 
-	free(output_filepath);
-	pixman_image_unref(image);
+	int listen_fd = daemon_listen(socket_path);
+	if (listen_fd < 0) {
+		finish_state(&state);
+		return EXIT_FAILURE;
+	}
 
-	struct grim_capture *capture, *capture_tmp;
-	wl_list_for_each_safe(capture, capture_tmp, &state.captures, link) {
-		wl_list_remove(&capture->link);
-		if (capture->ext_image_copy_capture_frame != NULL) {
-			ext_image_copy_capture_frame_v1_destroy(capture->ext_image_copy_capture_frame);
+	struct sigaction sa = { .sa_handler = handle_stop_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	// Clients may go away before their destination is written
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	// Keep the connection and globals around, so that a request only
+	// costs the capture itself
+	int ret = EXIT_SUCCESS;
+	while (!stop_requested) {
+		while (wl_display_prepare_read(state.display) != 0) {
+			wl_display_dispatch_pending(state.display);
 		}
-		if (capture->ext_image_copy_capture_session != NULL) {
-			ext_image_copy_capture_session_v1_destroy(capture->ext_image_copy_capture_session);
+		wl_display_flush(state.display);
+
+		struct pollfd fds[] = {
+			{ .fd = wl_display_get_fd(state.display), .events = POLLIN },
+			{ .fd = listen_fd, .events = POLLIN },
+		};
+		if (poll(fds, 2, -1) < 0) {
+			wl_display_cancel_read(state.display);
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			ret = EXIT_FAILURE;
+			break;
 		}
-		if (capture->screencopy_frame != NULL) {
-			zwlr_screencopy_frame_v1_destroy(capture->screencopy_frame);
+
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(state.display) < 0) {
+				fprintf(stderr, "failed to read Wayland events\n");
+				ret = EXIT_FAILURE;
+				break;
+			}
+		} else {
+			wl_display_cancel_read(state.display);
+		}
+		if ((fds[0].revents & (POLLERR | POLLHUP)) ||
+				wl_display_dispatch_pending(state.display) < 0) {
+			fprintf(stderr, "lost the connection to the compositor\n");
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			int fd = daemon_accept(listen_fd);
+			if (fd < 0) {
+				continue;
+			}
+			handle_daemon_client(&state, fd);
+			close(fd);
 		}
-		destroy_buffer(capture->buffer);
-		free(capture);
 	}
-	struct grim_output *output, *output_tmp;
-	wl_list_for_each_safe(output, output_tmp, &state.outputs, link) {
-		wl_list_remove(&output->link);
-		free(output->name);
-		if (output->xdg_output != NULL) {
-			zxdg_output_v1_destroy(output->xdg_output);
+
+	close(listen_fd);
+	unlink(socket_path);
+	free(socket_path);
+	finish_state(&state);
+	return ret;
+}
+
+static int run_client(const struct grim_request *request, FILE *file) {
+	char *socket_path = get_daemon_socket_path();
+	if (socket_path == NULL) {
+		fprintf(stderr, "failed to get the daemon socket path, "
+			"set GRIM_SOCKET or XDG_RUNTIME_DIR\n");
+		return EXIT_FAILURE;
+	}
+
+	int fd = daemon_connect(socket_path);
+	free(socket_path);
+	if (fd < 0) {
+		return EXIT_FAILURE;
+	}
+
+	// The daemon writes to our file directly
+	bool ok = daemon_send_request(fd, request, fileno(file)) &&
+		daemon_read_reply(fd);
+	close(fd);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct grim_region {
+	struct grim_box geometry;
+	char *path; // NULL to use the output file name pattern
+	struct wl_list link;
+};
+
+/**
+ * Parses a geometry, optionally followed by a space and the file to write
+ * the region to, and appends it to the list.
+ */
+static bool add_region(struct wl_list *regions, const char *str) {
+	// A geometry contains a single space
+	const char *sep = strchr(str, ' ');
+	if (sep != NULL) {
+		sep = strchr(sep + 1, ' ');
+	}
+
+	struct grim_region *region = calloc(1, sizeof(*region));
+	char *geometry_str = sep != NULL ? strndup(str, sep - str) : strdup(str);
+	if (region == NULL || geometry_str == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(region);
+		free(geometry_str);
+		return false;
+	}
+	bool ok = parse_box(&region->geometry, geometry_str);
+	free(geometry_str);
+	if (!ok) {
+		fprintf(stderr, "invalid geometry\n");
+		free(region);
+		return false;
+	}
+
+	if (sep != NULL && sep[1] != '\0') {
+		region->path = strdup(sep + 1);
+	}
+	wl_list_insert(regions->prev, &region->link);
+	return true;
+}
+
+static void destroy_regions(struct wl_list *regions) {
+	struct grim_region *region, *region_tmp;
+	wl_list_for_each_safe(region, region_tmp, regions, link) {
+		wl_list_remove(&region->link);
+		free(region->path);
+		free(region);
+	}
+}
+
+struct grim_image_task {
+	struct grim_state *state;
+	const struct grim_request *request;
+	pixman_image_t *image; // already rendered, if set
+	// Rendered on its own if set, else geometry is rendered
+	struct grim_capture *capture;
+	struct grim_box geometry;
+	double scale;
+	char *path; // owned by the caller
+	bool ok;
+	bool ready, started; // for pipelines
+};
+
+static void write_image_task(void *data) {
+	struct grim_image_task *task = data;
+	enum wl_output_transform transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	enum wl_output_transform *view_transform =
+		task->request->filetype == GRIM_FILETYPE_RAW ? &transform : NULL;
+	pixman_image_t *image;
+	if (task->image != NULL) {
+		image = pixman_image_ref(task->image);
+	} else if (task->capture != NULL) {
+		image = get_single_capture_view(task->capture, task->scale,
+			view_transform);
+		if (image == NULL) {
+			image = render_capture(task->state, task->capture, task->scale,
+				task->request->filter);
+		}
+	} else {
+		image = get_capture_view(task->state, &task->geometry, task->scale,
+			view_transform);
+		if (image == NULL) {
+			image = render(task->state, &task->geometry, task->scale,
+				task->request->filter);
 		}
-		wl_output_release(output->wl_output);
-		free(output);
 	}
-	struct grim_toplevel *toplevel, *toplevel_tmp;
-	wl_list_for_each_safe(toplevel, toplevel_tmp, &state.toplevels, link) {
-		wl_list_remove(&toplevel->link);
-		free(toplevel->identifier);
-		ext_foreign_toplevel_handle_v1_destroy(toplevel->handle);
-		free(toplevel);
+	if (image == NULL) {
+		return;
+	}
+
+	bool to_stdout = strcmp(task->path, "-") == 0;
+	FILE *file = to_stdout ? stdout : fopen(task->path, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+			task->path, strerror(errno));
+	} else {
+		// A capture's own task may run while the others are still being
+		// copied, only read its own time then
+		struct timespec time;
+		bool has_time = task->capture != NULL ?
+			get_capture_time(task->capture, &time) :
+			get_captures_time(task->state, &time);
+		task->ok = write_single_image(image, transform,
+			has_time ? &time : NULL, file, task->request,
+			task->state) == 0;
+		if (to_stdout) {
+			fflush(file);
+		} else {
+			fclose(file);
+		}
+	}
+	pixman_image_unref(image);
+}
+
+/**
+ * Write tasks, one per capture, started from the dispatch loop as soon as
+ * their capture is ready so that encoding overlaps with the captures still
+ * in flight.
+ */
+struct grim_pipeline {
+	struct grim_state *state;
+	struct grim_task_group group;
+	struct grim_image_task *tasks;
+	size_t n_tasks;
+};
+
+static void pipeline_start_ready(struct grim_pipeline *pipeline) {
+	// Creating a buffer may grow and remap the shm pool, only start
+	// reading buffers once all of them exist
+	struct grim_capture *capture;
+	wl_list_for_each(capture, &pipeline->state->captures, link) {
+		if (capture->buffer == NULL) {
+			return;
+		}
+	}
+
+	for (size_t i = 0; i < pipeline->n_tasks; i++) {
+		struct grim_image_task *task = &pipeline->tasks[i];
+		if (task->ready && !task->started) {
+			task->started = true;
+			task_group_submit(&pipeline->group, write_image_task, task);
+		}
+	}
+}
+
+static void pipeline_handle_capture_ready(struct grim_capture *capture,
+		void *data) {
+	struct grim_pipeline *pipeline = data;
+	for (size_t i = 0; i < pipeline->n_tasks; i++) {
+		if (pipeline->tasks[i].capture == capture) {
+			pipeline->tasks[i].ready = true;
+		}
 	}
-	if (state.foreign_toplevel_list != NULL) {
-		ext_foreign_toplevel_list_v1_destroy(state.foreign_toplevel_list);
+	pipeline_start_ready(pipeline);
+}
+
+/**
+ * Waits for the captures of the tasks, writing each of them as soon as it
+ * is ready. Wayland events keep being dispatched on the calling thread.
+ */
+static bool run_pipeline(struct grim_state *state,
+		struct grim_image_task *tasks, size_t n_tasks) {
+	struct grim_pipeline pipeline = {
+		.state = state,
+		.tasks = tasks,
+		.n_tasks = n_tasks,
+	};
+	task_group_init(&pipeline.group, state->pool);
+	state->capture_ready = pipeline_handle_capture_ready;
+	state->capture_ready_data = &pipeline;
+
+	bool ok = wait_captures(state);
+	state->capture_ready = NULL;
+	state->capture_ready_data = NULL;
+	if (ok) {
+		pipeline_start_ready(&pipeline);
 	}
-	if (state.ext_output_image_capture_source_manager != NULL) {
-		ext_output_image_capture_source_manager_v1_destroy(state.ext_output_image_capture_source_manager);
+	// Tasks already started must finish even if a capture failed
+	task_group_wait(&pipeline.group);
+
+	for (size_t i = 0; i < n_tasks; i++) {
+		ok = ok && tasks[i].ok;
 	}
-	if (state.ext_foreign_toplevel_image_capture_source_manager != NULL) {
-		ext_foreign_toplevel_image_capture_source_manager_v1_destroy(state.ext_foreign_toplevel_image_capture_source_manager);
+	return ok;
+}
+
+/**
+ * Captures the outputs covering all regions once, then renders and writes
+ * the regions concurrently.
+ */
+static bool capture_regions(struct grim_state *state,
+		const struct grim_request *request, struct wl_list *regions) {
+	size_t n_regions = wl_list_length(regions);
+	struct grim_box *boxes = calloc(n_regions, sizeof(struct grim_box));
+	struct grim_image_task *tasks =
+		calloc(n_regions, sizeof(struct grim_image_task));
+	if (boxes == NULL || tasks == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(boxes);
+		free(tasks);
+		return false;
 	}
-	if (state.ext_image_copy_capture_manager != NULL) {
-		ext_image_copy_capture_manager_v1_destroy(state.ext_image_copy_capture_manager);
+
+	size_t i = 0;
+	struct grim_region *region;
+	wl_list_for_each(region, regions, link) {
+		boxes[i++] = region->geometry;
 	}
-	if (state.screencopy_manager != NULL) {
-		zwlr_screencopy_manager_v1_destroy(state.screencopy_manager);
+
+	bool ok = false;
+	struct grim_box geometry;
+	bool use_layout_extents;
+	double scale;
+	if (start_captures(state, request, boxes, n_regions, &geometry,
+			&use_layout_extents, &scale) && wait_captures(state)) {
+		struct grim_task_group group;
+		task_group_init(&group, state->pool);
+		i = 0;
+		wl_list_for_each(region, regions, link) {
+			tasks[i] = (struct grim_image_task){
+				.state = state,
+				.request = request,
+				.geometry = region->geometry,
+				.scale = scale,
+				.path = region->path,
+			};
+			task_group_submit(&group, write_image_task, &tasks[i]);
+			i++;
+		}
+		task_group_wait(&group);
+
+		ok = true;
+		for (i = 0; i < n_regions; i++) {
+			ok = ok && tasks[i].ok;
+		}
 	}
-	if (state.xdg_output_manager != NULL) {
-		zxdg_output_manager_v1_destroy(state.xdg_output_manager);
+
+	free(boxes);
+	free(tasks);
+	return ok;
+}
+
+struct grim_encode {
+	struct grim_request request;
+	char *path;
+	struct wl_list link;
+};
+
+/**
+ * Parses comma-separated "key=value" encoding options ending with the file
+ * to write, e.g. "type=jpeg,scale=0.5,file=thumb.jpeg", on top of the
+ * options of request, and appends them to the list.
+ */
+static bool add_encode(struct wl_list *encodes,
+		const struct grim_request *request, const char *spec) {
+	static const char *const keys[] = {
+		"type", "scale", "quality", "level", "chroma", "range",
+	};
+
+	struct grim_encode *encode = calloc(1, sizeof(*encode));
+	char *str = strdup(spec);
+	if (encode == NULL || str == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(encode);
+		free(str);
+		return false;
 	}
-	wl_shm_destroy(state.shm);
-	wl_registry_destroy(state.registry);
-	wl_display_disconnect(state.display);
-	free(geometry);
+	encode->request = *request;
+	encode->request.use_greatest_scale = true;
+
+	bool ok = true;
+	char *key = str;
+	while (ok && encode->path == NULL && key != NULL) {
+		// The file name may contain commas
+		if (strncmp(key, "file=", strlen("file=")) == 0) {
+			encode->path = strdup(key + strlen("file="));
+			ok = encode->path != NULL && encode->path[0] != '\0';
+			break;
+		}
+
+		char *next = strchr(key, ',');
+		if (next != NULL) {
+			*next = '\0';
+			next++;
+		}
+		char *value = strchr(key, '=');
+		ok = false;
+		if (value != NULL) {
+			*value = '\0';
+			for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+				ok = ok || strcmp(key, keys[i]) == 0;
+			}
+			// Requests are made of "key value" lines
+			*value = ' ';
+		}
+		ok = ok && parse_request_line(&encode->request, key);
+		key = next;
+	}
+	free(str);
+
+	if (!ok || encode->path == NULL) {
+		fprintf(stderr, "invalid encoding options '%s'\n", spec);
+		free(encode->path);
+		free(encode);
+		return false;
+	}
+	wl_list_insert(encodes->prev, &encode->link);
+	return true;
+}
+
+static void destroy_encodes(struct wl_list *encodes) {
+	struct grim_encode *encode, *encode_tmp;
+	wl_list_for_each_safe(encode, encode_tmp, encodes, link) {
+		wl_list_remove(&encode->link);
+		free(encode->path);
+		free(encode);
+	}
+}
+
+struct grim_render_task {
+	struct grim_state *state;
+	struct grim_box geometry;
+	double scale;
+	enum grim_filter filter;
+	pixman_image_t *image;
+};
+
+static void render_task(void *data) {
+	struct grim_render_task *task = data;
+	task->image = get_capture_view(task->state, &task->geometry, task->scale,
+		NULL);
+	if (task->image == NULL) {
+		task->image = render(task->state, &task->geometry, task->scale,
+			task->filter);
+	}
+}
+
+/**
+ * Captures once, then writes the image to path and once for each encode.
+ * The image is rendered once per distinct scale, and all renders, then all
+ * encodes, run concurrently.
+ */
+static bool capture_encodes(struct grim_state *state,
+		const struct grim_request *request, char *path,
+		struct wl_list *encodes) {
+	struct grim_box geometry;
+	bool use_layout_extents;
+	double scale;
+	if (!start_captures(state, request, NULL, 0, &geometry,
+			&use_layout_extents, &scale) || !wait_captures(state)) {
+		return false;
+	}
+	if (use_layout_extents) {
+		get_capture_layout_extents(state, &geometry);
+	}
+
+	size_t n_images = wl_list_length(encodes) + 1;
+	struct grim_image_task *image_tasks =
+		calloc(n_images, sizeof(struct grim_image_task));
+	struct grim_render_task *render_tasks =
+		calloc(n_images, sizeof(struct grim_render_task));
+	size_t *render_indices = calloc(n_images, sizeof(size_t));
+	if (image_tasks == NULL || render_tasks == NULL ||
+			render_indices == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(image_tasks);
+		free(render_tasks);
+		free(render_indices);
+		return false;
+	}
+
+	// The first image is the one from the command line
+	size_t n_renders = 0;
+	struct wl_list *link = encodes;
+	for (size_t i = 0; i < n_images; i++) {
+		const struct grim_request *image_request = request;
+		char *image_path = path;
+		double image_scale = scale;
+		if (i > 0) {
+			link = link->next;
+			struct grim_encode *encode = wl_container_of(link, encode, link);
+			image_request = &encode->request;
+			image_path = encode->path;
+			if (!encode->request.use_greatest_scale) {
+				image_scale = encode->request.scale;
+			}
+		}
+
+		size_t j = 0;
+		while (j < n_renders && render_tasks[j].scale != image_scale) {
+			j++;
+		}
+		if (j == n_renders) {
+			render_tasks[n_renders++] = (struct grim_render_task){
+				.state = state,
+				.geometry = geometry,
+				.scale = image_scale,
+				.filter = request->filter,
+			};
+		}
+		render_indices[i] = j;
+		image_tasks[i] = (struct grim_image_task){
+			.state = state,
+			.request = image_request,
+			.path = image_path,
+		};
+	}
+
+	struct grim_task_group group;
+	task_group_init(&group, state->pool);
+	for (size_t i = 0; i < n_renders; i++) {
+		task_group_submit(&group, render_task, &render_tasks[i]);
+	}
+	task_group_wait(&group);
+
+	bool ok = true;
+	for (size_t i = 0; i < n_renders; i++) {
+		ok = ok && render_tasks[i].image != NULL;
+	}
+	if (ok) {
+		for (size_t i = 0; i < n_images; i++) {
+			image_tasks[i].image = render_tasks[render_indices[i]].image;
+			task_group_submit(&group, write_image_task, &image_tasks[i]);
+		}
+		task_group_wait(&group);
+		for (size_t i = 0; i < n_images; i++) {
+			ok = ok && image_tasks[i].ok;
+		}
+	}
+
+	for (size_t i = 0; i < n_renders; i++) {
+		if (render_tasks[i].image != NULL) {
+			pixman_image_unref(render_tasks[i].image);
+		}
+	}
+	free(image_tasks);
+	free(render_tasks);
+	free(render_indices);
+	return ok;
+}
+
+static bool is_output_selected(struct grim_output *output,
+		const char **names, size_t n_names) {
+	if (n_names == 0) {
+		return true;
+	}
+	for (size_t i = 0; i < n_names; i++) {
+		if (output->name != NULL && strcmp(output->name, names[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Captures the selected outputs, or all of them if there are no names, and
+ * writes each of them to its own file at its own scale, concurrently.
+ */
+static bool capture_outputs(struct grim_state *state,
+		const struct grim_request *request, const char **names,
+		size_t n_names, const char *pattern) {
+	struct grim_box *boxes = calloc(n_names + 1, sizeof(struct grim_box));
+	if (boxes == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+	// Only capture the selected outputs
+	for (size_t i = 0; i < n_names; i++) {
+		struct grim_output *output, *found = NULL;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->name != NULL && strcmp(output->name, names[i]) == 0) {
+				found = output;
+				break;
+			}
+		}
+		if (found == NULL) {
+			fprintf(stderr, "unknown output '%s'\n", names[i]);
+			free(boxes);
+			return false;
+		}
+		boxes[i] = found->logical_geometry;
+	}
+
+	struct grim_box geometry;
+	bool use_layout_extents;
+	double scale;
+	bool ok = start_captures(state, request, boxes, n_names, &geometry,
+			&use_layout_extents, &scale);
+	free(boxes);
+	if (!ok) {
+		return false;
+	}
+
+	size_t n_tasks = 0;
+	struct grim_image_task *tasks = calloc(wl_list_length(&state->captures),
+		sizeof(struct grim_image_task));
+	if (tasks == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	struct grim_capture *capture;
+	wl_list_for_each(capture, &state->captures, link) {
+		struct grim_output *output = capture->output;
+		if (!is_output_selected(output, names, n_names)) {
+			continue;
+		}
+		const char *name = output->name != NULL ? output->name : "unknown";
+		char *path = format_name_filename(pattern, "o", &name);
+		if (path == NULL) {
+			fprintf(stderr, "failed to format output filename\n");
+			ok = false;
+			break;
+		}
+		// Each output keeps its own resolution
+		tasks[n_tasks++] = (struct grim_image_task){
+			.state = state,
+			.request = request,
+			.capture = capture,
+			.scale = request->use_greatest_scale ?
+				output->logical_scale : request->scale,
+			.path = path,
+		};
+	}
+
+	ok = ok && run_pipeline(state, tasks, n_tasks);
+	for (size_t i = 0; i < n_tasks; i++) {
+		free(tasks[i].path);
+	}
+	free(tasks);
+	return ok;
+}
+
+/**
+ * Captures the toplevels with the given identifiers, or all of them if
+ * there are none, and writes each of them to its own file, concurrently.
+ */
+static bool capture_toplevels(struct grim_state *state,
+		const struct grim_request *request, const char **identifiers,
+		size_t n_identifiers, const char *pattern) {
+	if (!can_capture_toplevels(state)) {
+		fprintf(stderr, "compositor doesn't support the screen capture protocol\n");
+		return false;
+	}
+
+	size_t n_toplevels = n_identifiers > 0 ?
+		n_identifiers : (size_t)wl_list_length(&state->toplevels);
+	if (n_toplevels == 0) {
+		fprintf(stderr, "no toplevel to capture\n");
+		return false;
+	}
+	struct grim_toplevel **toplevels =
+		calloc(n_toplevels, sizeof(struct grim_toplevel *));
+	struct grim_image_task *tasks =
+		calloc(n_toplevels, sizeof(struct grim_image_task));
+	if (toplevels == NULL || tasks == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		free(toplevels);
+		free(tasks);
+		return false;
+	}
+	if (n_identifiers > 0) {
+		for (size_t i = 0; i < n_identifiers; i++) {
+			toplevels[i] = find_toplevel(state, identifiers[i]);
+			if (toplevels[i] == NULL) {
+				fprintf(stderr, "cannot find toplevel '%s'\n", identifiers[i]);
+				free(toplevels);
+				free(tasks);
+				return false;
+			}
+		}
+	} else {
+		size_t i = 0;
+		struct grim_toplevel *toplevel;
+		wl_list_for_each(toplevel, &state->toplevels, link) {
+			toplevels[i++] = toplevel;
+		}
+	}
+
+	state->n_done = 0;
+	state->failed = false;
+
+	// Name the files now, toplevels may be closed while being captured.
+	// Sessions are all created before waiting, so that the compositor
+	// copies them concurrently.
+	bool ok = true;
+	for (size_t i = 0; i < n_toplevels; i++) {
+		struct grim_toplevel *toplevel = toplevels[i];
+		const char *values[] = {
+			toplevel->identifier != NULL ? toplevel->identifier : "unknown",
+			toplevel->app_id != NULL ? toplevel->app_id : "unknown",
+		};
+		char *path = format_name_filename(pattern, "ia", values);
+		if (path == NULL) {
+			fprintf(stderr, "failed to format output filename\n");
+			ok = false;
+			break;
+		}
+		create_toplevel_capture(state, toplevel, request->with_cursor);
+		struct grim_capture *capture =
+			wl_container_of(state->captures.next, capture, link);
+		tasks[i] = (struct grim_image_task){
+			.state = state,
+			.request = request,
+			.capture = capture,
+			.scale = request->use_greatest_scale ? 1.0 : request->scale,
+			.path = path,
+		};
+	}
+	free(toplevels);
+
+	ok = ok && run_pipeline(state, tasks, n_toplevels);
+	for (size_t i = 0; i < n_toplevels; i++) {
+		free(tasks[i].path);
+	}
+	free(tasks);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	struct grim_request request = {
+		.scale = 1.0,
+		.use_greatest_scale = true,
+		.filetype = GRIM_FILETYPE_PNG,
+		.jpeg_quality = 80,
+		.png_level = 6, // current default png/zlib compression level
+	};
+	bool recording = false;
+	long n_frames = 1; // 0 means until interrupted
+	double frame_rate = 0; // 0 means as fast as possible
+	bool has_n_frames = false;
+	int n_threads = get_default_threads();
+	bool daemon_mode = false;
+	bool client_mode = false;
+	struct wl_list regions;
+	wl_list_init(&regions);
+	const char **output_names = NULL;
+	size_t n_output_names = 0;
+	bool output_files = false;
+	// Parsed once all options are known, as they inherit them
+	const char **toplevel_ids = NULL;
+	size_t n_toplevel_ids = 0;
+	bool toplevel_files = false;
+	const char **encode_specs = NULL;
+	size_t n_encode_specs = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "hs:F:b:g:t:q:l:Y:R:o:Oe:cT:An:r:j:DC")) != -1) {
+		switch (opt) {
+		case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		case 's':
+			request.use_greatest_scale = false;
+			request.scale = strtod(optarg, NULL);
+			break;
+		case 'F':
+			if (strcmp(optarg, "fast") == 0) {
+				request.filter = GRIM_FILTER_FAST;
+			} else if (strcmp(optarg, "quality") == 0) {
+				request.filter = GRIM_FILTER_QUALITY;
+			} else {
+				fprintf(stderr, "filter valid values are fast or quality\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':;
+			char *band_end = NULL;
+			errno = 0;
+			request.band_rows = strtol(optarg, &band_end, 10);
+			if (*band_end != '\0' || errno || request.band_rows < 1) {
+				fprintf(stderr, "band height must be a positive integer\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'g':
+			if (strcmp(optarg, "-") == 0) {
+				// One region per line, until the end of the input
+				char *line = NULL;
+				size_t n = 0;
+				ssize_t nread;
+				bool found = false;
+				while ((nread = getline(&line, &n, stdin)) >= 0) {
+					if (nread > 0 && line[nread - 1] == '\n') {
+						line[nread - 1] = '\0';
+					}
+					if (line[0] == '\0') {
+						continue;
+					}
+					if (!add_region(&regions, line)) {
+						free(line);
+						return EXIT_FAILURE;
+					}
+					found = true;
+				}
+				free(line);
+				if (!found) {
+					fprintf(stderr, "failed to read a line from stdin\n");
+					return EXIT_FAILURE;
+				}
+			} else if (!add_region(&regions, optarg)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			if (strcmp(optarg, "png") == 0) {
+				request.filetype = GRIM_FILETYPE_PNG;
+			} else if (strcmp(optarg, "ppm") == 0) {
+				request.filetype = GRIM_FILETYPE_PPM;
+			} else if (strcmp(optarg, "qoi") == 0) {
+				request.filetype = GRIM_FILETYPE_QOI;
+			} else if (strcmp(optarg, "raw") == 0) {
+				request.filetype = GRIM_FILETYPE_RAW;
+			} else if (strcmp(optarg, "y4m") == 0) {
+				request.filetype = GRIM_FILETYPE_Y4M;
+			} else if (strcmp(optarg, "jpeg") == 0) {
+#if HAVE_JPEG
+				request.filetype = GRIM_FILETYPE_JPEG;
+#else
+				fprintf(stderr, "jpeg support disabled\n");
+				return EXIT_FAILURE;
+#endif
+			} else {
+				fprintf(stderr, "invalid filetype\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			if (request.filetype != GRIM_FILETYPE_JPEG) {
+				fprintf(stderr, "quality is used only for jpeg files\n");
+				return EXIT_FAILURE;
+			} else {
+				char *endptr = NULL;
+				errno = 0;
+				request.jpeg_quality = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || errno) {
+					fprintf(stderr, "quality must be a integer\n");
+					return EXIT_FAILURE;
+				}
+				if (request.jpeg_quality < 0 || request.jpeg_quality > 100) {
+					fprintf(stderr, "quality valid values are between 0-100\n");
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		case 'l':
+			if (request.filetype != GRIM_FILETYPE_PNG) {
+				fprintf(stderr, "compression level is used only for png files\n");
+				return EXIT_FAILURE;
+			} else if (strcmp(optarg, "fast") == 0) {
+				request.png_level = GRIM_PNG_LEVEL_FAST;
+			} else if (strcmp(optarg, "auto") == 0) {
+				request.png_level = GRIM_PNG_LEVEL_AUTO;
+			} else {
+				char *endptr = NULL;
+				errno = 0;
+				request.png_level = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || errno) {
+					fprintf(stderr, "level must be a integer\n");
+					return EXIT_FAILURE;
+				}
+				if (request.png_level < 0 || request.png_level > 9) {
+					fprintf(stderr, "compression level valid values are between 0-9\n");
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		case 'Y':
+			if (request.filetype != GRIM_FILETYPE_Y4M) {
+				fprintf(stderr, "chroma subsampling is used only for y4m files\n");
+				return EXIT_FAILURE;
+			} else if (strcmp(optarg, "420") == 0) {
+				request.y4m_format.chroma_444 = false;
+			} else if (strcmp(optarg, "444") == 0) {
+				request.y4m_format.chroma_444 = true;
+			} else {
+				fprintf(stderr, "chroma subsampling valid values are 420 or 444\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			if (request.filetype != GRIM_FILETYPE_Y4M) {
+				fprintf(stderr, "color range is used only for y4m files\n");
+				return EXIT_FAILURE;
+			} else if (strcmp(optarg, "limited") == 0) {
+				request.y4m_format.full_range = false;
+			} else if (strcmp(optarg, "full") == 0) {
+				request.y4m_format.full_range = true;
+			} else {
+				fprintf(stderr, "color range valid values are limited or full\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':;
+			const char **names = realloc(output_names,
+				(n_output_names + 1) * sizeof(const char *));
+			if (names == NULL) {
+				fprintf(stderr, "allocation failed\n");
+				return EXIT_FAILURE;
+			}
+			output_names = names;
+			output_names[n_output_names++] = optarg;
+			request.output_name = optarg;
+			break;
+		case 'O':
+			output_files = true;
+			break;
+		case 'e':;
+			const char **specs = realloc(encode_specs,
+				(n_encode_specs + 1) * sizeof(const char *));
+			if (specs == NULL) {
+				fprintf(stderr, "allocation failed\n");
+				return EXIT_FAILURE;
+			}
+			encode_specs = specs;
+			encode_specs[n_encode_specs++] = optarg;
+			break;
+		case 'c':
+			request.with_cursor = true;
+			break;
+		case 'T':;
+			const char **ids = realloc(toplevel_ids,
+				(n_toplevel_ids + 1) * sizeof(const char *));
+			if (ids == NULL) {
+				fprintf(stderr, "allocation failed\n");
+				return EXIT_FAILURE;
+			}
+			toplevel_ids = ids;
+			toplevel_ids[n_toplevel_ids++] = optarg;
+			request.toplevel_identifier = optarg;
+			break;
+		case 'A':
+			toplevel_files = true;
+			break;
+		case 'n':;
+			char *frames_end = NULL;
+			errno = 0;
+			n_frames = strtol(optarg, &frames_end, 10);
+			if (*frames_end != '\0' || errno || n_frames < 0 ||
+					n_frames > INT_MAX) {
+				fprintf(stderr, "number of frames must be a positive integer\n");
+				return EXIT_FAILURE;
+			}
+			recording = true;
+			has_n_frames = true;
+			break;
+		case 'r':;
+			char *frame_rate_end = NULL;
+			frame_rate = strtod(optarg, &frame_rate_end);
+			// The frame interval must be at least a nanosecond and fit
+			// in the nanoseconds of advance_frame_time
+			if (*frame_rate_end != '\0' || !isfinite(frame_rate) ||
+					!(frame_rate > 1e-9 && frame_rate <= 1e9)) {
+				fprintf(stderr, "frame rate must be a positive number\n");
+				return EXIT_FAILURE;
+			}
+			recording = true;
+			break;
+		case 'j':;
+			char *threads_end = NULL;
+			errno = 0;
+			n_threads = strtol(optarg, &threads_end, 10);
+			if (*threads_end != '\0' || errno || n_threads < 1) {
+				fprintf(stderr, "number of threads must be a positive integer\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'D':
+			daemon_mode = true;
+			break;
+		case 'C':
+			client_mode = true;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (daemon_mode) {
+		if (client_mode || optind < argc) {
+			printf("%s", usage);
+			return EXIT_FAILURE;
+		}
+		return run_daemon(n_threads);
+	}
+
+	// Several regions, or a region with its own file, are written to
+	// separate files
+	bool region_files = false;
+	if (!wl_list_empty(&regions)) {
+		struct grim_region *first =
+			wl_container_of(regions.next, first, link);
+		request.has_geometry = true;
+		request.geometry = first->geometry;
+		region_files = regions.next != regions.prev || first->path != NULL;
+	}
+
+	if (!check_request(&request)) {
+		return EXIT_FAILURE;
+	}
+	if (region_files && (recording || client_mode ||
+			request.toplevel_identifier != NULL)) {
+		fprintf(stderr, "several regions can't be used with -n, -r, -C or -T\n");
+		return EXIT_FAILURE;
+	}
+	// Several outputs are written to separate files
+	if (n_output_names > 1) {
+		output_files = true;
+	}
+	if (output_files) {
+		if (recording || client_mode || request.has_geometry ||
+				request.toplevel_identifier != NULL) {
+			fprintf(stderr, "-O can't be used with -n, -r, -C, -g or -T\n");
+			return EXIT_FAILURE;
+		}
+		request.output_name = NULL;
+	}
+	// Several toplevels are written to separate files
+	if (n_toplevel_ids > 1) {
+		toplevel_files = true;
+	}
+	if (toplevel_files) {
+		if (recording || client_mode || request.has_geometry ||
+				request.output_name != NULL || output_files) {
+			fprintf(stderr, "-A can't be used with -n, -r, -C, -g, -o or -O\n");
+			return EXIT_FAILURE;
+		}
+		request.toplevel_identifier = NULL;
+	}
+
+	struct wl_list encodes;
+	wl_list_init(&encodes);
+	for (size_t i = 0; i < n_encode_specs; i++) {
+		if (!add_encode(&encodes, &request, encode_specs[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+	free(encode_specs);
+	if (!wl_list_empty(&encodes) && (recording || client_mode ||
+			region_files || output_files || toplevel_files)) {
+		fprintf(stderr, "-e can't be used with -n, -r, -C, -O, -A or several "
+			"regions\n");
+		return EXIT_FAILURE;
+	}
+	if (client_mode && recording) {
+		fprintf(stderr, "-C can't be used to record\n");
+		return EXIT_FAILURE;
+	}
+	if (recording && !has_n_frames) {
+		n_frames = 0;
+	}
+
+	const char *output_filename;
+	char *output_filepath;
+	char tmp[64];
+	if (optind >= argc) {
+		const char *suffix = "";
+		if (output_files) {
+			suffix = "-%%o";
+		} else if (toplevel_files) {
+			suffix = "-%%i";
+		} else if (recording || region_files) {
+			suffix = "-%%04d";
+		}
+		if (!default_filename(tmp, sizeof(tmp), request.filetype, suffix)) {
+			fprintf(stderr, "failed to generate default filename\n");
+			return EXIT_FAILURE;
+		}
+		output_filename = tmp;
+
+		char *output_dir = get_output_dir();
+		int len = snprintf(NULL, 0, "%s/%s", output_dir, output_filename);
+		if (len < 0) {
+			perror("snprintf failed");
+			return EXIT_FAILURE;
+		}
+		output_filepath = malloc(len + 1);
+		snprintf(output_filepath, len + 1, "%s/%s", output_dir, output_filename);
+		free(output_dir);
+	} else if (optind < argc - 1) {
+		printf("%s", usage);
+		return EXIT_FAILURE;
+	} else {
+		output_filename = argv[optind];
+		output_filepath = strdup(output_filename);
+	}
+
+	bool to_stdout = strcmp(output_filename, "-") == 0;
+	if (recording && !to_stdout && !check_frame_pattern(output_filepath)) {
+		fprintf(stderr, "output file must contain one frame number "
+			"conversion such as %%04d when recording\n");
+		return EXIT_FAILURE;
+	}
+
+	if (output_files && (to_stdout ||
+			!check_name_pattern(output_filepath, "o"))) {
+		fprintf(stderr, "output file must contain the output name "
+			"conversion %%o, and no other, when writing each output to "
+			"its own file\n");
+		return EXIT_FAILURE;
+	}
+	if (toplevel_files && (to_stdout ||
+			!check_name_pattern(output_filepath, "ia"))) {
+		fprintf(stderr, "output file must contain the toplevel identifier "
+			"or app ID conversion %%i or %%a, and no other, when writing "
+			"each toplevel to its own file\n");
+		return EXIT_FAILURE;
+	}
+	if (region_files) {
+		size_t index = 0;
+		struct grim_region *region;
+		wl_list_for_each(region, &regions, link) {
+			if (region->path == NULL) {
+				if (to_stdout || !check_frame_pattern(output_filepath)) {
+					fprintf(stderr, "output file must contain one region "
+						"number conversion such as %%d for regions "
+						"without their own file\n");
+					return EXIT_FAILURE;
+				}
+				if (index > INT_MAX) {
+					fprintf(stderr, "too many regions\n");
+					return EXIT_FAILURE;
+				}
+				region->path = format_frame_filename(output_filepath,
+					(int)index);
+				if (region->path == NULL) {
+					fprintf(stderr, "failed to format output filename\n");
+					return EXIT_FAILURE;
+				}
+			}
+			index++;
+		}
+	}
+
+	if (client_mode) {
+		FILE *file = stdout;
+		if (!to_stdout) {
+			file = fopen(output_filepath, "w");
+			if (!file) {
+				fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+					output_filepath, strerror(errno));
+				return EXIT_FAILURE;
+			}
+		}
+		int ret = run_client(&request, file);
+		if (!to_stdout) {
+			fclose(file);
+		}
+		free(output_filepath);
+		return ret;
+	}
+
+	struct grim_state state;
+	if (!init_state(&state, n_threads)) {
+		return EXIT_FAILURE;
+	}
+	if (toplevel_files) {
+		bool ok = capture_toplevels(&state, &request, toplevel_ids,
+			n_toplevel_ids, output_filepath);
+		free(toplevel_ids);
+		free(output_filepath);
+		finish_state(&state);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	free(toplevel_ids);
+	if (!check_capture_support(&state, &request)) {
+		return EXIT_FAILURE;
+	}
+
+	if (!wl_list_empty(&encodes)) {
+		bool ok = capture_encodes(&state, &request, output_filepath,
+			&encodes);
+		destroy_encodes(&encodes);
+		free(output_filepath);
+		finish_state(&state);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (output_files) {
+		bool ok = capture_outputs(&state, &request, output_names,
+			n_output_names, output_filepath);
+		free(output_names);
+		free(output_filepath);
+		finish_state(&state);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	free(output_names);
+
+	if (region_files) {
+		bool ok = capture_regions(&state, &request, &regions);
+		destroy_regions(&regions);
+		free(output_filepath);
+		finish_state(&state);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	destroy_regions(&regions);
+
+	if (!recording && can_write_bands(&request)) {
+		FILE *file = stdout;
+		if (!to_stdout) {
+			file = fopen(output_filepath, "w");
+			if (!file) {
+				fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+					output_filepath, strerror(errno));
+				return EXIT_FAILURE;
+			}
+		}
+		const char *error = capture_to_file(&state, &request, file);
+		if (error != NULL) {
+			fprintf(stderr, "%s\n", error);
+		}
+		if (to_stdout) {
+			fflush(file);
+		} else {
+			fclose(file);
+		}
+		free(output_filepath);
+		finish_state(&state);
+		return error == NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	struct grim_box geometry;
+	bool use_layout_extents;
+	double scale;
+	if (!start_captures(&state, &request, NULL, 0, &geometry,
+			&use_layout_extents, &scale)) {
+		return EXIT_FAILURE;
+	}
+
+	if (recording) {
+		struct sigaction sa = { .sa_handler = handle_stop_signal };
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+	}
+
+	pixman_image_t *image = NULL;
+	bool image_is_view = false;
+	enum wl_output_transform image_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	char *encoded = NULL;
+	size_t encoded_len = 0;
+	char *prev_filepath = NULL;
+	int stream_width = 0, stream_height = 0;
+	struct timespec frame_time;
+	clock_gettime(CLOCK_MONOTONIC, &frame_time);
+	for (long frame = 0; n_frames == 0 || frame < n_frames; frame++) {
+		if (frame > 0) {
+			if (frame_rate > 0) {
+				while (!stop_requested && clock_nanosleep(CLOCK_MONOTONIC,
+						TIMER_ABSTIME, &frame_time, NULL) == EINTR) {
+					// Retry unless asked to stop
+				}
+			}
+			if (stop_requested) {
+				break;
+			}
+
+			state.n_done = 0;
+			struct grim_capture *capture;
+			wl_list_for_each(capture, &state.captures, link) {
+				capture_next_frame(capture);
+			}
+		}
+		if (frame_rate > 0) {
+			advance_frame_time(&frame_time, frame_rate);
+		}
+
+		if (!wait_captures(&state)) {
+			return EXIT_FAILURE;
+		}
+
+		struct grim_box frame_geometry = geometry;
+		if (use_layout_extents) {
+			get_capture_layout_extents(&state, &frame_geometry);
+		}
+
+		// When recording, only re-render what the compositor reported as
+		// damaged, and re-use the previous encoded frame if nothing changed
+		bool changed = true;
+		bool same_geometry = image != NULL && memcmp(&frame_geometry,
+			&geometry, sizeof(struct grim_box)) == 0;
+		enum wl_output_transform view_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+		pixman_image_t *view = get_capture_view(&state, &frame_geometry, scale,
+			request.filetype == GRIM_FILETYPE_RAW ? &view_transform : NULL);
+		if (view != NULL) {
+			// Encode straight from the shm buffer, it's up to date
+			if (same_geometry && image_is_view) {
+				struct grim_capture *capture = wl_container_of(
+					state.captures.next, capture, link);
+				changed = pixman_region32_not_empty(&capture->damage);
+			}
+			geometry = frame_geometry;
+			if (image != NULL) {
+				pixman_image_unref(image);
+			}
+			image = view;
+			image_is_view = true;
+			image_transform = view_transform;
+		} else if (same_geometry && !image_is_view) {
+			if (!render_damage(&state, &geometry, scale, request.filter,
+					image, &changed)) {
+				return EXIT_FAILURE;
+			}
+		} else {
+			geometry = frame_geometry;
+			if (image != NULL) {
+				pixman_image_unref(image);
+			}
+			image = render(&state, &geometry, scale, request.filter);
+			if (image == NULL) {
+				return EXIT_FAILURE;
+			}
+			image_is_view = false;
+			image_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+		}
+
+		// Raw frames carry their timestamp and are always written again,
+		// other unchanged frames re-use the previous one
+		bool reuse_frame = recording && !changed &&
+			request.filetype != GRIM_FILETYPE_RAW;
+
+		FILE *file;
+		char *frame_filepath = NULL;
+		if (to_stdout) {
+			file = stdout;
+		} else {
+			// The frame number must fit the %d conversion
+			if (recording && frame > INT_MAX) {
+				fprintf(stderr, "too many frames to number\n");
+				return EXIT_FAILURE;
+			}
+			frame_filepath = recording ?
+				format_frame_filename(output_filepath, (int)frame) :
+				strdup(output_filepath);
+			if (frame_filepath == NULL) {
+				fprintf(stderr, "failed to format output filename\n");
+				return EXIT_FAILURE;
+			}
+			if (reuse_frame && prev_filepath != NULL) {
+				if (!reuse_frame_file(prev_filepath, frame_filepath)) {
+					return EXIT_FAILURE;
+				}
+				free(frame_filepath);
+				continue;
+			}
+			file = fopen(frame_filepath, "w");
+			if (!file) {
+				fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+					frame_filepath, strerror(errno));
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Y4M frames written to the standard output make up a single
+		// stream, which can't change size
+		if (request.filetype == GRIM_FILETYPE_Y4M) {
+			int width = pixman_image_get_width(image);
+			int height = pixman_image_get_height(image);
+			if (!to_stdout || frame == 0) {
+				stream_width = width;
+				stream_height = height;
+				if (write_y4m_header(file, width, height, frame_rate,
+						&request.y4m_format) == -1) {
+					return EXIT_FAILURE;
+				}
+			} else if (width != stream_width || height != stream_height) {
+				fprintf(stderr, "frame size changed from %dx%d to %dx%d, "
+					"which a y4m stream can't follow\n", stream_width,
+					stream_height, width, height);
+				return EXIT_FAILURE;
+			}
+		}
+
+		// The standard output can't be read back, keep a copy of the last
+		// frame written to it. Files are written straight away.
+		struct timespec time;
+		if (recording && to_stdout && request.filetype != GRIM_FILETYPE_RAW) {
+			if (!reuse_frame || encoded == NULL) {
+				free(encoded);
+				encoded = NULL;
+				FILE *stream = open_memstream(&encoded, &encoded_len);
+				if (stream == NULL) {
+					perror("open_memstream");
+					return EXIT_FAILURE;
+				}
+				int ret = write_image(image, image_transform, NULL, stream,
+					&request, &state);
+				fclose(stream);
+				if (ret == -1) {
+					return EXIT_FAILURE;
+				}
+			}
+			size_t written = fwrite(encoded, 1, encoded_len, file);
+			if (written < encoded_len) {
+				fprintf(stderr, "Failed to write frame; only %zu of %zu bytes written\n",
+					written, encoded_len);
+				return EXIT_FAILURE;
+			}
+		} else if (write_image(image, image_transform,
+				get_captures_time(&state, &time) ? &time : NULL, file,
+				&request, &state) == -1) {
+			// Error messages will be printed at the source
+			return EXIT_FAILURE;
+		}
+
+		if (to_stdout) {
+			fflush(file);
+		} else if (fclose(file) != 0) {
+			fprintf(stderr, "Failed to write file '%s'\n", frame_filepath);
+			return EXIT_FAILURE;
+		}
+		free(prev_filepath);
+		prev_filepath = frame_filepath;
+	}
+
+	if (image != NULL) {
+		pixman_image_unref(image);
+	}
+	free(encoded);
+	free(prev_filepath);
+	free(output_filepath);
+
+	finish_state(&state);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,302 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pack.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && GRIM_LITTLE_ENDIAN
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#else
+#define HAVE_NEON_KERNELS 0
+#endif
+
+// 16.16 fixed-point reciprocals: c * table[a] >> 16 is c * 255 / a,
+// rounded down. Fully transparent and opaque pixels are left as is.
+static uint32_t unpremultiply_table[256];
+
+static void init_unpremultiply_table(void) {
+	for (int a = 0; a < 256; a++) {
+		if (a == 0 || a == 0xff) {
+			unpremultiply_table[a] = 1 << 16;
+		} else {
+			unpremultiply_table[a] = (0xff << 16) / a;
+		}
+	}
+}
+
+static inline uint8_t unpremultiply(uint8_t c, uint8_t a) {
+	uint32_t v = (c * unpremultiply_table[a]) >> 16;
+	return v > 0xff ? 0xff : v;
+}
+
+static bool is_opaque_scalar(const uint32_t *row, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		if ((row[x] >> 24) != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void pack_rgb_scalar(uint8_t *out, const uint32_t *row, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		*out++ = (row[x] >> 16) & 0xff;
+		*out++ = (row[x] >>  8) & 0xff;
+		*out++ = (row[x] >>  0) & 0xff;
+	}
+}
+
+static void pack_rgba_scalar(uint8_t *out, const uint32_t *row, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		uint8_t a = (row[x] >> 24) & 0xff;
+		*out++ = unpremultiply((row[x] >> 16) & 0xff, a);
+		*out++ = unpremultiply((row[x] >>  8) & 0xff, a);
+		*out++ = unpremultiply((row[x] >>  0) & 0xff, a);
+		*out++ = a;
+	}
+}
+
+#if HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static bool is_opaque_sse2(const uint32_t *row, size_t width) {
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	size_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&row[x]);
+		__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(v, alpha), alpha);
+		if (_mm_movemask_epi8(eq) != 0xffff) {
+			return false;
+		}
+	}
+	return is_opaque_scalar(row + x, width - x);
+}
+
+// Pixels whose alpha is 0 or 0xff don't need to be unpremultiplied
+__attribute__((target("sse2")))
+static bool is_alpha_trivial_sse2(__m128i v) {
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	__m128i a = _mm_and_si128(v, alpha);
+	__m128i trivial = _mm_or_si128(_mm_cmpeq_epi32(a, alpha),
+		_mm_cmpeq_epi32(a, _mm_setzero_si128()));
+	return _mm_movemask_epi8(trivial) == 0xffff;
+}
+
+__attribute__((target("sse2")))
+static void pack_rgba_sse2(uint8_t *out, const uint32_t *row, size_t width) {
+	const __m128i green_alpha = _mm_set1_epi32(0xff00ff00);
+	const __m128i blue = _mm_set1_epi32(0xff);
+	size_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&row[x]);
+		if (!is_alpha_trivial_sse2(v)) {
+			pack_rgba_scalar(out + 4 * x, row + x, 4);
+			continue;
+		}
+		// Swap red and blue
+		__m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), blue),
+			_mm_slli_epi32(_mm_and_si128(v, blue), 16));
+		v = _mm_or_si128(_mm_and_si128(v, green_alpha), rb);
+		_mm_storeu_si128((__m128i *)(out + 4 * x), v);
+	}
+	pack_rgba_scalar(out + 4 * x, row + x, width - x);
+}
+
+__attribute__((target("ssse3")))
+static void pack_rgb_ssse3(uint8_t *out, const uint32_t *row, size_t width) {
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+		14, 13, 12, -1, -1, -1, -1);
+	size_t x = 0;
+	// Each store writes 16 bytes for 12 bytes of pixels, so stop while
+	// there's room for the 4 extra bytes
+	for (; x + 6 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&row[x]);
+		_mm_storeu_si128((__m128i *)(out + 3 * x), _mm_shuffle_epi8(v, shuffle));
+	}
+	pack_rgb_scalar(out + 3 * x, row + x, width - x);
+}
+
+__attribute__((target("ssse3")))
+static void pack_rgba_ssse3(uint8_t *out, const uint32_t *row, size_t width) {
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+		10, 9, 8, 11, 14, 13, 12, 15);
+	size_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&row[x]);
+		if (!is_alpha_trivial_sse2(v)) {
+			pack_rgba_scalar(out + 4 * x, row + x, 4);
+			continue;
+		}
+		_mm_storeu_si128((__m128i *)(out + 4 * x), _mm_shuffle_epi8(v, shuffle));
+	}
+	pack_rgba_scalar(out + 4 * x, row + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static bool is_opaque_avx2(const uint32_t *row, size_t width) {
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	size_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&row[x]);
+		__m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(v, alpha), alpha);
+		if (_mm256_movemask_epi8(eq) != -1) {
+			return false;
+		}
+	}
+	return is_opaque_scalar(row + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void pack_rgb_avx2(uint8_t *out, const uint32_t *row, size_t width) {
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+		14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t x = 0;
+	// The second store writes up to byte 28 for 24 bytes of pixels
+	for (; x + 10 <= width; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&row[x]);
+		v = _mm256_shuffle_epi8(v, shuffle);
+		_mm_storeu_si128((__m128i *)(out + 3 * x), _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(out + 3 * x + 12), _mm256_extracti128_si256(v, 1));
+	}
+	pack_rgb_scalar(out + 3 * x, row + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void pack_rgba_avx2(uint8_t *out, const uint32_t *row, size_t width) {
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	size_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&row[x]);
+		__m256i a = _mm256_srli_epi32(v, 24);
+		__m256i inv = _mm256_i32gather_epi32((const int *)unpremultiply_table, a, 4);
+		__m256i b = _mm256_and_si256(v, mask);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+		__m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+		b = _mm256_min_epu32(_mm256_srli_epi32(_mm256_mullo_epi32(b, inv), 16), mask);
+		g = _mm256_min_epu32(_mm256_srli_epi32(_mm256_mullo_epi32(g, inv), 16), mask);
+		r = _mm256_min_epu32(_mm256_srli_epi32(_mm256_mullo_epi32(r, inv), 16), mask);
+		v = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+			_mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_slli_epi32(a, 24)));
+		_mm256_storeu_si256((__m256i *)(out + 4 * x), v);
+	}
+	pack_rgba_scalar(out + 4 * x, row + x, width - x);
+}
+#endif
+
+#if HAVE_NEON_KERNELS
+static bool is_opaque_neon(const uint32_t *row, size_t width) {
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)&row[x]);
+		if (vminvq_u8(v.val[3]) != 0xff) {
+			return false;
+		}
+	}
+	return is_opaque_scalar(row + x, width - x);
+}
+
+static void pack_rgb_neon(uint8_t *out, const uint32_t *row, size_t width) {
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		// Little-endian ARGB pixels are BGRA in memory
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)&row[x]);
+		uint8x16x3_t rgb = {{ v.val[2], v.val[1], v.val[0] }};
+		vst3q_u8(out + 3 * x, rgb);
+	}
+	pack_rgb_scalar(out + 3 * x, row + x, width - x);
+}
+
+static void pack_rgba_neon(uint8_t *out, const uint32_t *row, size_t width) {
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)&row[x]);
+		uint8x16_t trivial = vorrq_u8(vceqq_u8(v.val[3], vdupq_n_u8(0xff)),
+			vceqq_u8(v.val[3], vdupq_n_u8(0)));
+		if (vminvq_u8(trivial) != 0xff) {
+			pack_rgba_scalar(out + 4 * x, row + x, 16);
+			continue;
+		}
+		uint8x16x4_t rgba = {{ v.val[2], v.val[1], v.val[0], v.val[3] }};
+		vst4q_u8(out + 4 * x, rgba);
+	}
+	pack_rgba_scalar(out + 4 * x, row + x, width - x);
+}
+#endif
+
+static const struct grim_pack_funcs pack_funcs_scalar = {
+	.is_opaque = is_opaque_scalar,
+	.pack_rgb = pack_rgb_scalar,
+	.pack_rgba = pack_rgba_scalar,
+};
+
+#if HAVE_X86_KERNELS
+static const struct grim_pack_funcs pack_funcs_sse2 = {
+	.is_opaque = is_opaque_sse2,
+	.pack_rgb = pack_rgb_scalar,
+	.pack_rgba = pack_rgba_sse2,
+};
+
+static const struct grim_pack_funcs pack_funcs_ssse3 = {
+	.is_opaque = is_opaque_sse2,
+	.pack_rgb = pack_rgb_ssse3,
+	.pack_rgba = pack_rgba_ssse3,
+};
+
+static const struct grim_pack_funcs pack_funcs_avx2 = {
+	.is_opaque = is_opaque_avx2,
+	.pack_rgb = pack_rgb_avx2,
+	.pack_rgba = pack_rgba_avx2,
+};
+#endif
+
+#if HAVE_NEON_KERNELS
+static const struct grim_pack_funcs pack_funcs_neon = {
+	.is_opaque = is_opaque_neon,
+	.pack_rgb = pack_rgb_neon,
+	.pack_rgba = pack_rgba_neon,
+};
+#endif
+
+// Supported kernel sets, from the scalar reference to the fastest
+static const struct grim_pack_funcs *supported_pack_funcs[4];
+static size_t n_supported_pack_funcs = 0;
+static pthread_once_t pack_funcs_once = PTHREAD_ONCE_INIT;
+
+static void init_pack_funcs(void) {
+	init_unpremultiply_table();
+
+	supported_pack_funcs[n_supported_pack_funcs++] = &pack_funcs_scalar;
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		supported_pack_funcs[n_supported_pack_funcs++] = &pack_funcs_sse2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		supported_pack_funcs[n_supported_pack_funcs++] = &pack_funcs_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		supported_pack_funcs[n_supported_pack_funcs++] = &pack_funcs_avx2;
+	}
+#elif HAVE_NEON_KERNELS
+	supported_pack_funcs[n_supported_pack_funcs++] = &pack_funcs_neon;
+#endif
+}
+
+const struct grim_pack_funcs *get_pack_funcs(void) {
+	pthread_once(&pack_funcs_once, init_pack_funcs);
+	return supported_pack_funcs[n_supported_pack_funcs - 1];
+}
+
+size_t get_supported_pack_funcs(const struct grim_pack_funcs ***funcs) {
+	pthread_once(&pack_funcs_once, init_pack_funcs);
+	*funcs = supported_pack_funcs;
+	return n_supported_pack_funcs;
+}
@@ -0,0 +1,180 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "permute.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+static void copy_row_scalar(uint32_t *dest, const uint32_t *src,
+		ptrdiff_t step, int width, uint32_t alpha) {
+	if (step == 1 && alpha == 0) {
+		memcpy(dest, src, width * sizeof(uint32_t));
+		return;
+	}
+	for (int x = 0; x < width; x++) {
+		dest[x] = src[x * step] | alpha;
+	}
+}
+
+static void transpose_block_scalar(uint32_t *dest, ptrdiff_t dest_stride,
+		const uint32_t *src, ptrdiff_t x_step, ptrdiff_t y_step,
+		int width, int height, uint32_t alpha) {
+	// Read along source rows, i.e. down destination columns
+	for (int x = 0; x < width; x++) {
+		const uint32_t *s = src + x * x_step;
+		for (int y = 0; y < height; y++) {
+			dest[y * dest_stride + x] = s[y * y_step] | alpha;
+		}
+	}
+}
+
+#if HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static void copy_row_avx2(uint32_t *dest, const uint32_t *src,
+		ptrdiff_t step, int width, uint32_t alpha) {
+	if (step == 1) {
+		copy_row_scalar(dest, src, step, width, alpha);
+		return;
+	}
+
+	const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256i a = _mm256_set1_epi32(alpha);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src - x - 7));
+		v = _mm256_permutevar8x32_epi32(v, reverse);
+		_mm256_storeu_si256((__m256i *)(dest + x), _mm256_or_si256(v, a));
+	}
+	copy_row_scalar(dest + x, src - x, step, width - x, alpha);
+}
+
+// Each of the 8 rows of dest gets one element of each vector, in order
+__attribute__((target("avx2")))
+static void store_transposed_avx2(uint32_t *dest, ptrdiff_t dest_stride,
+		__m256i c[8], __m256i alpha) {
+	__m256i t[8], u[8];
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(c[i], c[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(c[i], c[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		__m256i lo = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		__m256i hi = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+		_mm256_storeu_si256((__m256i *)(dest + i * dest_stride),
+			_mm256_or_si256(lo, alpha));
+		_mm256_storeu_si256((__m256i *)(dest + (i + 4) * dest_stride),
+			_mm256_or_si256(hi, alpha));
+	}
+}
+
+// Transposes the 8x8 tile at (x, y)
+__attribute__((target("avx2")))
+static void transpose_tile_avx2(uint32_t *dest, ptrdiff_t dest_stride,
+		const uint32_t *src, ptrdiff_t x_step, ptrdiff_t y_step,
+		int x, int y, __m256i alpha) {
+	const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	// Each vector is a destination column, read from a source row
+	__m256i c[8];
+	for (int i = 0; i < 8; i++) {
+		const uint32_t *s = src + (x + i) * x_step + y * y_step;
+		if (y_step == 1) {
+			c[i] = _mm256_loadu_si256((const __m256i *)s);
+		} else {
+			c[i] = _mm256_permutevar8x32_epi32(
+				_mm256_loadu_si256((const __m256i *)(s - 7)), reverse);
+		}
+	}
+	store_transposed_avx2(dest + y * dest_stride + x, dest_stride, c, alpha);
+}
+
+__attribute__((target("avx2")))
+static void transpose_block_avx2(uint32_t *dest, ptrdiff_t dest_stride,
+		const uint32_t *src, ptrdiff_t x_step, ptrdiff_t y_step,
+		int width, int height, uint32_t alpha) {
+	const __m256i a = _mm256_set1_epi32(alpha);
+	int tiled_width = width & ~7, tiled_height = height & ~7;
+	// Go along 8 source rows at a time, whose cache lines are used up right
+	// away, while the destination lines are completed by the next rows
+	for (int x = 0; x < tiled_width; x += 8) {
+		for (int y = 0; y < tiled_height; y += 8) {
+			transpose_tile_avx2(dest, dest_stride, src, x_step, y_step,
+				x, y, a);
+		}
+	}
+
+	transpose_block_scalar(dest + tiled_width, dest_stride,
+		src + tiled_width * x_step, x_step, y_step,
+		width - tiled_width, tiled_height, alpha);
+	transpose_block_scalar(dest + tiled_height * dest_stride, dest_stride,
+		src + tiled_height * y_step, x_step, y_step,
+		width, height - tiled_height, alpha);
+}
+#endif
+
+static struct {
+	void (*copy_row)(uint32_t *dest, const uint32_t *src, ptrdiff_t step,
+		int width, uint32_t alpha);
+	void (*transpose_block)(uint32_t *dest, ptrdiff_t dest_stride,
+		const uint32_t *src, ptrdiff_t x_step, ptrdiff_t y_step,
+		int width, int height, uint32_t alpha);
+	// Transposes are split into blocks of this size, whose source rows
+	// stay in the cache
+	int block_size;
+} permute_funcs = {
+	.copy_row = copy_row_scalar,
+	.transpose_block = transpose_block_scalar,
+	.block_size = 32,
+};
+static pthread_once_t permute_funcs_once = PTHREAD_ONCE_INIT;
+
+static void init_permute_funcs(void) {
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		permute_funcs.copy_row = copy_row_avx2;
+		permute_funcs.transpose_block = transpose_block_avx2;
+		// Whole 8-pixel strips use up the source lines they read, short
+		// blocks would only revisit them
+		permute_funcs.block_size = INT_MAX;
+	}
+#endif
+}
+
+void copy_permuted(uint32_t *dest, ptrdiff_t dest_stride,
+		const uint32_t *src, ptrdiff_t x_step, ptrdiff_t y_step,
+		int width, int height, uint32_t alpha) {
+	pthread_once(&permute_funcs_once, init_permute_funcs);
+
+	if (x_step == 1 || x_step == -1) {
+		// Destination rows are source rows, maybe reversed
+		for (int y = 0; y < height; y++) {
+			permute_funcs.copy_row(dest + y * dest_stride, src + y * y_step,
+				x_step, width, alpha);
+		}
+		return;
+	}
+
+	int size = permute_funcs.block_size;
+	for (int y = 0; y < height; y += size) {
+		int block_height = height - y < size ? height - y : size;
+		for (int x = 0; x < width; x += size) {
+			int block_width = width - x < size ? width - x : size;
+			permute_funcs.transpose_block(dest + y * dest_stride + x,
+				dest_stride, src + x * x_step + y * y_step, x_step, y_step,
+				block_width, block_height, alpha);
+		}
+	}
+}
@@ -0,0 +1,168 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <wayland-util.h>
+
+#include "pool.h"
+
+struct grim_task {
+	grim_task_func_t func;
+	void *data;
+	struct grim_task_group *group;
+	struct wl_list link;
+};
+
+struct grim_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t task_cond; // a task has been queued
+	pthread_cond_t done_cond; // a task has completed
+	struct wl_list tasks;
+	bool stop;
+
+	pthread_t *threads;
+	int n_threads;
+};
+
+// Must be called with the mutex held, which is released while the task runs
+static void run_task(struct grim_pool *pool, struct grim_task *task) {
+	wl_list_remove(&task->link);
+	pthread_mutex_unlock(&pool->mutex);
+
+	task->func(task->data);
+
+	pthread_mutex_lock(&pool->mutex);
+	task->group->pending--;
+	if (task->group->pending == 0) {
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	free(task);
+}
+
+static void *worker_run(void *data) {
+	struct grim_pool *pool = data;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (!pool->stop && wl_list_empty(&pool->tasks)) {
+			pthread_cond_wait(&pool->task_cond, &pool->mutex);
+		}
+		if (pool->stop) {
+			break;
+		}
+		struct grim_task *task =
+			wl_container_of(pool->tasks.next, task, link);
+		run_task(pool, task);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+int get_default_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) {
+		return 1;
+	}
+	// Beyond this, memory bandwidth is the bottleneck
+	return n > 16 ? 16 : n;
+}
+
+struct grim_pool *create_pool(int n_threads) {
+	if (n_threads <= 1) {
+		return NULL;
+	}
+
+	struct grim_pool *pool = calloc(1, sizeof(struct grim_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->task_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	wl_list_init(&pool->tasks);
+
+	// The thread waiting on a group runs tasks too
+	pool->threads = calloc(n_threads - 1, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		destroy_pool(pool);
+		return NULL;
+	}
+	for (int i = 0; i < n_threads - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, worker_run, pool) != 0) {
+			fprintf(stderr, "failed to create worker thread\n");
+			break;
+		}
+		pool->n_threads++;
+	}
+	return pool;
+}
+
+void destroy_pool(struct grim_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->task_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (int i = 0; i < pool->n_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->task_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+int pool_get_threads(struct grim_pool *pool) {
+	return pool == NULL ? 1 : pool->n_threads + 1;
+}
+
+void task_group_init(struct grim_task_group *group, struct grim_pool *pool) {
+	group->pool = pool;
+	group->pending = 0;
+}
+
+void task_group_submit(struct grim_task_group *group, grim_task_func_t func,
+		void *data) {
+	struct grim_pool *pool = group->pool;
+	struct grim_task *task = NULL;
+	if (pool != NULL) {
+		task = calloc(1, sizeof(struct grim_task));
+	}
+	if (task == NULL) {
+		func(data);
+		return;
+	}
+	task->func = func;
+	task->data = data;
+	task->group = group;
+
+	pthread_mutex_lock(&pool->mutex);
+	wl_list_insert(pool->tasks.prev, &task->link);
+	group->pending++;
+	pthread_cond_signal(&pool->task_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void task_group_wait(struct grim_task_group *group) {
+	struct grim_pool *pool = group->pool;
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	while (group->pending > 0) {
+		if (!wl_list_empty(&pool->tasks)) {
+			struct grim_task *task =
+				wl_container_of(pool->tasks.next, task, link);
+			run_task(pool, task);
+		} else {
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
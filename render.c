@@ -6,11 +6,17 @@
 #include <pixman.h>
 
 #include "buffer.h"
+#include "downscale.h"
 #include "output-layout.h"
+#include "permute.h"
+#include "pool.h"
 #include "render.h"
 
 #include "wlr-screencopy-unstable-v1-protocol.h"
 
+// Band images rendered into by render_bands() in turn
+#define BAND_RING_SIZE 2
+
 static pixman_format_code_t get_pixman_format(enum wl_shm_format wl_fmt) {
 	switch (wl_fmt) {
 #if GRIM_LITTLE_ENDIAN
@@ -140,10 +146,674 @@ static void compute_composite_region(const struct pixman_f_transform *out2com,
 	};
 }
 
-pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
-		double scale) {
-	int common_width = geometry->width * scale;
-	int common_height = geometry->height * scale;
+static void get_capture_transform(struct grim_capture *capture,
+		struct grim_box *geometry, double scale,
+		struct pixman_f_transform *out2com) {
+	struct grim_buffer *buffer = capture->buffer;
+
+	int32_t output_x = capture->logical_geometry.x - geometry->x;
+	int32_t output_y = capture->logical_geometry.y - geometry->y;
+	int32_t output_width = capture->logical_geometry.width;
+	int32_t output_height = capture->logical_geometry.height;
+
+	int32_t raw_output_width = buffer->width;
+	int32_t raw_output_height = buffer->height;
+	apply_output_transform(capture->transform, &raw_output_width, &raw_output_height);
+
+	int output_flipped_x = get_output_flipped(capture->transform);
+	int output_flipped_y = capture->screencopy_frame_flags &
+		ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT ? -1 : 1;
+
+	// The transformation `out2com` will send a pixel in the output_image
+	// to one in the common_image
+	pixman_f_transform_init_identity(out2com);
+	pixman_f_transform_translate(out2com, NULL,
+		-(double)buffer->width / 2,
+		-(double)buffer->height / 2);
+	pixman_f_transform_scale(out2com, NULL,
+		(double)output_width / raw_output_width,
+		(double)output_height * output_flipped_y / raw_output_height);
+	pixman_f_transform_rotate(out2com, NULL,
+		round(cos(get_output_rotation(capture->transform))),
+		round(sin(get_output_rotation(capture->transform))));
+	pixman_f_transform_scale(out2com, NULL, output_flipped_x, 1);
+	pixman_f_transform_translate(out2com, NULL,
+		(double)output_width / 2,
+		(double)output_height / 2);
+	pixman_f_transform_translate(out2com, NULL, output_x, output_y);
+	pixman_f_transform_scale(out2com, NULL, scale, scale);
+}
+
+/**
+ * Everything needed to composite a capture into the common image, so that
+ * parts of it can be composited from several threads.
+ */
+struct grim_composite {
+	struct grim_buffer *buffer;
+	// The source pixels, from the buffer or from a downscaled copy of it
+	void *data;
+	int32_t width, height, stride;
+	pixman_image_t *downscaled; // NULL if not downscaled yet
+	pixman_format_code_t format;
+	struct pixman_transform com2out;
+	pixman_filter_t filter;
+	pixman_fixed_t *filter_params;
+	int n_filter_params;
+	pixman_op_t op;
+	struct grim_box dest;
+	// Set if each destination pixel is a copy of a single source pixel:
+	// the one at origin + permutation * (x, y), relative to dest
+	bool permuted;
+	int32_t origin_x, origin_y;
+	int32_t permutation[2][2];
+};
+
+/**
+ * Returns the size the buffer is about to have in the common image, to be
+ * downscaled to first. An axis which would be upscaled is kept as is.
+ */
+static void get_downscaled_size(const struct pixman_f_transform *out2com,
+		struct grim_buffer *buffer, int32_t *width, int32_t *height) {
+	// Transforms only swap and flip axes, each column has one coefficient
+	double u_scale = fmax(fabs(out2com->m[0][0]), fabs(out2com->m[1][0]));
+	double v_scale = fmax(fabs(out2com->m[0][1]), fabs(out2com->m[1][1]));
+	*width = lround(buffer->width * fmin(u_scale, 1));
+	*height = lround(buffer->height * fmin(v_scale, 1));
+	*width = *width > 0 ? *width : 1;
+	*height = *height > 0 ? *height : 1;
+}
+
+/**
+ * Checks whether the transform of a composite sends the center of each
+ * destination pixel to the center of a source pixel, i.e. only rotates by
+ * multiples of 90 degrees and flips at a unit scale, so that pixels can be
+ * copied instead of filtered.
+ */
+static bool prepare_permutation(struct grim_composite *composite) {
+	if ((composite->format != PIXMAN_a8r8g8b8 &&
+			composite->format != PIXMAN_x8r8g8b8) ||
+			composite->filter != PIXMAN_FILTER_BILINEAR ||
+			composite->op != PIXMAN_OP_SRC ||
+			composite->dest.width <= 0 || composite->dest.height <= 0) {
+		return false;
+	}
+
+	const struct pixman_transform *t = &composite->com2out;
+	if (t->matrix[2][0] != 0 || t->matrix[2][1] != 0 ||
+			t->matrix[2][2] != pixman_fixed_1) {
+		return false;
+	}
+	int32_t (*m)[2] = composite->permutation;
+	int32_t origin[2];
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			pixman_fixed_t v = t->matrix[i][j];
+			if (v != 0 && v != pixman_fixed_1 && v != -pixman_fixed_1) {
+				return false;
+			}
+			m[i][j] = v / pixman_fixed_1;
+		}
+		// Where the center of the first destination pixel lands, minus
+		// half a pixel to get to the corner of its source pixel
+		pixman_fixed_t o = (t->matrix[i][0] + t->matrix[i][1]) / 2 +
+			t->matrix[i][2] - pixman_fixed_1 / 2;
+		if (pixman_fixed_frac(o) != 0) {
+			return false;
+		}
+		origin[i] = pixman_fixed_to_int(o);
+	}
+	if (m[0][0] * m[1][1] - m[0][1] * m[1][0] == 0) {
+		return false;
+	}
+
+	// Pixels outside of the source would be transparent, leave those to
+	// pixman
+	for (int i = 0; i < 4; i++) {
+		int32_t u = i & 1 ? composite->dest.width - 1 : 0;
+		int32_t v = i & 2 ? composite->dest.height - 1 : 0;
+		int32_t x = origin[0] + m[0][0] * u + m[0][1] * v;
+		int32_t y = origin[1] + m[1][0] * u + m[1][1] * v;
+		if (x < 0 || x >= composite->width || y < 0 || y >= composite->height) {
+			return false;
+		}
+	}
+
+	composite->origin_x = origin[0];
+	composite->origin_y = origin[1];
+	return true;
+}
+
+static bool prepare_composite(struct grim_state *state,
+		struct grim_capture *capture, struct grim_box *geometry, double scale,
+		bool alone, enum grim_filter filter, struct grim_composite *composite) {
+	struct grim_buffer *buffer = capture->buffer;
+
+	pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
+	if (!pixman_fmt) {
+		fprintf(stderr, "unsupported format %d = 0x%08x\n",
+			buffer->format, buffer->format);
+		return false;
+	}
+
+	struct pixman_f_transform out2com;
+	get_capture_transform(capture, geometry, scale, &out2com);
+
+	struct grim_box composite_dest;
+	bool grid_aligned;
+	compute_composite_region(&out2com, buffer->width,
+		buffer->height, &composite_dest, &grid_aligned);
+
+	pixman_f_transform_translate(&out2com, NULL,
+		-composite_dest.x, -composite_dest.y);
+
+	struct pixman_f_transform com2out;
+	pixman_f_transform_invert(&com2out, &out2com);
+
+	*composite = (struct grim_composite){
+		.buffer = buffer,
+		.data = buffer->data,
+		.width = buffer->width,
+		.height = buffer->height,
+		.stride = buffer->stride,
+		.format = pixman_fmt,
+		.dest = composite_dest,
+	};
+
+	double x_scale = fmax(fabs(out2com.m[0][0]), fabs(out2com.m[0][1]));
+	double y_scale = fmax(fabs(out2com.m[1][0]), fabs(out2com.m[1][1]));
+	if (x_scale >= 0.75 && y_scale >= 0.75) {
+		// Bilinear scaling is relatively fast and gives decent
+		// results for upscaling and light downscaling
+		composite->filter = PIXMAN_FILTER_BILINEAR;
+	} else if (filter == GRIM_FILTER_FAST &&
+			is_downscale_format_supported(pixman_fmt)) {
+		// Average the buffer down to about its size in the common image
+		// first, which leaves a transform close to a unit scale
+		get_downscaled_size(&out2com, buffer, &composite->width,
+			&composite->height);
+		pixman_f_transform_scale(&com2out, NULL,
+			(double)composite->width / buffer->width,
+			(double)composite->height / buffer->height);
+		composite->filter = PIXMAN_FILTER_BILINEAR;
+	} else {
+		// When downscaling, convolve the output_image so that each
+		// pixel in the common_image collects colors from a region
+		// of size roughly 1/x_scale*1/y_scale in the output_image
+		composite->filter = PIXMAN_FILTER_SEPARABLE_CONVOLUTION;
+		composite->filter_params = pixman_filter_create_separable_convolution(
+			&composite->n_filter_params,
+			pixman_double_to_fixed(fmax(1., 1. / x_scale)),
+			pixman_double_to_fixed(fmax(1., 1. / y_scale)),
+			PIXMAN_KERNEL_IMPULSE, PIXMAN_KERNEL_IMPULSE,
+			PIXMAN_KERNEL_LANCZOS2, PIXMAN_KERNEL_LANCZOS2,
+			2, 2);
+	}
+	pixman_transform_from_pixman_f_transform(&composite->com2out, &com2out);
+
+	bool overlapping = false;
+	struct grim_capture *other_capture;
+	wl_list_for_each(other_capture, &state->captures, link) {
+		if (!alone && capture != other_capture &&
+				intersect_box(&capture->logical_geometry,
+				&other_capture->logical_geometry)) {
+			overlapping = true;
+		}
+	}
+	/* OP_SRC copies the image instead of blending it, and is much
+	 * faster, but this a) is incorrect in the weird case where
+	 * logical outputs overlap and are partially transparent b)
+	 * can draw the edge between two outputs incorrectly if that
+	 * edge is not exactly grid aligned in the common image */
+	composite->op = (grid_aligned && !overlapping) ? PIXMAN_OP_SRC : PIXMAN_OP_OVER;
+	composite->permuted = prepare_permutation(composite);
+	return true;
+}
+
+/**
+ * Copies the rows [y1, y2) of a permuted composite, within the clip if it
+ * isn't NULL.
+ */
+static void permute_rows(struct grim_composite *composite,
+		pixman_image_t *image, int32_t image_y, pixman_region32_t *clip,
+		int32_t y1, int32_t y2) {
+	struct grim_box *dest = &composite->dest;
+	pixman_region32_t region;
+	pixman_region32_init_rect(&region, dest->x, y1, dest->width, y2 - y1);
+	if (clip != NULL) {
+		pixman_region32_intersect(&region, &region, clip);
+	}
+	pixman_region32_intersect_rect(&region, &region, 0, image_y,
+		pixman_image_get_width(image), pixman_image_get_height(image));
+
+	uint32_t *image_data = pixman_image_get_data(image);
+	ptrdiff_t image_stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+	const uint32_t *data = composite->data;
+	ptrdiff_t stride = composite->stride / sizeof(uint32_t);
+	int32_t (*m)[2] = composite->permutation;
+	ptrdiff_t x_step = m[0][0] + m[1][0] * stride;
+	ptrdiff_t y_step = m[0][1] + m[1][1] * stride;
+	// Like OP_SRC, fill in the alpha of formats without it
+	uint32_t alpha = composite->format == PIXMAN_x8r8g8b8 ? 0xff000000 : 0;
+
+	int n_boxes = 0;
+	pixman_box32_t *boxes = pixman_region32_rectangles(&region, &n_boxes);
+	for (int i = 0; i < n_boxes; i++) {
+		int32_t u = boxes[i].x1 - dest->x, v = boxes[i].y1 - dest->y;
+		int32_t x = composite->origin_x + m[0][0] * u + m[0][1] * v;
+		int32_t y = composite->origin_y + m[1][0] * u + m[1][1] * v;
+		copy_permuted(image_data + (boxes[i].y1 - image_y) * image_stride +
+			boxes[i].x1, image_stride, data + y * stride + x, x_step, y_step,
+			boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1, alpha);
+	}
+
+	pixman_region32_fini(&region);
+}
+
+/**
+ * Composites the rows [y1, y2) of a capture, within the clip if it isn't
+ * NULL, into image, which holds the rows of the common image from image_y.
+ * pixman images lazily compute internal state, so each call uses its own
+ * source image.
+ */
+static bool composite_rows(struct grim_composite *composite,
+		pixman_image_t *image, int32_t image_y, pixman_region32_t *clip,
+		int32_t y1, int32_t y2) {
+	struct grim_box *dest = &composite->dest;
+	if (y1 < dest->y) {
+		y1 = dest->y;
+	}
+	if (y2 > dest->y + dest->height) {
+		y2 = dest->y + dest->height;
+	}
+	if (y1 >= y2) {
+		return true;
+	}
+
+	if (composite->permuted &&
+			pixman_image_get_format(image) == PIXMAN_a8r8g8b8) {
+		permute_rows(composite, image, image_y, clip, y1, y2);
+		return true;
+	}
+
+	pixman_image_t *output_image = pixman_image_create_bits(
+		composite->format, composite->width, composite->height,
+		composite->data, composite->stride);
+	if (!output_image) {
+		fprintf(stderr, "Failed to create image\n");
+		return false;
+	}
+	pixman_image_set_transform(output_image, &composite->com2out);
+	pixman_image_set_filter(output_image, composite->filter,
+		composite->filter_params, composite->n_filter_params);
+
+	// The transform maps each destination pixel on its own, so compositing
+	// a subset of the rows gives the same pixels as the whole
+	pixman_image_composite32(composite->op, output_image, NULL, image,
+		0, y1 - dest->y, 0, 0, dest->x, y1 - image_y, dest->width, y2 - y1);
+
+	pixman_image_unref(output_image);
+	return true;
+}
+
+struct grim_downscale_band {
+	pixman_image_t *src, *dest;
+	int32_t y1, y2;
+	bool ok;
+};
+
+static void downscale_band(void *data) {
+	struct grim_downscale_band *band = data;
+	band->ok = downscale_rows(band->src, band->dest, band->y1, band->y2);
+}
+
+/**
+ * Fills the rows [y1, y2) of the downscaled copy of the buffer of a
+ * composite prepared for it, in bands downscaled concurrently. The other
+ * rows are left transparent.
+ */
+static bool downscale_composite(struct grim_state *state,
+		struct grim_buffer *buffer, struct grim_composite *composite,
+		int32_t y1, int32_t y2) {
+	pixman_image_t *src = pixman_image_create_bits(composite->format,
+		buffer->width, buffer->height, buffer->data, buffer->stride);
+	pixman_image_t *dest = pixman_image_create_bits(composite->format,
+		composite->width, composite->height, NULL, 0);
+	int n_bands = 4 * pool_get_threads(state->pool);
+	if (n_bands > y2 - y1) {
+		n_bands = y2 - y1;
+	}
+	struct grim_downscale_band *bands =
+		calloc(n_bands, sizeof(struct grim_downscale_band));
+	bool ok = src != NULL && dest != NULL && (bands != NULL || n_bands == 0);
+	if (!ok) {
+		fprintf(stderr, "failed to create downscaled image\n");
+	} else {
+		struct grim_task_group group;
+		task_group_init(&group, state->pool);
+		for (int i = 0; i < n_bands; i++) {
+			bands[i] = (struct grim_downscale_band){
+				.src = src,
+				.dest = dest,
+				.y1 = y1 + (int64_t)(y2 - y1) * i / n_bands,
+				.y2 = y1 + (int64_t)(y2 - y1) * (i + 1) / n_bands,
+			};
+			task_group_submit(&group, downscale_band, &bands[i]);
+		}
+		task_group_wait(&group);
+
+		for (int i = 0; i < n_bands; i++) {
+			ok = ok && bands[i].ok;
+		}
+	}
+
+	if (src != NULL) {
+		pixman_image_unref(src);
+	}
+	if (ok) {
+		composite->downscaled = dest;
+		composite->data = pixman_image_get_data(dest);
+		composite->stride = pixman_image_get_stride(dest);
+	} else if (dest != NULL) {
+		pixman_image_unref(dest);
+	}
+	free(bands);
+	return ok;
+}
+
+struct grim_render_band {
+	struct grim_composite *composites;
+	size_t n_composites;
+	pixman_image_t *image; // the rows of the common image from image_y
+	int32_t image_y;
+	pixman_region32_t *clip;
+	bool clear; // fill the rows with transparent pixels first
+	int32_t y1, y2;
+	bool ok;
+};
+
+static void render_band(void *data) {
+	struct grim_render_band *band = data;
+	pixman_image_t *image = band->image;
+
+	if (band->clear) {
+		int stride = pixman_image_get_stride(image);
+		memset((unsigned char *)pixman_image_get_data(image) +
+			(size_t)(band->y1 - band->image_y) * stride, 0,
+			(size_t)(band->y2 - band->y1) * stride);
+	}
+
+	// Like source images, destination images can't be shared between
+	// threads, but they can share their pixels
+	pixman_image_t *band_image = pixman_image_create_bits(
+		pixman_image_get_format(image),
+		pixman_image_get_width(image),
+		pixman_image_get_height(image),
+		pixman_image_get_data(image),
+		pixman_image_get_stride(image));
+	if (!band_image) {
+		fprintf(stderr, "Failed to create image\n");
+		band->ok = false;
+		return;
+	}
+	if (band->clip != NULL) {
+		pixman_image_set_clip_region32(band_image, band->clip);
+	}
+
+	// Captures are composited in the same order as a serial render, so
+	// that overlapping captures blend identically
+	band->ok = true;
+	for (size_t i = 0; i < band->n_composites && band->ok; i++) {
+		band->ok = composite_rows(&band->composites[i], band_image,
+			band->image_y, band->clip, band->y1, band->y2);
+	}
+
+	pixman_image_unref(band_image);
+}
+
+/**
+ * Splits the rows of band in n_bands bands of its own settings, submitted
+ * to group.
+ */
+static void submit_render_bands(struct grim_task_group *group,
+		const struct grim_render_band *band, struct grim_render_band *bands,
+		int n_bands) {
+	int32_t height = band->y2 - band->y1;
+	for (int i = 0; i < n_bands; i++) {
+		bands[i] = *band;
+		bands[i].y1 = band->y1 + (int64_t)height * i / n_bands;
+		bands[i].y2 = band->y1 + (int64_t)height * (i + 1) / n_bands;
+		task_group_submit(group, render_band, &bands[i]);
+	}
+}
+
+static void finish_composites(struct grim_composite *composites,
+		size_t n_composites) {
+	for (size_t i = 0; i < n_composites; i++) {
+		free(composites[i].filter_params);
+		if (composites[i].downscaled != NULL) {
+			pixman_image_unref(composites[i].downscaled);
+		}
+	}
+	free(composites);
+}
+
+/**
+ * Gets the rows [y1, y2) of the source of a composite which the part of the
+ * common image within box samples from, with a margin for the filter.
+ */
+static void get_source_rows(struct grim_composite *composite,
+		const pixman_box32_t *box, int32_t *y1, int32_t *y2) {
+	pixman_fixed_t y_min = INT32_MAX, y_max = INT32_MIN;
+	for (int i = 0; i < 4; i++) {
+		struct pixman_vector v = {{
+			pixman_int_to_fixed((i & 1 ? box->x2 : box->x1) - composite->dest.x),
+			pixman_int_to_fixed((i & 2 ? box->y2 : box->y1) - composite->dest.y),
+			pixman_fixed_1,
+		}};
+		pixman_transform_point(&composite->com2out, &v);
+		y_min = v.vector[1] < y_min ? v.vector[1] : y_min;
+		y_max = v.vector[1] > y_max ? v.vector[1] : y_max;
+	}
+	*y1 = pixman_fixed_to_int(pixman_fixed_floor(y_min)) - 2;
+	*y2 = pixman_fixed_to_int(pixman_fixed_ceil(y_max)) + 2;
+	*y1 = *y1 > 0 ? *y1 : 0;
+	*y2 = *y2 < composite->height ? *y2 : composite->height;
+	*y2 = *y2 > *y1 ? *y2 : *y1;
+}
+
+/**
+ * Prepares the composites of all captures, or only one if only isn't NULL,
+ * and fills their downscaled copies. If clip isn't NULL, captures outside of
+ * it are left out and only the parts of the copies it needs are filled.
+ */
+static bool prepare_composites(struct grim_state *state,
+		struct grim_capture *only, struct grim_box *geometry, double scale,
+		enum grim_filter filter, pixman_region32_t *clip,
+		struct grim_composite **composites_out, size_t *n_composites_out) {
+	size_t n_composites = 0;
+	struct grim_composite *composites =
+		calloc(wl_list_length(&state->captures), sizeof(struct grim_composite));
+	if (composites == NULL && !wl_list_empty(&state->captures)) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+
+	bool ok = true;
+	struct grim_capture *capture;
+	wl_list_for_each(capture, &state->captures, link) {
+		if (capture->buffer == NULL || (only != NULL && capture != only)) {
+			continue;
+		}
+		struct grim_composite *composite = &composites[n_composites];
+		if (!prepare_composite(state, capture, geometry, scale, only != NULL,
+				filter, composite)) {
+			ok = false;
+			break;
+		}
+		n_composites++;
+
+		int32_t y1 = 0, y2 = composite->height;
+		if (clip != NULL) {
+			struct grim_box *dest = &composite->dest;
+			pixman_region32_t region;
+			pixman_region32_init_rect(&region, dest->x, dest->y,
+				dest->width, dest->height);
+			pixman_region32_intersect(&region, &region, clip);
+			bool empty = !pixman_region32_not_empty(&region);
+			if (!empty) {
+				get_source_rows(composite,
+					pixman_region32_extents(&region), &y1, &y2);
+			}
+			pixman_region32_fini(&region);
+			if (empty) {
+				// Nothing of it is redrawn
+				n_composites--;
+				free(composite->filter_params);
+				continue;
+			}
+		}
+
+		if (composite->width != capture->buffer->width ||
+				composite->height != capture->buffer->height) {
+			if (!downscale_composite(state, capture->buffer, composite,
+					y1, y2)) {
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	if (!ok) {
+		finish_composites(composites, n_composites);
+		return false;
+	}
+	*composites_out = composites;
+	*n_composites_out = n_composites;
+	return true;
+}
+
+/**
+ * Composites all captures, or only one if only isn't NULL, splitting the
+ * common image in horizontal bands rendered concurrently.
+ */
+static bool composite_captures(struct grim_state *state,
+		struct grim_capture *only, struct grim_box *geometry, double scale,
+		enum grim_filter filter, pixman_image_t *common_image,
+		pixman_region32_t *clip) {
+	struct grim_composite *composites;
+	size_t n_composites;
+	if (!prepare_composites(state, only, geometry, scale, filter, clip,
+			&composites, &n_composites)) {
+		return false;
+	}
+
+	// A few bands per thread balance uneven bands, e.g. when captures
+	// don't cover the whole common image
+	int height = pixman_image_get_height(common_image);
+	int n_bands = 4 * pool_get_threads(state->pool);
+	if (n_bands > height) {
+		n_bands = height > 0 ? height : 1;
+	}
+	bool ok = true;
+	struct grim_render_band *bands =
+		calloc(n_bands, sizeof(struct grim_render_band));
+	if (bands == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		ok = false;
+	}
+
+	if (ok) {
+		struct grim_task_group group;
+		task_group_init(&group, state->pool);
+		struct grim_render_band band = {
+			.composites = composites,
+			.n_composites = n_composites,
+			.image = common_image,
+			.clip = clip,
+			.y1 = 0,
+			.y2 = height,
+		};
+		submit_render_bands(&group, &band, bands, n_bands);
+		task_group_wait(&group);
+
+		for (int i = 0; i < n_bands; i++) {
+			ok = ok && bands[i].ok;
+		}
+	}
+
+	finish_composites(composites, n_composites);
+	free(bands);
+	return ok;
+}
+
+static pixman_image_t *create_capture_view(struct grim_capture *capture,
+		struct grim_box *geometry, double scale,
+		enum wl_output_transform *transform) {
+	struct grim_buffer *buffer = capture->buffer;
+	if (buffer == NULL) {
+		return NULL;
+	}
+
+	// Encoders take native-endian 32-bit pixels, which is what most
+	// compositors hand out anyway
+	pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
+	if (pixman_fmt != PIXMAN_a8r8g8b8 && pixman_fmt != PIXMAN_x8r8g8b8) {
+		return NULL;
+	}
+
+	// Only if compositing would be an identity copy of the whole buffer,
+	// but maybe for its transform
+	int32_t width = buffer->width, height = buffer->height;
+	if (capture->transform & WL_OUTPUT_TRANSFORM_90) {
+		width = buffer->height;
+		height = buffer->width;
+	}
+	if ((transform == NULL &&
+			capture->transform != WL_OUTPUT_TRANSFORM_NORMAL) ||
+			(capture->screencopy_frame_flags &
+			ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT) ||
+			memcmp(&capture->logical_geometry, geometry,
+			sizeof(struct grim_box)) != 0 ||
+			geometry->width * scale != width ||
+			geometry->height * scale != height) {
+		return NULL;
+	}
+	if (transform != NULL) {
+		*transform = capture->transform;
+	}
+
+	return pixman_image_create_bits(pixman_fmt, buffer->width,
+		buffer->height, buffer->data, buffer->stride);
+}
+
+pixman_image_t *get_capture_view(struct grim_state *state,
+		struct grim_box *geometry, double scale,
+		enum wl_output_transform *transform) {
+	if (wl_list_length(&state->captures) != 1) {
+		return NULL;
+	}
+	struct grim_capture *capture =
+		wl_container_of(state->captures.next, capture, link);
+	return create_capture_view(capture, geometry, scale, transform);
+}
+
+pixman_image_t *get_single_capture_view(struct grim_capture *capture,
+		double scale, enum wl_output_transform *transform) {
+	return create_capture_view(capture, &capture->logical_geometry, scale,
+		transform);
+}
+
+void get_render_size(struct grim_box *geometry, double scale,
+		int *width, int *height) {
+	*width = geometry->width * scale;
+	*height = geometry->height * scale;
+}
+
+static pixman_image_t *render_captures(struct grim_state *state,
+		struct grim_capture *only, struct grim_box *geometry, double scale,
+		enum grim_filter filter) {
+	int common_width, common_height;
+	get_render_size(geometry, scale, &common_width, &common_height);
 	pixman_image_t *common_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
 		common_width, common_height, NULL, 0);
 	if (!common_image) {
@@ -152,119 +822,209 @@ pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 		return NULL;
 	}
 
-	struct grim_capture *capture;
-	wl_list_for_each(capture, &state->captures, link) {
-		struct grim_buffer *buffer = capture->buffer;
-		if (buffer == NULL) {
-			continue;
+	if (!composite_captures(state, only, geometry, scale, filter,
+			common_image, NULL)) {
+		pixman_image_unref(common_image);
+		return NULL;
+	}
+
+	return common_image;
+}
+
+pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
+		double scale, enum grim_filter filter) {
+	return render_captures(state, NULL, geometry, scale, filter);
+}
+
+pixman_image_t *render_capture(struct grim_state *state,
+		struct grim_capture *capture, double scale, enum grim_filter filter) {
+	return render_captures(state, capture, &capture->logical_geometry, scale,
+		filter);
+}
+
+/**
+ * Discards the buffers of the composites which the rows of the common image
+ * from y on don't need anymore.
+ */
+static void discard_composite_buffers(struct grim_composite *composites,
+		size_t n_composites, int32_t y) {
+	for (size_t i = 0; i < n_composites; i++) {
+		struct grim_composite *composite = &composites[i];
+		if (composite->buffer != NULL && (composite->downscaled != NULL ||
+				composite->dest.y + composite->dest.height <= y)) {
+			discard_buffer_data(composite->buffer);
+			composite->buffer = NULL;
+		}
+	}
+}
+
+bool render_bands(struct grim_state *state, struct grim_box *geometry,
+		double scale, enum grim_filter filter, int band_height,
+		grim_band_func func, void *data) {
+	int width, height;
+	get_render_size(geometry, scale, &width, &height);
+	if (band_height > height) {
+		band_height = height > 0 ? height : 1;
+	}
+
+	struct grim_composite *composites;
+	size_t n_composites;
+	if (!prepare_composites(state, NULL, geometry, scale, filter, NULL,
+			&composites, &n_composites)) {
+		return false;
+	}
+	// Downscaled buffers have been copied already
+	discard_composite_buffers(composites, n_composites, 0);
+
+	// One band is encoded while the next one is rendered
+	bool ok = true;
+	pixman_image_t *ring[BAND_RING_SIZE] = {0};
+	for (int i = 0; i < BAND_RING_SIZE && ok; i++) {
+		ring[i] = pixman_image_create_bits(PIXMAN_a8r8g8b8, width,
+			band_height, NULL, 0);
+		if (ring[i] == NULL) {
+			fprintf(stderr, "failed to create image with size: %d x %d\n",
+				width, band_height);
+			ok = false;
+		}
+	}
+	int n_tasks = pool_get_threads(state->pool);
+	if (n_tasks > band_height) {
+		n_tasks = band_height;
+	}
+	struct grim_render_band *tasks =
+		calloc(n_tasks, sizeof(struct grim_render_band));
+	if (ok && tasks == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		ok = false;
+	}
+
+	int n_bands = (height + band_height - 1) / band_height;
+	struct grim_task_group group;
+	task_group_init(&group, state->pool);
+	for (int i = 0; i <= n_bands && ok; i++) {
+		// Rendered by the tasks submitted in the previous iteration
+		int32_t y1 = (i - 1) * band_height;
+		int32_t y2 = y1 + band_height < height ? y1 + band_height : height;
+		if (i > 0) {
+			discard_composite_buffers(composites, n_composites, y2);
+		}
+
+		if (i < n_bands) {
+			int32_t next_y = i * band_height;
+			struct grim_render_band band = {
+				.composites = composites,
+				.n_composites = n_composites,
+				.image = ring[i % BAND_RING_SIZE],
+				.image_y = next_y,
+				.clear = true,
+				.y1 = next_y,
+				.y2 = next_y + band_height < height ?
+					next_y + band_height : height,
+			};
+			submit_render_bands(&group, &band, tasks, n_tasks);
 		}
 
-		pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
-		if (!pixman_fmt) {
-			fprintf(stderr, "unsupported format %d = 0x%08x\n",
-				buffer->format, buffer->format);
-			return NULL;
+		if (i > 0) {
+			pixman_image_t *band_image = pixman_image_create_bits(
+				PIXMAN_a8r8g8b8, width, y2 - y1,
+				pixman_image_get_data(ring[(i - 1) % BAND_RING_SIZE]),
+				pixman_image_get_stride(ring[(i - 1) % BAND_RING_SIZE]));
+			if (band_image == NULL) {
+				fprintf(stderr, "Failed to create image\n");
+				ok = false;
+			} else {
+				ok = func(band_image, data);
+				pixman_image_unref(band_image);
+			}
+		}
+
+		task_group_wait(&group);
+		for (int j = 0; j < n_tasks && i < n_bands; j++) {
+			ok = ok && tasks[j].ok;
+		}
+	}
+
+	for (int i = 0; i < BAND_RING_SIZE; i++) {
+		if (ring[i] != NULL) {
+			pixman_image_unref(ring[i]);
 		}
+	}
+	free(tasks);
+	finish_composites(composites, n_composites);
+	return ok;
+}
+
+bool render_damage(struct grim_state *state, struct grim_box *geometry,
+		double scale, enum grim_filter filter, pixman_image_t *common_image,
+		bool *changed) {
+	pixman_region32_t clip;
+	pixman_region32_init(&clip);
 
-		int32_t output_x = capture->logical_geometry.x - geometry->x;
-		int32_t output_y = capture->logical_geometry.y - geometry->y;
-		int32_t output_width = capture->logical_geometry.width;
-		int32_t output_height = capture->logical_geometry.height;
-
-		int32_t raw_output_width = buffer->width;
-		int32_t raw_output_height = buffer->height;
-		apply_output_transform(capture->transform, &raw_output_width, &raw_output_height);
-
-		int output_flipped_x = get_output_flipped(capture->transform);
-		int output_flipped_y = capture->screencopy_frame_flags &
-			ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT ? -1 : 1;
-
-		pixman_image_t *output_image = pixman_image_create_bits(
-			pixman_fmt, buffer->width, buffer->height,
-			buffer->data, buffer->stride);
-		if (!output_image) {
-			fprintf(stderr, "Failed to create image\n");
-			return NULL;
+	struct grim_capture *capture;
+	wl_list_for_each(capture, &state->captures, link) {
+		if (capture->buffer == NULL ||
+				!pixman_region32_not_empty(&capture->damage)) {
+			continue;
 		}
 
-		// The transformation `out2com` will send a pixel in the output_image
-		// to one in the common_image
 		struct pixman_f_transform out2com;
-		pixman_f_transform_init_identity(&out2com);
-		pixman_f_transform_translate(&out2com, NULL,
-			-(double)buffer->width / 2,
-			-(double)buffer->height / 2);
-		pixman_f_transform_scale(&out2com, NULL,
-			(double)output_width / raw_output_width,
-			(double)output_height * output_flipped_y / raw_output_height);
-		pixman_f_transform_rotate(&out2com, NULL,
-			round(cos(get_output_rotation(capture->transform))),
-			round(sin(get_output_rotation(capture->transform))));
-		pixman_f_transform_scale(&out2com, NULL, output_flipped_x, 1);
-		pixman_f_transform_translate(&out2com, NULL,
-			(double)output_width / 2,
-			(double)output_height / 2);
-		pixman_f_transform_translate(&out2com, NULL, output_x, output_y);
-		pixman_f_transform_scale(&out2com, NULL, scale, scale);
-
-		struct grim_box composite_dest;
-		bool grid_aligned;
-		compute_composite_region(&out2com, buffer->width,
-			buffer->height, &composite_dest, &grid_aligned);
-
-		pixman_f_transform_translate(&out2com, NULL,
-			-composite_dest.x, -composite_dest.y);
-
-		struct pixman_f_transform com2out;
-		pixman_f_transform_invert(&com2out, &out2com);
-		struct pixman_transform c2o_fixedpt;
-		pixman_transform_from_pixman_f_transform(&c2o_fixedpt, &com2out);
-		pixman_image_set_transform(output_image, &c2o_fixedpt);
+		get_capture_transform(capture, geometry, scale, &out2com);
 
+		// Filters sample neighbouring source pixels, so grow the damage
+		// by the filter footprint in the common image
 		double x_scale = fmax(fabs(out2com.m[0][0]), fabs(out2com.m[0][1]));
 		double y_scale = fmax(fabs(out2com.m[1][0]), fabs(out2com.m[1][1]));
-		if (x_scale >= 0.75 && y_scale >= 0.75) {
-			// Bilinear scaling is relatively fast and gives decent
-			// results for upscaling and light downscaling
-			pixman_image_set_filter(output_image,
-				PIXMAN_FILTER_BILINEAR, NULL, 0);
-		} else {
-			// When downscaling, convolve the output_image so that each
-			// pixel in the common_image collects colors from a region
-			// of size roughly 1/x_scale*1/y_scale in the output_image
-			int n_values = 0;
-			pixman_fixed_t *conv = pixman_filter_create_separable_convolution(
-				&n_values,
-				pixman_double_to_fixed(fmax(1., 1. / x_scale)),
-				pixman_double_to_fixed(fmax(1., 1. / y_scale)),
-				PIXMAN_KERNEL_IMPULSE, PIXMAN_KERNEL_IMPULSE,
-				PIXMAN_KERNEL_LANCZOS2, PIXMAN_KERNEL_LANCZOS2,
-				2, 2);
-			pixman_image_set_filter(output_image,
-				PIXMAN_FILTER_SEPARABLE_CONVOLUTION, conv, n_values);
-			free(conv);
-		}
+		int margin = ceil(fmax(x_scale, y_scale)) + 2;
 
-		bool overlapping = false;
-		struct grim_capture *other_capture;
-		wl_list_for_each(other_capture, &state->captures, link) {
-			if (capture != other_capture && intersect_box(&capture->logical_geometry,
-					&other_capture->logical_geometry)) {
-				overlapping = true;
+		int n_rects = 0;
+		pixman_box32_t *rects =
+			pixman_region32_rectangles(&capture->damage, &n_rects);
+		for (int i = 0; i < n_rects; i++) {
+			double x_min = INFINITY, x_max = -INFINITY,
+				y_min = INFINITY, y_max = -INFINITY;
+			for (int j = 0; j < 4; j++) {
+				struct pixman_f_vector v = {{
+					j & 1 ? rects[i].x2 : rects[i].x1,
+					j & 2 ? rects[i].y2 : rects[i].y1,
+					1,
+				}};
+				pixman_f_transform_point(&out2com, &v);
+				x_min = fmin(x_min, v.v[0]);
+				x_max = fmax(x_max, v.v[0]);
+				y_min = fmin(y_min, v.v[1]);
+				y_max = fmax(y_max, v.v[1]);
 			}
+
+			int32_t x1 = floor(x_min) - margin;
+			int32_t y1 = floor(y_min) - margin;
+			int32_t x2 = ceil(x_max) + margin;
+			int32_t y2 = ceil(y_max) + margin;
+			pixman_region32_union_rect(&clip, &clip, x1, y1,
+				x2 - x1, y2 - y1);
 		}
-		/* OP_SRC copies the image instead of blending it, and is much
-		 * faster, but this a) is incorrect in the weird case where
-		 * logical outputs overlap and are partially transparent b)
-		 * can draw the edge between two outputs incorrectly if that
-		 * edge is not exactly grid aligned in the common image */
-		pixman_op_t op = (grid_aligned && !overlapping) ? PIXMAN_OP_SRC : PIXMAN_OP_OVER;
-		pixman_image_composite32(op, output_image, NULL, common_image,
-			0, 0, 0, 0, composite_dest.x, composite_dest.y,
-			composite_dest.width, composite_dest.height);
+	}
 
-		pixman_image_unref(output_image);
+	pixman_region32_intersect_rect(&clip, &clip, 0, 0,
+		pixman_image_get_width(common_image),
+		pixman_image_get_height(common_image));
+	*changed = pixman_region32_not_empty(&clip);
+	if (!*changed) {
+		pixman_region32_fini(&clip);
+		return true;
 	}
 
-	return common_image;
+	// Start from a cleared region like render() does, so that blended
+	// captures give the same result as a full render
+	int n_boxes = 0;
+	pixman_box32_t *boxes = pixman_region32_rectangles(&clip, &n_boxes);
+	pixman_color_t transparent = {0};
+	pixman_image_fill_boxes(PIXMAN_OP_SRC, common_image, &transparent,
+		n_boxes, boxes);
+
+	bool ok = composite_captures(state, NULL, geometry, scale, filter,
+		common_image, &clip);
+
+	pixman_region32_fini(&clip);
+	return ok;
 }
@@ -0,0 +1,187 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack.h"
+
+#define MAX_WIDTH 1031
+// Leaves room to start input and output rows at unaligned addresses
+#define MAX_OFFSET 3
+
+static const uint8_t edge_alphas[] = { 0, 1, 2, 127, 128, 129, 254, 255 };
+
+static uint32_t rng_state = 0x9e3779b9;
+
+static uint32_t next_random(void) {
+	// xorshift32, to get the same rows everywhere
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static uint8_t random_channel(uint8_t a) {
+	// Premultiplied colors can't exceed alpha
+	return next_random() % (a + 1);
+}
+
+static uint32_t make_pixel(uint8_t a, uint8_t r, uint8_t g, uint8_t b) {
+	return (uint32_t)a << 24 | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+}
+
+static void fill_random(uint32_t *row, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		uint8_t a = next_random() & 0xff;
+		row[x] = make_pixel(a, random_channel(a), random_channel(a),
+			random_channel(a));
+	}
+}
+
+static void fill_edge(uint32_t *row, size_t width) {
+	size_t n_alphas = sizeof(edge_alphas) / sizeof(edge_alphas[0]);
+	for (size_t x = 0; x < width; x++) {
+		uint8_t a = edge_alphas[x % n_alphas];
+		// Cycle through the darkest, middle and brightest colors
+		uint8_t c = (x / n_alphas) % 3 == 0 ? 0 :
+			(x / n_alphas) % 3 == 1 ? a / 2 : a;
+		row[x] = make_pixel(a, c, a - c, c);
+	}
+}
+
+static void fill_opaque(uint32_t *row, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		row[x] = 0xff000000 | (next_random() & 0xffffff);
+	}
+}
+
+/*
+ * The reference is the per-pixel conversion grim used before the kernels,
+ * independent of their shared tables.
+ */
+static bool is_opaque_ref(const uint32_t *row, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		if ((row[x] >> 24) != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void pack_row32_ref(uint8_t *row_out, const uint32_t *row_in,
+		size_t width, bool fully_opaque) {
+	for (size_t x = 0; x < width; x++) {
+		uint8_t b = (row_in[x] >>  0) & 0xff;
+		uint8_t g = (row_in[x] >>  8) & 0xff;
+		uint8_t r = (row_in[x] >> 16) & 0xff;
+		uint8_t a = (row_in[x] >> 24) & 0xff;
+
+		if (!fully_opaque && (a != 0 && a != 255)) {
+			uint32_t inv = (0xff << 16) / a;
+			uint32_t sr = r * inv;
+			r = sr > (0xff << 16) ? 0xff : (sr >> 16);
+			uint32_t sg = g * inv;
+			g = sg > (0xff << 16) ? 0xff : (sg >> 16);
+			uint32_t sb = b * inv;
+			b = sb > (0xff << 16) ? 0xff : (sb >> 16);
+		}
+
+		*row_out++ = r;
+		*row_out++ = g;
+		*row_out++ = b;
+		if (!fully_opaque) {
+			*row_out++ = a;
+		}
+	}
+}
+
+static bool check_row(const struct grim_pack_funcs *funcs, size_t level,
+		const uint32_t *row, size_t width, const char *kind) {
+	static uint8_t ref_out[4 * MAX_WIDTH + 1];
+	static uint8_t out_buffer[4 * MAX_WIDTH + 1 + MAX_OFFSET];
+	bool ok = true;
+
+	if (funcs->is_opaque(row, width) != is_opaque_ref(row, width)) {
+		fprintf(stderr, "level %zu: is_opaque differs on %s row of width %zu\n",
+			level, kind, width);
+		ok = false;
+	}
+
+	// Stores may be unaligned too. The last byte catches writes past the
+	// end of the row.
+	for (size_t offset = 0; offset <= MAX_OFFSET; offset++) {
+		uint8_t *out = out_buffer + offset;
+
+		memset(ref_out, 0xa5, sizeof(ref_out));
+		memset(out_buffer, 0xa5, sizeof(out_buffer));
+		pack_row32_ref(ref_out, row, width, true);
+		funcs->pack_rgb(out, row, width);
+		if (memcmp(out, ref_out, 3 * width + 1) != 0) {
+			fprintf(stderr, "level %zu: pack_rgb differs on %s row of "
+				"width %zu, output offset %zu\n", level, kind, width, offset);
+			ok = false;
+		}
+
+		memset(ref_out, 0xa5, sizeof(ref_out));
+		memset(out_buffer, 0xa5, sizeof(out_buffer));
+		pack_row32_ref(ref_out, row, width, false);
+		funcs->pack_rgba(out, row, width);
+		if (memcmp(out, ref_out, 4 * width + 1) != 0) {
+			fprintf(stderr, "level %zu: pack_rgba differs on %s row of "
+				"width %zu, output offset %zu\n", level, kind, width, offset);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+int main(void) {
+	const struct grim_pack_funcs **funcs;
+	size_t n_funcs = get_supported_pack_funcs(&funcs);
+	if (get_pack_funcs() != funcs[n_funcs - 1]) {
+		fprintf(stderr, "get_pack_funcs doesn't return the fastest kernels\n");
+		return EXIT_FAILURE;
+	}
+
+	static uint32_t buffer[MAX_WIDTH + MAX_OFFSET];
+	size_t n_failed = 0;
+	for (size_t level = 0; level < n_funcs; level++) {
+		for (size_t width = 0; width <= MAX_WIDTH; width++) {
+			// Short rows exercise the tails, a few long ones the main loops
+			if (width > 80 && width != 255 && width != 256 &&
+					width != MAX_WIDTH) {
+				continue;
+			}
+
+			for (size_t offset = 0; offset <= MAX_OFFSET; offset++) {
+				uint32_t *row = buffer + offset;
+
+				fill_random(row, width);
+				n_failed += !check_row(funcs[level], level,
+					row, width, "random");
+				fill_edge(row, width);
+				n_failed += !check_row(funcs[level], level,
+					row, width, "edge");
+
+				// A single translucent pixel at each position must be
+				// found by the opaque scan
+				fill_opaque(row, width);
+				n_failed += !check_row(funcs[level], level,
+					row, width, "opaque");
+				for (size_t x = 0; x < width; x++) {
+					uint32_t saved = row[x];
+					row[x] = make_pixel(0xfe, 0x12, 0x34, 0x56);
+					n_failed += !check_row(funcs[level], level,
+						row, width, "nearly opaque");
+					row[x] = saved;
+				}
+			}
+		}
+	}
+
+	printf("%zu kernel levels checked against the reference, "
+		"%zu failures\n", n_funcs, n_failed);
+	return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
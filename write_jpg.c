@@ -3,8 +3,11 @@
  * @license This code is free software. Do whatever you like to do with it.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <assert.h>
@@ -15,30 +18,67 @@
 
 #include "write_jpg.h"
 
-int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality) {
-	pixman_format_code_t format = pixman_image_get_format(image);
-	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+// With 4:4:4 sampling an MCU is 8x8 pixels
+#define JPEG_MCU_SIZE 8
+// Bands smaller than this aren't worth a thread
+#define JPEG_BAND_MIN_ROWS (16 * JPEG_MCU_SIZE)
+#define JPEG_MARKER_SOF0 0xC0
+#define JPEG_MARKER_RST0 0xD0
+#define JPEG_MARKER_EOI 0xD9
+#define JPEG_MARKER_SOS 0xDA
+// Size of the chunks the serial encoder writes to the stream
+#define JPEG_CHUNK_SIZE (64 * 1024)
 
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	JSAMPROW row_pointer[1];
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
+/**
+ * A libjpeg destination manager writing to a stream in fixed-size chunks,
+ * so that the compressed image is never held in memory as a whole.
+ */
+struct jpeg_stream_dest {
+	struct jpeg_destination_mgr pub;
+	FILE *stream;
+	bool failed;
+	JOCTET buffer[JPEG_CHUNK_SIZE];
+};
+
+static void write_jpeg_chunk(struct jpeg_stream_dest *dest, size_t len) {
+	if (!dest->failed && fwrite(dest->buffer, 1, len, dest->stream) < len) {
+		dest->failed = true;
+	}
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = sizeof(dest->buffer);
+}
 
-	unsigned char *data = NULL;
-	unsigned long len = 0;
-	jpeg_mem_dest(&cinfo, &data, &len);
-	cinfo.image_width = pixman_image_get_width(image);
-	cinfo.image_height = pixman_image_get_height(image);
+static void init_stream_destination(j_compress_ptr cinfo) {
+	struct jpeg_stream_dest *dest = (struct jpeg_stream_dest *)cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = sizeof(dest->buffer);
+}
+
+static boolean empty_stream_output_buffer(j_compress_ptr cinfo) {
+	// The whole buffer is to be written, regardless of free_in_buffer
+	struct jpeg_stream_dest *dest = (struct jpeg_stream_dest *)cinfo->dest;
+	write_jpeg_chunk(dest, sizeof(dest->buffer));
+	return TRUE;
+}
+
+static void term_stream_destination(j_compress_ptr cinfo) {
+	struct jpeg_stream_dest *dest = (struct jpeg_stream_dest *)cinfo->dest;
+	write_jpeg_chunk(dest, sizeof(dest->buffer) - dest->pub.free_in_buffer);
+}
+
+static void setup_jpeg_compress(struct jpeg_compress_struct *cinfo,
+		pixman_format_code_t format, int width, int height, int quality) {
+	cinfo->image_width = width;
+	cinfo->image_height = height;
 	if (format == PIXMAN_a8r8g8b8) {
-		cinfo.in_color_space = JCS_EXT_BGRA;
+		cinfo->in_color_space = JCS_EXT_BGRA;
 	} else {
-		cinfo.in_color_space = JCS_EXT_BGRX;
+		cinfo->in_color_space = JCS_EXT_BGRX;
 	}
-	cinfo.input_components = 4;
+	cinfo->input_components = 4;
 
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, quality, TRUE);
 
 	// Ensure 444 subsampling instead of 420; this significantly improves
 	// the accuracy with which colored text and single pixel features are
@@ -46,29 +86,272 @@ int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality) {
 	// can introduce significant visible changes in brightness, even at 100%
 	// quality. Note that anyone editing and resaving the image as 420 may
 	// encounter these issues again.
-	for (int i = 0; i < cinfo.num_components; i++) {
-		cinfo.comp_info[i].h_samp_factor = 1;
-		cinfo.comp_info[i].v_samp_factor = 1;
+	for (int i = 0; i < cinfo->num_components; i++) {
+		cinfo->comp_info[i].h_samp_factor = 1;
+		cinfo->comp_info[i].v_samp_factor = 1;
+	}
+}
+
+struct grim_jpeg_writer {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_stream_dest dest;
+};
+
+struct grim_jpeg_writer *create_jpeg_writer(FILE *stream,
+		pixman_format_code_t format, int width, int height, int quality) {
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	struct grim_jpeg_writer *writer = calloc(1, sizeof(struct grim_jpeg_writer));
+	if (writer == NULL) {
+		fprintf(stderr, "failed to allocate jpeg destination\n");
+		return NULL;
+	}
+	struct jpeg_stream_dest *dest = &writer->dest;
+	dest->pub.init_destination = init_stream_destination;
+	dest->pub.empty_output_buffer = empty_stream_output_buffer;
+	dest->pub.term_destination = term_stream_destination;
+	dest->stream = stream;
+
+	struct jpeg_compress_struct *cinfo = &writer->cinfo;
+	cinfo->err = jpeg_std_error(&writer->jerr);
+	jpeg_create_compress(cinfo);
+
+	cinfo->dest = &dest->pub;
+	setup_jpeg_compress(cinfo, format, width, height, quality);
+
+	jpeg_start_compress(cinfo, TRUE);
+	return writer;
+}
+
+int jpeg_writer_write_rows(struct grim_jpeg_writer *writer,
+		pixman_image_t *image) {
+	struct jpeg_compress_struct *cinfo = &writer->cinfo;
+	int height = pixman_image_get_height(image);
+	assert(cinfo->next_scanline + height <= cinfo->image_height);
+
+	JSAMPROW row_pointer[1];
+	for (int y = 0; y < height; y++) {
+		row_pointer[0] = (unsigned char *)pixman_image_get_data(image)
+			+ ((size_t)y * pixman_image_get_stride(image));
+		(void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+	}
+
+	// Errors are reported by finish_jpeg_writer()
+	return writer->dest.failed ? -1 : 0;
+}
+
+int finish_jpeg_writer(struct grim_jpeg_writer *writer) {
+	// Missing rows, after an error, are left out of the image
+	struct jpeg_compress_struct *cinfo = &writer->cinfo;
+	if (cinfo->next_scanline == cinfo->image_height) {
+		jpeg_finish_compress(cinfo);
+	}
+	jpeg_destroy_compress(cinfo);
+
+	bool failed = writer->dest.failed ||
+		cinfo->next_scanline < cinfo->image_height;
+	free(writer);
+	if (failed) {
+		fprintf(stderr, "Failed to write jpg\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int write_jpeg_serial(pixman_image_t *image, FILE *stream, int quality) {
+	struct grim_jpeg_writer *writer = create_jpeg_writer(stream,
+		pixman_image_get_format(image), pixman_image_get_width(image),
+		pixman_image_get_height(image), quality);
+	if (writer == NULL) {
+		return -1;
 	}
+	jpeg_writer_write_rows(writer, image);
+	return finish_jpeg_writer(writer);
+}
+
+struct jpeg_band {
+	const unsigned char *data;
+	int stride;
+	pixman_format_code_t format;
+	int width;
+	int quality;
+	int y1, y2;
+
+	unsigned char *out;
+	unsigned long out_len;
+	size_t header_len; // up to the end of the SOS segment
+	size_t sof_offset; // of the SOF0 marker
+};
+
+/**
+ * Encodes a band as a JPEG image of its own, with a restart marker after
+ * each MCU row.
+ */
+static void encode_jpeg_band(void *data) {
+	struct jpeg_band *band = data;
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	jpeg_mem_dest(&cinfo, &band->out, &band->out_len);
+	setup_jpeg_compress(&cinfo, band->format, band->width,
+		band->y2 - band->y1, band->quality);
+	// The bands must share their Huffman tables
+	cinfo.optimize_coding = FALSE;
+	cinfo.restart_in_rows = 1;
 
 	jpeg_start_compress(&cinfo, TRUE);
 
+	JSAMPROW row_pointers[JPEG_MCU_SIZE];
 	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer[0] = (unsigned char *)pixman_image_get_data(image)
-			+ (cinfo.next_scanline * pixman_image_get_stride(image));
-		(void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+		JDIMENSION n = cinfo.image_height - cinfo.next_scanline;
+		if (n > JPEG_MCU_SIZE) {
+			n = JPEG_MCU_SIZE;
+		}
+		for (JDIMENSION i = 0; i < n; i++) {
+			row_pointers[i] = (JSAMPROW)(band->data + (size_t)band->stride *
+				(band->y1 + cinfo.next_scanline + i));
+		}
+		(void) jpeg_write_scanlines(&cinfo, row_pointers, n);
 	}
 
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
+}
+
+static bool parse_jpeg_band(struct jpeg_band *band) {
+	const unsigned char *out = band->out;
+	size_t len = band->out_len;
+	if (len < 4 || out[len - 2] != 0xFF || out[len - 1] != JPEG_MARKER_EOI) {
+		return false;
+	}
 
-	size_t written = fwrite(data, 1, len, stream);
-	if (written < len) {
-		free(data);
-		fprintf(stderr, "Failed to write jpg; only %zu of %lu bytes written\n",
-			written, len);
+	// Skip over the marker segments following SOI
+	size_t i = 2;
+	while (i + 4 <= len && out[i] == 0xFF) {
+		uint8_t marker = out[i + 1];
+		size_t segment_len = out[i + 2] << 8 | out[i + 3];
+		if (marker == JPEG_MARKER_SOF0) {
+			band->sof_offset = i;
+		} else if (marker == JPEG_MARKER_SOS) {
+			band->header_len = i + 2 + segment_len;
+			return band->sof_offset != 0 && band->header_len <= len - 2;
+		}
+		i += 2 + segment_len;
+	}
+	return false;
+}
+
+/**
+ * Encodes bands of MCU rows concurrently, and stitches their entropy-coded
+ * segments together with restart markers, which reset the DC predictions
+ * the bands started from.
+ */
+static int write_jpeg_parallel(pixman_image_t *image, FILE *stream,
+		int quality, struct grim_pool *pool, int n_bands) {
+	int height = pixman_image_get_height(image);
+	int mcu_rows = (height + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+
+	struct jpeg_band *bands = calloc(n_bands, sizeof(struct jpeg_band));
+	if (bands == NULL) {
+		fprintf(stderr, "failed to allocate jpeg bands\n");
 		return -1;
 	}
-	free(data);
-	return 0;
+
+	struct grim_task_group group;
+	task_group_init(&group, pool);
+	for (int i = 0; i < n_bands; i++) {
+		int y2 = (int64_t)mcu_rows * (i + 1) / n_bands * JPEG_MCU_SIZE;
+		bands[i] = (struct jpeg_band){
+			.data = (unsigned char *)pixman_image_get_data(image),
+			.stride = pixman_image_get_stride(image),
+			.format = pixman_image_get_format(image),
+			.width = pixman_image_get_width(image),
+			.quality = quality,
+			.y1 = (int64_t)mcu_rows * i / n_bands * JPEG_MCU_SIZE,
+			.y2 = y2 < height ? y2 : height,
+		};
+		task_group_submit(&group, encode_jpeg_band, &bands[i]);
+	}
+	task_group_wait(&group);
+
+	int ret = 0;
+	for (int i = 0; i < n_bands; i++) {
+		if (!parse_jpeg_band(&bands[i])) {
+			fprintf(stderr, "failed to parse jpeg band\n");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	// The headers of the first band describe the whole image, but for its
+	// height. The SOF0 segment is FF C0, length, precision, then height.
+	unsigned char *sof = bands[0].out + bands[0].sof_offset;
+	sof[5] = height >> 8;
+	sof[6] = height;
+	bool ok = fwrite(bands[0].out, 1, bands[0].header_len, stream) ==
+		bands[0].header_len;
+
+	int n_restarts = 0;
+	for (int i = 0; i < n_bands && ok; i++) {
+		struct jpeg_band *band = &bands[i];
+		unsigned char *segment = band->out + band->header_len;
+		size_t segment_len = band->out_len - 2 - band->header_len;
+
+		if (i > 0) {
+			unsigned char rst[2] = { 0xFF, JPEG_MARKER_RST0 + n_restarts % 8 };
+			n_restarts++;
+			ok = fwrite(rst, 1, sizeof(rst), stream) == sizeof(rst);
+		}
+
+		// Each band numbers its restart markers from zero. Other bytes
+		// equal to 0xFF are followed by a stuffed zero.
+		unsigned char *end = segment + segment_len;
+		unsigned char *p = segment;
+		while ((p = memchr(p, 0xFF, end - p)) != NULL && p + 1 < end) {
+			if ((p[1] & 0xF8) == JPEG_MARKER_RST0) {
+				p[1] = JPEG_MARKER_RST0 + n_restarts % 8;
+				n_restarts++;
+			}
+			p += 2;
+		}
+		ok = ok && fwrite(segment, 1, segment_len, stream) == segment_len;
+	}
+
+	static const unsigned char eoi[2] = { 0xFF, JPEG_MARKER_EOI };
+	ok = ok && fwrite(eoi, 1, sizeof(eoi), stream) == sizeof(eoi);
+	if (!ok) {
+		fprintf(stderr, "failed to write jpg\n");
+		ret = -1;
+	}
+
+cleanup:
+	for (int i = 0; i < n_bands; i++) {
+		free(bands[i].out);
+	}
+	free(bands);
+	return ret;
+}
+
+int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality,
+		struct grim_pool *pool) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	// A few bands per thread, unless they would get too small. A restart
+	// interval is limited to 65535 MCUs, which is plenty for a row.
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int n_bands = 4 * pool_get_threads(pool);
+	if (n_bands > height / JPEG_BAND_MIN_ROWS) {
+		n_bands = height / JPEG_BAND_MIN_ROWS;
+	}
+	if (pool == NULL || n_bands < 2 ||
+			(width + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE > UINT16_MAX) {
+		return write_jpeg_serial(image, stream, quality);
+	}
+	return write_jpeg_parallel(image, stream, quality, pool, n_bands);
 }
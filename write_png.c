@@ -3,61 +3,157 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
 
+#include "fast_deflate.h"
+#include "pack.h"
 #include "write_png.h"
 
-static void pack_row32(uint8_t *restrict row_out, const uint32_t *restrict row_in,
-		size_t width, bool fully_opaque) {
-	for (size_t x = 0; x < width; x++) {
-		uint8_t b = (row_in[x] >>  0) & 0xff;
-		uint8_t g = (row_in[x] >>  8) & 0xff;
-		uint8_t r = (row_in[x] >> 16) & 0xff;
-		uint8_t a = (row_in[x] >> 24) & 0xff;
+// Each strip is deflated on its own, with the end of the previous strip as
+// its dictionary. Smaller strips compress worse and add a sync flush each.
+#define PNG_STRIP_MIN_SIZE (256 * 1024)
+#define PNG_STRIP_MAX_SIZE (256 * 1024 * 1024)
+#define PNG_WINDOW_SIZE 32768
+#define PNG_FILTER_HEURISTIC -1
+// With -l auto, one row out of PNG_AUTO_SAMPLE_STEP is looked at
+#define PNG_AUTO_SAMPLE_STEP 8
+#define PNG_AUTO_MAX_COLORS 256
+#define PNG_PALETTE_HASH_SIZE 1024
+
+struct png_palette {
+	uint32_t mask; // ignore the padding byte of opaque images
+	int n_colors;
+	int n_trans; // translucent colors come first
+	int bit_depth;
+	png_color colors[256];
+	png_byte trans[256];
 
-		// Unpremultiply pixels, if necessary. In practice, few images
-		// made by grim will have many pixels with fractional alpha
-		if (!fully_opaque && (a != 0 && a != 255)) {
-			uint32_t inv = (0xff << 16) / a;
-			uint32_t sr = r * inv;
-			r = sr > (0xff << 16) ? 0xff : (sr >> 16);
-			uint32_t sg = g * inv;
-			g = sg > (0xff << 16) ? 0xff : (sg >> 16);
-			uint32_t sb = b * inv;
-			b = sb > (0xff << 16) ? 0xff : (sb >> 16);
+	// Pixel to palette index
+	uint32_t keys[PNG_PALETTE_HASH_SIZE];
+	uint8_t indices[PNG_PALETTE_HASH_SIZE];
+	bool used[PNG_PALETTE_HASH_SIZE];
+};
+
+static size_t palette_slot(const struct png_palette *palette, uint32_t pixel) {
+	size_t i = (pixel * 2654435761u) >> 22; // 10 bits
+	while (palette->used[i] && palette->keys[i] != pixel) {
+		i = (i + 1) % PNG_PALETTE_HASH_SIZE;
+	}
+	return i;
+}
+
+/**
+ * Collects the colors of an image, and gives up as soon as there are more
+ * than fit in a palette.
+ */
+static bool build_palette(struct png_palette *palette, const unsigned char *data,
+		int stride, int width, int height, bool fully_opaque) {
+	palette->mask = fully_opaque ? 0xffffff : 0xffffffff;
+	int n_colors = 0;
+	for (int y = 0; y < height; y++) {
+		const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+		for (int x = 0; x < width; x++) {
+			uint32_t p = row[x] & palette->mask;
+			if (x > 0 && p == (row[x - 1] & palette->mask)) {
+				continue;
+			}
+			size_t i = palette_slot(palette, p);
+			if (palette->used[i]) {
+				continue;
+			}
+			if (n_colors == 256) {
+				return false;
+			}
+			palette->used[i] = true;
+			palette->keys[i] = p;
+			n_colors++;
 		}
+	}
 
-		*row_out++ = r;
-		*row_out++ = g;
-		*row_out++ = b;
-		if (!fully_opaque) {
-			*row_out++ = a;
+	// tRNS can leave out the opaque colors at the end
+	const struct grim_pack_funcs *funcs = get_pack_funcs();
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < PNG_PALETTE_HASH_SIZE; i++) {
+			if (!palette->used[i]) {
+				continue;
+			}
+			uint8_t rgba[4] = { 0, 0, 0, 0xff };
+			if (fully_opaque) {
+				funcs->pack_rgb(rgba, &palette->keys[i], 1);
+			} else {
+				funcs->pack_rgba(rgba, &palette->keys[i], 1);
+			}
+			if ((rgba[3] != 0xff) != (pass == 0)) {
+				continue;
+			}
+			int index = palette->n_colors++;
+			palette->indices[i] = index;
+			palette->colors[index] = (png_color){ rgba[0], rgba[1], rgba[2] };
+			palette->trans[index] = rgba[3];
+			if (pass == 0) {
+				palette->n_trans++;
+			}
 		}
 	}
+
+	palette->bit_depth = n_colors <= 2 ? 1 : n_colors <= 4 ? 2 :
+		n_colors <= 16 ? 4 : 8;
+	return true;
 }
 
-int write_to_png_stream(pixman_image_t *image, FILE *stream,
-		int comp_level) {
-	pixman_format_code_t format = pixman_image_get_format(image);
-	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+static int get_png_bits_per_pixel(bool fully_opaque,
+		const struct png_palette *palette) {
+	if (palette != NULL) {
+		return palette->bit_depth;
+	}
+	return fully_opaque ? 24 : 32;
+}
 
+static void pack_row_indexed(uint8_t *restrict row_out,
+		const uint32_t *restrict row_in, size_t width,
+		const struct png_palette *palette) {
+	int depth = palette->bit_depth;
+	int per_byte = 8 / depth;
+	memset(row_out, 0, (width * depth + 7) / 8);
+
+	uint8_t index = 0;
+	for (size_t x = 0; x < width; x++) {
+		uint32_t p = row_in[x] & palette->mask;
+		if (x == 0 || p != (row_in[x - 1] & palette->mask)) {
+			index = palette->indices[palette_slot(palette, p)];
+		}
+		row_out[x / per_byte] |= index << (8 - depth * (int)(x % per_byte + 1));
+	}
+}
+
+static void pack_row32(uint8_t *restrict row_out, const uint32_t *restrict row_in,
+		size_t width, bool fully_opaque, const struct png_palette *palette) {
+	const struct grim_pack_funcs *funcs = get_pack_funcs();
+	if (palette != NULL) {
+		pack_row_indexed(row_out, row_in, width, palette);
+	} else if (fully_opaque) {
+		funcs->pack_rgb(row_out, row_in, width);
+	} else {
+		// In practice, few images made by grim will have many pixels
+		// with fractional alpha
+		funcs->pack_rgba(row_out, row_in, width);
+	}
+}
+
+static int write_png_serial(pixman_image_t *image, FILE *stream,
+		int comp_level, bool fully_opaque, const struct png_palette *palette) {
 	int width = pixman_image_get_width(image);
 	int height = pixman_image_get_height(image);
 	int stride = pixman_image_get_stride(image);
 	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
 
-	bool fully_opaque = true;
-	if (format == PIXMAN_a8r8g8b8) {
-		for (int y = 0; y < height; y++) {
-			const uint32_t *row = (const uint32_t *)(data + y * stride);
-			for (int x = 0; x < width; x++) {
-				if ((row[x] >> 24) != 0xff) {
-					fully_opaque = false;
-				}
-			}
-		}
-	}
 	int color_type = fully_opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA;
 	int bit_depth = 8;
+	if (palette != NULL) {
+		color_type = PNG_COLOR_TYPE_PALETTE;
+		bit_depth = palette->bit_depth;
+	}
 
 	uint8_t *tmp_row = calloc(width, 4);
 	if (!tmp_row) {
@@ -93,11 +189,18 @@ int write_to_png_stream(pixman_image_t *image, FILE *stream,
 
 	png_set_IHDR(png, info, width, height, bit_depth, color_type,
 		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	if (palette != NULL) {
+		png_set_PLTE(png, info, palette->colors, palette->n_colors);
+		if (palette->n_trans > 0) {
+			png_set_tRNS(png, info, palette->trans, palette->n_trans, NULL);
+		}
+	}
 	png_write_info(png, info);
 
-	// If the level is zero (no compression), filtering will be unnecessary
+	// If the level is zero (no compression), filtering will be unnecessary.
+	// Palette indices don't predict each other, filters only get in the way.
 	png_set_compression_level(png, comp_level);
-	if (comp_level == 0) {
+	if (comp_level == 0 || palette != NULL) {
 		png_set_filter(png, 0, PNG_NO_FILTERS);
 	} else {
 		png_set_filter(png, 0, PNG_ALL_FILTERS);
@@ -105,7 +208,7 @@ int write_to_png_stream(pixman_image_t *image, FILE *stream,
 
 	for (int y = 0; y < height; y++) {
 		const uint32_t *row = (const uint32_t *)(data + y * stride);
-		pack_row32(tmp_row, row, width, fully_opaque);
+		pack_row32(tmp_row, row, width, fully_opaque, palette);
 		png_write_row(png, tmp_row);
 	}
 
@@ -121,3 +224,512 @@ cleanup:
 	free(tmp_row);
 	return ret;
 }
+
+static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	} else if (pb <= pc) {
+		return b;
+	}
+	return c;
+}
+
+static uint8_t filter_byte(int type, const uint8_t *row, const uint8_t *prev,
+		size_t i, size_t bpp) {
+	uint8_t a = i >= bpp ? row[i - bpp] : 0;
+	uint8_t b = prev[i];
+	uint8_t c = i >= bpp ? prev[i - bpp] : 0;
+	switch (type) {
+	case PNG_FILTER_VALUE_SUB:
+		return row[i] - a;
+	case PNG_FILTER_VALUE_UP:
+		return row[i] - b;
+	case PNG_FILTER_VALUE_AVG:
+		return row[i] - ((a + b) >> 1);
+	case PNG_FILTER_VALUE_PAETH:
+		return row[i] - paeth_predictor(a, b, c);
+	default:
+		return row[i];
+	}
+}
+
+/**
+ * Filters a row with the given filter type, or with the one with the
+ * minimum sum of absolute differences like libpng does if it's
+ * PNG_FILTER_HEURISTIC. prev is all zeros for the first row.
+ */
+static void filter_row(uint8_t *restrict out, const uint8_t *restrict row,
+		const uint8_t *restrict prev, size_t rowbytes, size_t bpp, int filter) {
+	int best_type = filter;
+	if (filter == PNG_FILTER_HEURISTIC) {
+		uint64_t sums[PNG_FILTER_VALUE_LAST] = {0};
+		for (size_t i = 0; i < rowbytes; i++) {
+			uint8_t a = i >= bpp ? row[i - bpp] : 0;
+			uint8_t b = prev[i];
+			uint8_t c = i >= bpp ? prev[i - bpp] : 0;
+			uint8_t x = row[i];
+			sums[PNG_FILTER_VALUE_NONE] += abs((int8_t)x);
+			sums[PNG_FILTER_VALUE_SUB] += abs((int8_t)(x - a));
+			sums[PNG_FILTER_VALUE_UP] += abs((int8_t)(x - b));
+			sums[PNG_FILTER_VALUE_AVG] += abs((int8_t)(x - ((a + b) >> 1)));
+			sums[PNG_FILTER_VALUE_PAETH] +=
+				abs((int8_t)(x - paeth_predictor(a, b, c)));
+		}
+		best_type = PNG_FILTER_VALUE_NONE;
+		for (int type = 1; type < PNG_FILTER_VALUE_LAST; type++) {
+			if (sums[type] < sums[best_type]) {
+				best_type = type;
+			}
+		}
+	}
+
+	*out++ = best_type;
+	switch (best_type) {
+	case PNG_FILTER_VALUE_NONE:
+		memcpy(out, row, rowbytes);
+		break;
+	case PNG_FILTER_VALUE_SUB:
+		memcpy(out, row, bpp);
+		for (size_t i = bpp; i < rowbytes; i++) {
+			out[i] = row[i] - row[i - bpp];
+		}
+		break;
+	default:
+		for (size_t i = 0; i < rowbytes; i++) {
+			out[i] = filter_byte(best_type, row, prev, i, bpp);
+		}
+	}
+}
+
+struct png_strip {
+	const unsigned char *data;
+	int stride;
+	int width;
+	bool fully_opaque;
+	const struct png_palette *palette; // NULL for true color
+	int level;
+	int strategy;
+	int filter;
+	int dict_filter; // filter used for the rows before the strip
+	int y1, y2;
+	bool last;
+
+	unsigned char *out;
+	size_t out_len;
+	size_t in_len;
+	uLong adler;
+	bool ok;
+};
+
+static bool deflate_png_strip(struct png_strip *strip, unsigned char *in,
+		size_t dict_len) {
+	// Raw deflate, the zlib header and trailer are written for the whole
+	// image
+	z_stream zs = {0};
+	if (deflateInit2(&zs, strip->level, Z_DEFLATED, -15, 8,
+			strip->strategy) != Z_OK) {
+		fprintf(stderr, "failed to initialize deflate\n");
+		return false;
+	}
+	if (dict_len > 0) {
+		deflateSetDictionary(&zs, in - dict_len, dict_len);
+	}
+
+	// Sync flushes end on a byte boundary without marking the last block,
+	// so the strips can be concatenated
+	size_t out_size = deflateBound(&zs, strip->in_len) + 16;
+	strip->out = malloc(out_size);
+	if (strip->out == NULL) {
+		fprintf(stderr, "failed to allocate png strip\n");
+		deflateEnd(&zs);
+		return false;
+	}
+	zs.next_in = in;
+	zs.avail_in = strip->in_len;
+	zs.next_out = strip->out;
+	zs.avail_out = out_size;
+	int ret = deflate(&zs, strip->last ? Z_FINISH : Z_SYNC_FLUSH);
+	strip->out_len = zs.total_out;
+	deflateEnd(&zs);
+	if (ret != (strip->last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0) {
+		fprintf(stderr, "failed to deflate png strip\n");
+		return false;
+	}
+	return true;
+}
+
+struct png_content_stats {
+	size_t n_pixels;
+	size_t n_runs; // same as the pixel on the left
+	size_t n_still; // same as the pixel on the left or above
+	size_t n_smooth; // close to the pixel on the left, but not the same
+	size_t n_colors; // up to PNG_AUTO_MAX_COLORS + 1
+};
+
+static bool is_smooth(uint32_t p, uint32_t a) {
+	for (int shift = 0; shift < 32; shift += 8) {
+		if (abs((int)((p >> shift) & 0xff) - (int)((a >> shift) & 0xff)) > 2) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void sample_png_content(const struct png_strip *strip,
+		struct png_content_stats *stats) {
+	uint32_t mask = strip->fully_opaque ? 0xffffff : 0xffffffff;
+	uint32_t colors[2 * PNG_AUTO_MAX_COLORS];
+	bool used[2 * PNG_AUTO_MAX_COLORS] = {0};
+
+	*stats = (struct png_content_stats){0};
+	for (int y = strip->y1; y < strip->y2; y += PNG_AUTO_SAMPLE_STEP) {
+		const uint32_t *row = (const uint32_t *)(strip->data +
+			(size_t)y * strip->stride);
+		const uint32_t *prev = y > 0 ? (const uint32_t *)(strip->data +
+			(size_t)(y - 1) * strip->stride) : NULL;
+		for (int x = 0; x < strip->width; x++) {
+			uint32_t p = row[x] & mask;
+			bool run = x > 0 && p == (row[x - 1] & mask);
+			stats->n_pixels++;
+			stats->n_runs += run;
+			stats->n_still += run || (prev != NULL && p == (prev[x] & mask));
+			stats->n_smooth += !run && x > 0 && is_smooth(p, row[x - 1] & mask);
+
+			if (run || stats->n_colors > PNG_AUTO_MAX_COLORS) {
+				continue;
+			}
+			size_t i = (p * 2654435761u) >> 23; // 9 bits
+			while (used[i] && colors[i] != p) {
+				i = (i + 1) % (2 * PNG_AUTO_MAX_COLORS);
+			}
+			if (!used[i]) {
+				used[i] = true;
+				colors[i] = p;
+				stats->n_colors++;
+			}
+		}
+	}
+}
+
+/**
+ * Picks the filter, zlib strategy and level for a strip from a sample of its
+ * rows, for -l auto.
+ */
+static void analyze_png_strip(void *data) {
+	struct png_strip *strip = data;
+	struct png_content_stats stats;
+	sample_png_content(strip, &stats);
+
+	size_t n = stats.n_pixels;
+	strip->level = 6;
+	if (stats.n_still >= n - n / 32) {
+		// Flat areas: filtered rows are mostly zeros, run-length encoding
+		// is enough and much faster than looking for matches
+		strip->filter = PNG_FILTER_VALUE_UP;
+		strip->strategy = Z_RLE;
+	} else if (stats.n_colors <= PNG_AUTO_MAX_COLORS) {
+		// Text and UI: glyphs and widgets repeat, Sub keeps them identical
+		strip->filter = PNG_FILTER_VALUE_SUB;
+		strip->strategy = Z_DEFAULT_STRATEGY;
+	} else if (stats.n_smooth >= (n - stats.n_runs) / 2) {
+		// Gradients: the right filter leaves small repeating residuals
+		strip->filter = PNG_FILTER_HEURISTIC;
+		strip->strategy = Z_FILTERED;
+	} else if (stats.n_runs < n / 4) {
+		// Photos and noise: matches are rare and slow to look for
+		strip->filter = PNG_FILTER_HEURISTIC;
+		strip->strategy = Z_RLE;
+	} else {
+		strip->filter = PNG_FILTER_VALUE_SUB;
+		strip->strategy = Z_DEFAULT_STRATEGY;
+	}
+
+	if (strip->palette != NULL) {
+		strip->filter = PNG_FILTER_VALUE_NONE;
+	}
+}
+
+static void compress_png_strip(void *data) {
+	struct png_strip *strip = data;
+	int bits = get_png_bits_per_pixel(strip->fully_opaque, strip->palette);
+	size_t bpp = bits >= 8 ? bits / 8 : 1;
+	size_t rowbytes = ((size_t)strip->width * bits + 7) / 8;
+	size_t filtered_rowbytes = rowbytes + 1;
+
+	// Also filter the rows preceding the strip, they make up the
+	// dictionary. Filtering is deterministic, so they come out the same
+	// as in the previous strip as long as they use its filter.
+	int n_dict_rows = (PNG_WINDOW_SIZE + filtered_rowbytes - 1) / filtered_rowbytes;
+	int first = strip->y1 > n_dict_rows ? strip->y1 - n_dict_rows : 0;
+
+	uint8_t *packed = calloc(2, rowbytes);
+	unsigned char *filtered = malloc((size_t)(strip->y2 - first) * filtered_rowbytes);
+	if (packed == NULL || filtered == NULL) {
+		fprintf(stderr, "failed to allocate png strip\n");
+		goto cleanup;
+	}
+
+	uint8_t *row = packed, *prev = packed + rowbytes;
+	if (first > 0) {
+		pack_row32(prev, (const uint32_t *)(strip->data +
+			(size_t)(first - 1) * strip->stride), strip->width,
+			strip->fully_opaque, strip->palette);
+	}
+	for (int y = first; y < strip->y2; y++) {
+		pack_row32(row, (const uint32_t *)(strip->data +
+			(size_t)y * strip->stride), strip->width, strip->fully_opaque,
+			strip->palette);
+		filter_row(filtered + (size_t)(y - first) * filtered_rowbytes, row,
+			prev, rowbytes, bpp,
+			y < strip->y1 ? strip->dict_filter : strip->filter);
+		uint8_t *tmp = prev;
+		prev = row;
+		row = tmp;
+	}
+
+	unsigned char *in = filtered + (size_t)(strip->y1 - first) * filtered_rowbytes;
+	strip->in_len = (size_t)(strip->y2 - strip->y1) * filtered_rowbytes;
+	strip->adler = adler32(adler32(0, NULL, 0), in, strip->in_len);
+
+	size_t dict_len = in - filtered;
+	if (dict_len > PNG_WINDOW_SIZE) {
+		dict_len = PNG_WINDOW_SIZE;
+	}
+	if (strip->level == GRIM_PNG_LEVEL_FAST) {
+		strip->ok = fast_deflate(in, strip->in_len, dict_len,
+			filtered_rowbytes, strip->last, &strip->out, &strip->out_len);
+	} else {
+		strip->ok = deflate_png_strip(strip, in, dict_len);
+	}
+
+cleanup:
+	free(filtered);
+	free(packed);
+}
+
+struct png_chunk_part {
+	const unsigned char *data;
+	size_t len;
+};
+
+static bool write_png_chunk(FILE *stream, const char *type,
+		const struct png_chunk_part *parts, size_t n_parts) {
+	size_t len = 0;
+	for (size_t i = 0; i < n_parts; i++) {
+		len += parts[i].len;
+	}
+
+	unsigned char header[8] = {
+		len >> 24, len >> 16, len >> 8, len,
+		type[0], type[1], type[2], type[3],
+	};
+	uLong crc = crc32(crc32(0, NULL, 0), header + 4, 4);
+	bool ok = fwrite(header, 1, sizeof(header), stream) == sizeof(header);
+	for (size_t i = 0; i < n_parts && ok; i++) {
+		crc = crc32(crc, parts[i].data, parts[i].len);
+		ok = fwrite(parts[i].data, 1, parts[i].len, stream) == parts[i].len;
+	}
+	unsigned char footer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+	return ok && fwrite(footer, 1, sizeof(footer), stream) == sizeof(footer);
+}
+
+/**
+ * Compresses strips of rows concurrently, pigz-style, and stitches them in
+ * a single zlib stream split over one IDAT chunk per strip.
+ */
+static int write_png_parallel(pixman_image_t *image, FILE *stream,
+		int comp_level, bool fully_opaque, const struct png_palette *palette,
+		struct grim_pool *pool, int n_strips) {
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+
+	struct png_strip *strips = calloc(n_strips, sizeof(struct png_strip));
+	if (strips == NULL) {
+		fprintf(stderr, "failed to allocate png strips\n");
+		return -1;
+	}
+
+	// Screenshots are mostly flat, Sub turns them into runs of zeros
+	int filter = PNG_FILTER_HEURISTIC;
+	if (comp_level == 0 || palette != NULL) {
+		filter = PNG_FILTER_VALUE_NONE;
+	} else if (comp_level == GRIM_PNG_LEVEL_FAST) {
+		filter = PNG_FILTER_VALUE_SUB;
+	}
+
+	for (int i = 0; i < n_strips; i++) {
+		strips[i] = (struct png_strip){
+			.data = (unsigned char *)pixman_image_get_data(image),
+			.stride = pixman_image_get_stride(image),
+			.width = width,
+			.fully_opaque = fully_opaque,
+			.palette = palette,
+			.level = comp_level,
+			.strategy = filter != PNG_FILTER_VALUE_NONE ?
+				Z_FILTERED : Z_DEFAULT_STRATEGY,
+			.filter = filter,
+			.dict_filter = filter,
+			.y1 = (int64_t)height * i / n_strips,
+			.y2 = (int64_t)height * (i + 1) / n_strips,
+			.last = i == n_strips - 1,
+		};
+	}
+
+	struct grim_task_group group;
+	task_group_init(&group, pool);
+	if (comp_level == GRIM_PNG_LEVEL_AUTO) {
+		for (int i = 0; i < n_strips; i++) {
+			task_group_submit(&group, analyze_png_strip, &strips[i]);
+		}
+		task_group_wait(&group);
+		for (int i = 1; i < n_strips; i++) {
+			strips[i].dict_filter = strips[i - 1].filter;
+		}
+	}
+	for (int i = 0; i < n_strips; i++) {
+		task_group_submit(&group, compress_png_strip, &strips[i]);
+	}
+	task_group_wait(&group);
+
+	int ret = 0;
+	uLong adler = adler32(0, NULL, 0);
+	for (int i = 0; i < n_strips; i++) {
+		if (!strips[i].ok) {
+			ret = -1;
+			goto cleanup;
+		}
+		adler = adler32_combine(adler, strips[i].adler, strips[i].in_len);
+	}
+
+	static const unsigned char signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+	unsigned char ihdr[13] = {
+		width >> 24, width >> 16, width >> 8, width,
+		height >> 24, height >> 16, height >> 8, height,
+		palette != NULL ? palette->bit_depth : 8,
+		palette != NULL ? PNG_COLOR_TYPE_PALETTE :
+			fully_opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA,
+		PNG_COMPRESSION_TYPE_BASE,
+		PNG_FILTER_TYPE_BASE,
+		PNG_INTERLACE_NONE,
+	};
+
+	// zlib header for a 32K window, with the level hint zlib would use
+	int level_flag = comp_level == GRIM_PNG_LEVEL_AUTO ? 2 :
+		comp_level < 2 ? 0 : comp_level < 6 ? 1 : comp_level == 6 ? 2 : 3;
+	unsigned char zlib_header[2] = { 0x78, level_flag << 6 };
+	zlib_header[1] += 31 - (zlib_header[0] * 256 + zlib_header[1]) % 31;
+	unsigned char zlib_trailer[4] = {
+		adler >> 24, adler >> 16, adler >> 8, adler,
+	};
+
+	bool ok = fwrite(signature, 1, sizeof(signature), stream) == sizeof(signature);
+	ok = ok && write_png_chunk(stream, "IHDR",
+		&(struct png_chunk_part){ ihdr, sizeof(ihdr) }, 1);
+	if (palette != NULL) {
+		unsigned char plte[3 * 256];
+		for (int i = 0; i < palette->n_colors; i++) {
+			plte[3 * i] = palette->colors[i].red;
+			plte[3 * i + 1] = palette->colors[i].green;
+			plte[3 * i + 2] = palette->colors[i].blue;
+		}
+		ok = ok && write_png_chunk(stream, "PLTE", &(struct png_chunk_part){
+			plte, 3 * palette->n_colors }, 1);
+		if (palette->n_trans > 0) {
+			ok = ok && write_png_chunk(stream, "tRNS", &(struct png_chunk_part){
+				palette->trans, palette->n_trans }, 1);
+		}
+	}
+	for (int i = 0; i < n_strips && ok; i++) {
+		struct png_chunk_part parts[3];
+		size_t n_parts = 0;
+		if (i == 0) {
+			parts[n_parts++] = (struct png_chunk_part){ zlib_header, sizeof(zlib_header) };
+		}
+		parts[n_parts++] = (struct png_chunk_part){ strips[i].out, strips[i].out_len };
+		if (strips[i].last) {
+			parts[n_parts++] = (struct png_chunk_part){ zlib_trailer, sizeof(zlib_trailer) };
+		}
+		ok = write_png_chunk(stream, "IDAT", parts, n_parts);
+	}
+	ok = ok && write_png_chunk(stream, "IEND", NULL, 0);
+	if (!ok) {
+		fprintf(stderr, "failed to write png\n");
+		ret = -1;
+	}
+
+cleanup:
+	for (int i = 0; i < n_strips; i++) {
+		free(strips[i].out);
+	}
+	free(strips);
+	return ret;
+}
+
+int write_to_png_stream(pixman_image_t *image, FILE *stream,
+		int comp_level, struct grim_pool *pool) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+
+	bool fully_opaque = true;
+	if (format == PIXMAN_a8r8g8b8) {
+		const struct grim_pack_funcs *funcs = get_pack_funcs();
+		for (int y = 0; y < height && fully_opaque; y++) {
+			const uint32_t *row = (const uint32_t *)(data + y * stride);
+			fully_opaque = funcs->is_opaque(row, width);
+		}
+	}
+
+	// Screenshots of terminals and dashboards often have few enough colors
+	// for a palette, which makes the rows three to four times smaller
+	struct png_palette *palette = calloc(1, sizeof(struct png_palette));
+	if (palette != NULL && !build_palette(palette, data, stride, width,
+			height, fully_opaque)) {
+		free(palette);
+		palette = NULL;
+	}
+
+	// A few strips per thread, unless they would get too small
+	int bits = get_png_bits_per_pixel(fully_opaque, palette);
+	size_t size = (((size_t)width * bits + 7) / 8 + 1) * height;
+	size_t n_strips = 4 * pool_get_threads(pool);
+	if (n_strips > size / PNG_STRIP_MIN_SIZE) {
+		n_strips = size / PNG_STRIP_MIN_SIZE;
+	}
+	if (n_strips < size / PNG_STRIP_MAX_SIZE + 1) {
+		n_strips = size / PNG_STRIP_MAX_SIZE + 1;
+	}
+	if (n_strips > (size_t)height) {
+		n_strips = height;
+	}
+	bool serial = false;
+	if (comp_level == GRIM_PNG_LEVEL_FAST || comp_level == GRIM_PNG_LEVEL_AUTO) {
+		// Not supported by libpng, the stream is always written here
+		if (n_strips < 1) {
+			n_strips = 1;
+		}
+	} else {
+		serial = pool == NULL || n_strips < 2;
+	}
+
+	int ret;
+	if (serial) {
+		ret = write_png_serial(image, stream, comp_level, fully_opaque,
+			palette);
+	} else {
+		ret = write_png_parallel(image, stream, comp_level, fully_opaque,
+			palette, pool, n_strips);
+	}
+	free(palette);
+	return ret;
+}
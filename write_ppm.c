@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,48 +10,71 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "pack.h"
 #include "write_ppm.h"
 
-int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
+// Rows are converted and written in batches of about this size
+#define PPM_CHUNK_SIZE (64 * 1024)
+
+int write_ppm_header(FILE *stream, int width, int height) {
 	// 256 bytes ought to be enough for everyone
 	char header[256];
 
-	int width = pixman_image_get_width(image);
-	int height = pixman_image_get_height(image);
-
 	int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
 	assert(header_len <= (int)sizeof(header));
 
-	size_t len = header_len + width * height * 3;
-	unsigned char *data = malloc(len);
-	unsigned char *buffer = data;
-
 	// We _do_not_ include the null byte
-	memcpy(buffer, header, header_len);
-	buffer += header_len;
+	if (fwrite(header, 1, header_len, stream) != (size_t)header_len) {
+		fprintf(stderr, "Failed to write ppm\n");
+		return -1;
+	}
+	return 0;
+}
+
+int write_ppm_rows(pixman_image_t *image, FILE *stream) {
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
 
 	pixman_format_code_t format = pixman_image_get_format(image);
 	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
 
+	size_t rowbytes = (size_t)width * 3;
+	int batch_rows = rowbytes > 0 && rowbytes < PPM_CHUNK_SIZE ?
+		PPM_CHUNK_SIZE / rowbytes : 1;
+	unsigned char *buffer = malloc(batch_rows * rowbytes);
+	if (buffer == NULL) {
+		fprintf(stderr, "failed to allocate ppm buffer\n");
+		return -1;
+	}
+
 	// Both formats are native-endian 32-bit ints
-	uint32_t *pixels = pixman_image_get_data(image);
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			uint32_t p = *pixels++;
+	const struct grim_pack_funcs *funcs = get_pack_funcs();
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *pixels = (unsigned char *)pixman_image_get_data(image);
+	bool ok = true;
+	for (int y = 0; y < height && ok; y += batch_rows) {
+		int n_rows = height - y < batch_rows ? height - y : batch_rows;
+		for (int i = 0; i < n_rows; i++) {
+			const uint32_t *row = (const uint32_t *)(pixels + (size_t)(y + i) * stride);
 			// RGB order
-			*buffer++ = (p >> 16) & 0xff;
-			*buffer++ = (p >>  8) & 0xff;
-			*buffer++ = (p >>  0) & 0xff;
+			funcs->pack_rgb(buffer + i * rowbytes, row, width);
 		}
+		size_t len = n_rows * rowbytes;
+		ok = fwrite(buffer, 1, len, stream) == len;
 	}
+	free(buffer);
 
-	size_t written = fwrite(data, 1, len, stream);
-	if (written < len) {
-		free(data);
-		fprintf(stderr, "Failed to write ppm; only %zu of %zu bytes written\n",
-			written, len);
+	if (!ok) {
+		fprintf(stderr, "Failed to write ppm\n");
 		return -1;
 	}
-	free(data);
 	return 0;
 }
+
+int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
+	if (write_ppm_header(stream, pixman_image_get_width(image),
+			pixman_image_get_height(image)) == -1) {
+		return -1;
+	}
+	return write_ppm_rows(image, stream);
+}
@@ -0,0 +1,299 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "pack.h"
+#include "write_qoi.h"
+
+// See https://qoiformat.org/qoi-specification.pdf
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+#define QOI_MAX_RUN 62
+#define QOI_COLORSPACE_SRGB 0
+// Output is written in chunks of about this size
+#define QOI_CHUNK_SIZE (64 * 1024)
+// Worst case, a pixel takes a QOI_OP_RGBA
+#define QOI_MAX_PIXEL_SIZE 5
+
+union qoi_pixel {
+	uint8_t rgba[4];
+	uint32_t v;
+};
+
+static unsigned int qoi_hash(union qoi_pixel px) {
+	return (px.rgba[0] * 3 + px.rgba[1] * 5 + px.rgba[2] * 7 +
+		px.rgba[3] * 11) % 64;
+}
+
+struct qoi_encoder {
+	union qoi_pixel index[64];
+	union qoi_pixel prev;
+	int run;
+	uint8_t *out;
+};
+
+/**
+ * Writes out the run so far. If partial is false, a run shorter than
+ * QOI_MAX_RUN is kept, it may continue with the next row.
+ */
+static void qoi_flush_run(struct qoi_encoder *enc, bool partial) {
+	while (enc->run >= QOI_MAX_RUN) {
+		*enc->out++ = QOI_OP_RUN | (QOI_MAX_RUN - 1);
+		enc->run -= QOI_MAX_RUN;
+	}
+	if (partial && enc->run > 0) {
+		*enc->out++ = QOI_OP_RUN | (enc->run - 1);
+		enc->run = 0;
+	}
+}
+
+static void qoi_encode_row(struct qoi_encoder *enc,
+		const union qoi_pixel *restrict row, size_t width) {
+	uint8_t *restrict out = enc->out;
+	union qoi_pixel prev = enc->prev;
+	size_t x = 0;
+	while (x < width) {
+		// Runs are what UI screenshots are mostly made of: find their end
+		// with plain word compares, which the compiler vectorizes
+		if (row[x].v == prev.v) {
+			size_t end = x + 1;
+			while (end < width && row[end].v == prev.v) {
+				end++;
+			}
+			enc->run += end - x;
+			x = end;
+			continue;
+		}
+		if (enc->run > 0) {
+			enc->out = out;
+			qoi_flush_run(enc, true);
+			out = enc->out;
+		}
+
+		union qoi_pixel px = row[x++];
+		unsigned int hash = qoi_hash(px);
+		if (enc->index[hash].v == px.v) {
+			*out++ = QOI_OP_INDEX | hash;
+		} else if (px.rgba[3] == prev.rgba[3]) {
+			enc->index[hash] = px;
+			int8_t dr = px.rgba[0] - prev.rgba[0];
+			int8_t dg = px.rgba[1] - prev.rgba[1];
+			int8_t db = px.rgba[2] - prev.rgba[2];
+			int8_t dr_dg = dr - dg;
+			int8_t db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 &&
+					db >= -2 && db <= 1) {
+				*out++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+			} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+					db_dg >= -8 && db_dg <= 7) {
+				*out++ = QOI_OP_LUMA | (dg + 32);
+				*out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+			} else {
+				*out++ = QOI_OP_RGB;
+				*out++ = px.rgba[0];
+				*out++ = px.rgba[1];
+				*out++ = px.rgba[2];
+			}
+		} else {
+			enc->index[hash] = px;
+			*out++ = QOI_OP_RGBA;
+			memcpy(out, px.rgba, 4);
+			out += 4;
+		}
+		prev = px;
+	}
+	enc->out = out;
+	enc->prev = prev;
+}
+
+static void write_be32(uint8_t *out, uint32_t v) {
+	out[0] = v >> 24;
+	out[1] = v >> 16;
+	out[2] = v >> 8;
+	out[3] = v;
+}
+
+struct grim_qoi_writer {
+	FILE *stream;
+	int width;
+	bool fully_opaque;
+	bool rows_opaque; // all rows written so far are opaque
+	off_t header_offset; // -1 if the stream can't seek
+	bool header_written;
+	bool ok;
+	struct qoi_encoder enc;
+	uint8_t *buffer;
+	union qoi_pixel *row;
+	uint8_t *rgb;
+};
+
+static void destroy_qoi_writer(struct grim_qoi_writer *writer) {
+	free(writer->buffer);
+	free(writer->row);
+	free(writer->rgb);
+	free(writer);
+}
+
+struct grim_qoi_writer *create_qoi_writer(FILE *stream, int width, int height,
+		bool fully_opaque) {
+	struct grim_qoi_writer *writer = calloc(1, sizeof(struct grim_qoi_writer));
+	if (writer == NULL) {
+		fprintf(stderr, "failed to allocate qoi buffers\n");
+		return NULL;
+	}
+	writer->stream = stream;
+	writer->width = width;
+	writer->fully_opaque = fully_opaque;
+	writer->rows_opaque = true;
+	writer->header_offset = ftello(stream);
+	writer->ok = true;
+
+	// Room for a whole row and the end marker, plus the chunk size
+	size_t out_size = QOI_CHUNK_SIZE + (size_t)width * QOI_MAX_PIXEL_SIZE + 16;
+	writer->buffer = malloc(out_size);
+	writer->row = malloc((size_t)width * sizeof(union qoi_pixel));
+	writer->rgb = fully_opaque ? malloc((size_t)width * 3) : NULL;
+	if (writer->buffer == NULL || writer->row == NULL ||
+			(fully_opaque && writer->rgb == NULL)) {
+		fprintf(stderr, "failed to allocate qoi buffers\n");
+		destroy_qoi_writer(writer);
+		return NULL;
+	}
+
+	struct qoi_encoder *enc = &writer->enc;
+	*enc = (struct qoi_encoder){
+		.prev = {{ 0, 0, 0, 0xFF }},
+		.out = writer->buffer,
+	};
+
+	memcpy(enc->out, "qoif", 4);
+	write_be32(enc->out + 4, width);
+	write_be32(enc->out + 8, height);
+	enc->out[12] = fully_opaque ? 3 : 4;
+	enc->out[13] = QOI_COLORSPACE_SRGB;
+	enc->out += 14;
+	return writer;
+}
+
+int qoi_writer_write_rows(struct grim_qoi_writer *writer,
+		pixman_image_t *image) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+	assert(pixman_image_get_width(image) == writer->width);
+
+	int width = writer->width;
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+
+	const struct grim_pack_funcs *funcs = get_pack_funcs();
+	struct qoi_encoder *enc = &writer->enc;
+	union qoi_pixel *row = writer->row;
+	uint8_t *rgb = writer->rgb;
+	for (int y = 0; y < height && writer->ok; y++) {
+		const uint32_t *src = (const uint32_t *)(data + (size_t)y * stride);
+		if (writer->fully_opaque) {
+			funcs->pack_rgb(rgb, src, width);
+			for (int x = 0; x < width; x++) {
+				row[x].rgba[0] = rgb[3 * x];
+				row[x].rgba[1] = rgb[3 * x + 1];
+				row[x].rgba[2] = rgb[3 * x + 2];
+				row[x].rgba[3] = 0xFF;
+			}
+		} else {
+			// Opaque pixels give the same chunks either way, only the
+			// header may need to change in the end
+			if (writer->rows_opaque) {
+				writer->rows_opaque = funcs->is_opaque(src, width);
+			}
+			funcs->pack_rgba(row[0].rgba, src, width);
+		}
+		qoi_encode_row(enc, row, width);
+		// Runs carry over to the next row, but their output must fit
+		qoi_flush_run(enc, false);
+
+		size_t len = enc->out - writer->buffer;
+		if (len >= QOI_CHUNK_SIZE) {
+			writer->ok = fwrite(writer->buffer, 1, len, writer->stream) == len;
+			writer->header_written = true;
+			enc->out = writer->buffer;
+		}
+	}
+
+	if (!writer->ok) {
+		fprintf(stderr, "Failed to write qoi\n");
+		return -1;
+	}
+	return 0;
+}
+
+int finish_qoi_writer(struct grim_qoi_writer *writer) {
+	static const uint8_t end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	struct qoi_encoder *enc = &writer->enc;
+	qoi_flush_run(enc, true);
+	memcpy(enc->out, end_marker, sizeof(end_marker));
+	enc->out += sizeof(end_marker);
+
+	// Declare 3 channels like write_to_qoi_stream() does for opaque
+	// images, in the header if it's still buffered, in the file otherwise
+	bool opaque = !writer->fully_opaque && writer->rows_opaque;
+	if (opaque && !writer->header_written) {
+		writer->buffer[12] = 3;
+	}
+	size_t len = enc->out - writer->buffer;
+	bool ok = writer->ok &&
+		fwrite(writer->buffer, 1, len, writer->stream) == len;
+	if (ok && opaque && writer->header_written &&
+			writer->header_offset >= 0) {
+		off_t end = ftello(writer->stream);
+		ok = end >= 0 &&
+			fseeko(writer->stream, writer->header_offset + 12, SEEK_SET) == 0 &&
+			fputc(3, writer->stream) != EOF &&
+			fseeko(writer->stream, end, SEEK_SET) == 0;
+	}
+
+	destroy_qoi_writer(writer);
+	if (!ok) {
+		fprintf(stderr, "Failed to write qoi\n");
+		return -1;
+	}
+	return 0;
+}
+
+int write_to_qoi_stream(pixman_image_t *image, FILE *stream) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+
+	const struct grim_pack_funcs *funcs = get_pack_funcs();
+	bool fully_opaque = true;
+	if (format == PIXMAN_a8r8g8b8) {
+		for (int y = 0; y < height && fully_opaque; y++) {
+			const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+			fully_opaque = funcs->is_opaque(row, width);
+		}
+	}
+
+	struct grim_qoi_writer *writer =
+		create_qoi_writer(stream, width, height, fully_opaque);
+	if (writer == NULL) {
+		return -1;
+	}
+	if (qoi_writer_write_rows(writer, image) == -1) {
+		destroy_qoi_writer(writer);
+		return -1;
+	}
+	return finish_qoi_writer(writer);
+}
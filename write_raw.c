@@ -0,0 +1,117 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "write_raw.h"
+
+/*
+ * The header is made of little-endian fields:
+ *
+ *   0  magic "GRIMRAW1"
+ *   8  u32 header size, i.e. the offset of the first row
+ *  12  u32 width
+ *  16  u32 height
+ *  20  u32 stride, in bytes
+ *  24  u32 DRM fourcc pixel format
+ *  28  u32 wl_output transform
+ *  32  u64 presentation time in nanoseconds, 0 if unknown
+ *  40  reserved, zero
+ */
+#define GRIM_RAW_MAGIC "GRIMRAW1"
+
+#define fourcc_code(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+	((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+static void write_le32(uint8_t *out, uint32_t v) {
+	out[0] = v;
+	out[1] = v >> 8;
+	out[2] = v >> 16;
+	out[3] = v >> 24;
+}
+
+static uint32_t get_drm_format(pixman_format_code_t format) {
+	// DRM formats are little-endian, pixman ones native-endian
+#if GRIM_LITTLE_ENDIAN
+	return format == PIXMAN_a8r8g8b8 ? fourcc_code('A', 'R', '2', '4') :
+		fourcc_code('X', 'R', '2', '4');
+#else
+	return format == PIXMAN_a8r8g8b8 ? fourcc_code('B', 'A', '2', '4') :
+		fourcc_code('B', 'X', '2', '4');
+#endif
+}
+
+static bool write_all(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+int write_to_raw_stream(pixman_image_t *image, FILE *stream,
+		enum wl_output_transform transform, const struct timespec *time) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+
+	uint64_t time_ns = 0;
+	if (time != NULL) {
+		time_ns = (uint64_t)time->tv_sec * 1000000000 + time->tv_nsec;
+	}
+
+	uint8_t header[GRIM_RAW_HEADER_SIZE] = {0};
+	memcpy(header, GRIM_RAW_MAGIC, 8);
+	write_le32(header + 8, GRIM_RAW_HEADER_SIZE);
+	write_le32(header + 12, width);
+	write_le32(header + 16, height);
+	write_le32(header + 20, stride);
+	write_le32(header + 24, get_drm_format(format));
+	write_le32(header + 28, transform);
+	write_le32(header + 32, time_ns);
+	write_le32(header + 36, time_ns >> 32);
+
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof(header) },
+		{ .iov_base = pixman_image_get_data(image),
+			.iov_len = (size_t)stride * height },
+	};
+
+	// Hand the rows to the kernel in one go when there's a file
+	// descriptor behind the stream, anything buffered goes first
+	bool ok = fflush(stream) == 0;
+	int fd = fileno(stream);
+	if (ok && fd >= 0) {
+		ok = write_all(fd, iov, 2);
+	} else {
+		for (int i = 0; i < 2 && ok; i++) {
+			ok = fwrite(iov[i].iov_base, 1, iov[i].iov_len, stream) ==
+				iov[i].iov_len;
+		}
+	}
+	if (!ok) {
+		fprintf(stderr, "Failed to write raw image\n");
+		return -1;
+	}
+	return 0;
+}
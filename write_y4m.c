@@ -0,0 +1,352 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "write_y4m.h"
+
+// Bands converted by a single task have at least this many rows
+#define Y4M_BAND_MIN_ROWS 32
+// Frame rate used in the header when it isn't known
+#define Y4M_DEFAULT_FRAME_RATE 30
+
+// BT.709 luma weights
+#define BT709_KR 0.2126
+#define BT709_KB 0.0722
+
+// Weights have 14 fractional bits, so that they fit in 16-bit multiplies
+#define YUV_FRAC_BITS 14
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+/**
+ * Fixed-point BT.709 weights for R, G and B.
+ */
+struct yuv_coeffs {
+	int32_t y[3], y_offset;
+	int32_t u[3], v[3];
+};
+
+static int32_t to_fixed(double v) {
+	double one = 1 << YUV_FRAC_BITS;
+	return v >= 0 ? (int32_t)(v * one + 0.5) : -(int32_t)(-v * one + 0.5);
+}
+
+static void get_yuv_coeffs(struct yuv_coeffs *coeffs, bool full_range) {
+	double kg = 1 - BT709_KR - BT709_KB;
+	double y_scale = full_range ? 1 : 219.0 / 255;
+	double c_scale = full_range ? 1 : 224.0 / 255;
+
+	coeffs->y[0] = to_fixed(BT709_KR * y_scale);
+	coeffs->y[2] = to_fixed(BT709_KB * y_scale);
+	// Make the weights add up exactly, so that white doesn't overflow
+	coeffs->y[1] = to_fixed(y_scale) - coeffs->y[0] - coeffs->y[2];
+	coeffs->y_offset = ((full_range ? 0 : 16) << YUV_FRAC_BITS) +
+		(1 << (YUV_FRAC_BITS - 1));
+
+	// Cb is (B - Y) and Cr is (R - Y), brought to [-0.5, 0.5]
+	double cb = c_scale / (2 * (1 - BT709_KB));
+	double cr = c_scale / (2 * (1 - BT709_KR));
+	coeffs->u[0] = to_fixed(-BT709_KR * cb);
+	coeffs->u[1] = to_fixed(-kg * cb);
+	coeffs->u[2] = to_fixed(c_scale / 2);
+	coeffs->v[0] = to_fixed(c_scale / 2);
+	coeffs->v[1] = to_fixed(-kg * cr);
+	coeffs->v[2] = to_fixed(-BT709_KB * cr);
+}
+
+/**
+ * Kernels computing one plane of samples from rows of native-endian ARGB
+ * pixels, as (k[0] * R + k[1] * G + k[2] * B + offset) >> shift clamped to
+ * 8 bits. All of them give the same results.
+ */
+struct yuv_funcs {
+	void (*convert_row)(uint8_t *out, const uint32_t *row, int width,
+		const int32_t k[static 3], int32_t offset);
+	// Weighs the sums of 2x2 pixels, with 2 more bits of shift
+	void (*convert_rows_420)(uint8_t *out, const uint32_t *row0,
+		const uint32_t *row1, int width, const int32_t k[static 3],
+		int32_t offset);
+};
+
+static inline uint8_t clamp_sample(int32_t v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static void convert_row_scalar(uint8_t *out, const uint32_t *row, int width,
+		const int32_t k[static 3], int32_t offset) {
+	for (int x = 0; x < width; x++) {
+		uint32_t p = row[x];
+		int32_t r = (p >> 16) & 0xFF, g = (p >> 8) & 0xFF, b = p & 0xFF;
+		out[x] = clamp_sample((k[0] * r + k[1] * g + k[2] * b + offset) >>
+			YUV_FRAC_BITS);
+	}
+}
+
+static void convert_rows_420_scalar(uint8_t *out, const uint32_t *row0,
+		const uint32_t *row1, int width, const int32_t k[static 3],
+		int32_t offset) {
+	for (int x = 0; x < width; x += 2) {
+		// Repeat the last column if the width is odd
+		int x1 = x + 1 < width ? x + 1 : x;
+		uint32_t p[4] = { row0[x], row0[x1], row1[x], row1[x1] };
+		int32_t r = 0, g = 0, b = 0;
+		for (int i = 0; i < 4; i++) {
+			r += (p[i] >> 16) & 0xFF;
+			g += (p[i] >> 8) & 0xFF;
+			b += p[i] & 0xFF;
+		}
+		out[x / 2] = clamp_sample((k[0] * r + k[1] * g + k[2] * b + offset) >>
+			(YUV_FRAC_BITS + 2));
+	}
+}
+
+#if HAVE_X86_KERNELS
+/**
+ * Weighs 8 pixels with 16-bit multiplies: blue and red, then green and
+ * alpha are pairs of 16-bit lanes.
+ */
+__attribute__((target("avx2")))
+static inline __m256i weigh_avx2(__m256i v, __m256i k_br, __m256i k_g) {
+	const __m256i mask = _mm256_set1_epi32(0x00FF00FF);
+	__m256i br = _mm256_and_si256(v, mask);
+	__m256i ga = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+	return _mm256_add_epi32(_mm256_madd_epi16(br, k_br),
+		_mm256_madd_epi16(ga, k_g));
+}
+
+__attribute__((target("avx2")))
+static inline void store_samples_avx2(uint8_t *out, __m256i lo, __m256i hi) {
+	// Packing works within 128-bit lanes, put the samples back in order
+	__m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+	_mm_storeu_si128((__m128i *)out, _mm_packus_epi16(
+		_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+static void convert_row_avx2(uint8_t *out, const uint32_t *row, int width,
+		const int32_t k[static 3], int32_t offset) {
+	const __m256i k_br = _mm256_set1_epi32(
+		(int32_t)((uint32_t)k[0] << 16 | (k[2] & 0xFFFF)));
+	const __m256i k_g = _mm256_set1_epi32(k[1] & 0xFFFF);
+	const __m256i off = _mm256_set1_epi32(offset);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i lo = weigh_avx2(_mm256_loadu_si256((const __m256i *)&row[x]),
+			k_br, k_g);
+		__m256i hi = weigh_avx2(_mm256_loadu_si256((const __m256i *)&row[x + 8]),
+			k_br, k_g);
+		lo = _mm256_srai_epi32(_mm256_add_epi32(lo, off), YUV_FRAC_BITS);
+		hi = _mm256_srai_epi32(_mm256_add_epi32(hi, off), YUV_FRAC_BITS);
+		store_samples_avx2(out + x, lo, hi);
+	}
+	convert_row_scalar(out + x, row + x, width - x, k, offset);
+}
+
+__attribute__((target("avx2")))
+static void convert_rows_420_avx2(uint8_t *out, const uint32_t *row0,
+		const uint32_t *row1, int width, const int32_t k[static 3],
+		int32_t offset) {
+	const __m256i k_br = _mm256_set1_epi32(
+		(int32_t)((uint32_t)k[0] << 16 | (k[2] & 0xFFFF)));
+	const __m256i k_g = _mm256_set1_epi32(k[1] & 0xFFFF);
+	const __m256i off = _mm256_set1_epi32(offset);
+	int x = 0;
+	for (; x + 32 <= width; x += 32) {
+		// Weighing is linear, so weigh the pixels then add them up
+		__m256i sums[4];
+		for (int i = 0; i < 4; i++) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)&row0[x + 8 * i]);
+			__m256i b = _mm256_loadu_si256((const __m256i *)&row1[x + 8 * i]);
+			sums[i] = _mm256_add_epi32(weigh_avx2(a, k_br, k_g),
+				weigh_avx2(b, k_br, k_g));
+		}
+		// Adding horizontal pairs interleaves 128-bit lanes
+		__m256i lo = _mm256_permute4x64_epi64(
+			_mm256_hadd_epi32(sums[0], sums[1]), 0xD8);
+		__m256i hi = _mm256_permute4x64_epi64(
+			_mm256_hadd_epi32(sums[2], sums[3]), 0xD8);
+		lo = _mm256_srai_epi32(_mm256_add_epi32(lo, off), YUV_FRAC_BITS + 2);
+		hi = _mm256_srai_epi32(_mm256_add_epi32(hi, off), YUV_FRAC_BITS + 2);
+		store_samples_avx2(out + x / 2, lo, hi);
+	}
+	convert_rows_420_scalar(out + x / 2, row0 + x, row1 + x, width - x, k,
+		offset);
+}
+#endif
+
+static struct yuv_funcs yuv_funcs = {
+	.convert_row = convert_row_scalar,
+	.convert_rows_420 = convert_rows_420_scalar,
+};
+static pthread_once_t yuv_funcs_once = PTHREAD_ONCE_INIT;
+
+static void init_yuv_funcs(void) {
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		yuv_funcs.convert_row = convert_row_avx2;
+		yuv_funcs.convert_rows_420 = convert_rows_420_avx2;
+	}
+#endif
+}
+
+struct y4m_band {
+	const unsigned char *data;
+	int stride, width, height;
+	int y1, y2; // y1 is even
+	uint8_t *planes[3];
+	int chroma_width;
+	bool chroma_444;
+	const struct yuv_coeffs *coeffs;
+};
+
+static void convert_y4m_band(void *data) {
+	struct y4m_band *band = data;
+	const struct yuv_coeffs *coeffs = band->coeffs;
+	const struct yuv_funcs *funcs = &yuv_funcs;
+	int32_t chroma_offset = 128 << YUV_FRAC_BITS;
+	for (int y = band->y1; y < band->y2; y++) {
+		const uint32_t *row =
+			(const uint32_t *)(band->data + (size_t)y * band->stride);
+		funcs->convert_row(band->planes[0] + (size_t)y * band->width, row,
+			band->width, coeffs->y, coeffs->y_offset);
+
+		if (band->chroma_444) {
+			size_t offset = (size_t)y * band->chroma_width;
+			int32_t rounding = 1 << (YUV_FRAC_BITS - 1);
+			funcs->convert_row(band->planes[1] + offset, row, band->width,
+				coeffs->u, chroma_offset + rounding);
+			funcs->convert_row(band->planes[2] + offset, row, band->width,
+				coeffs->v, chroma_offset + rounding);
+		} else if (y % 2 == 0) {
+			// Repeat the last row if the height is odd
+			const uint32_t *next = y + 1 < band->height ?
+				(const uint32_t *)((const unsigned char *)row + band->stride) :
+				row;
+			size_t offset = (size_t)(y / 2) * band->chroma_width;
+			int32_t rounding = 1 << (YUV_FRAC_BITS + 1);
+			funcs->convert_rows_420(band->planes[1] + offset, row, next,
+				band->width, coeffs->u, (chroma_offset << 2) + rounding);
+			funcs->convert_rows_420(band->planes[2] + offset, row, next,
+				band->width, coeffs->v, (chroma_offset << 2) + rounding);
+		}
+	}
+}
+
+int write_y4m_header(FILE *stream, int width, int height, double frame_rate,
+		const struct grim_y4m_format *format) {
+	// Keep rates such as 29.97 as a fraction
+	uint64_t rate_num = Y4M_DEFAULT_FRAME_RATE, rate_den = 1;
+	if (frame_rate > 0 && frame_rate < UINT32_MAX) {
+		rate_den = 1000;
+		rate_num = (uint64_t)(frame_rate * rate_den + 0.5);
+		if (rate_num == 0) {
+			rate_num = 1;
+		}
+		uint64_t a = rate_num, b = rate_den;
+		while (b != 0) {
+			uint64_t t = a % b;
+			a = b;
+			b = t;
+		}
+		rate_num /= a;
+		rate_den /= a;
+	}
+
+	// The colorspace isn't part of the format, it's up to the reader
+	int ret = fprintf(stream, "YUV4MPEG2 W%d H%d F%llu:%llu Ip A1:1 %s "
+		"XCOLORRANGE=%s\n", width, height, (unsigned long long)rate_num,
+		(unsigned long long)rate_den,
+		format->chroma_444 ? "C444" : "C420jpeg",
+		format->full_range ? "FULL" : "LIMITED");
+	if (ret < 0) {
+		fprintf(stderr, "failed to write y4m header\n");
+		return -1;
+	}
+	return 0;
+}
+
+int write_y4m_frame(pixman_image_t *image, FILE *stream,
+		const struct grim_y4m_format *format, struct grim_pool *pool) {
+	pixman_format_code_t image_format = pixman_image_get_format(image);
+	assert(image_format == PIXMAN_a8r8g8b8 ||
+		image_format == PIXMAN_x8r8g8b8);
+
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int chroma_width = format->chroma_444 ? width : (width + 1) / 2;
+	int chroma_height = format->chroma_444 ? height : (height + 1) / 2;
+	size_t luma_size = (size_t)width * height;
+	size_t chroma_size = (size_t)chroma_width * chroma_height;
+	size_t frame_size = luma_size + 2 * chroma_size;
+
+	// Unlike the other formats, planes can't be written as rows come
+	uint8_t *buffer = malloc(frame_size);
+	if (buffer == NULL) {
+		fprintf(stderr, "failed to allocate y4m frame\n");
+		return -1;
+	}
+
+	int n_bands = 4 * pool_get_threads(pool);
+	if (n_bands > height / Y4M_BAND_MIN_ROWS) {
+		n_bands = height / Y4M_BAND_MIN_ROWS;
+	}
+	if (n_bands < 1) {
+		n_bands = 1;
+	}
+	struct y4m_band *bands = calloc(n_bands, sizeof(struct y4m_band));
+	if (bands == NULL) {
+		fprintf(stderr, "failed to allocate y4m bands\n");
+		free(buffer);
+		return -1;
+	}
+
+	struct yuv_coeffs coeffs;
+	get_yuv_coeffs(&coeffs, format->full_range);
+	pthread_once(&yuv_funcs_once, init_yuv_funcs);
+
+	// 4:2:0 chroma rows are taken from pairs of rows, don't split those
+	int row_pairs = (height + 1) / 2;
+	struct grim_task_group group;
+	task_group_init(&group, pool);
+	for (int i = 0; i < n_bands; i++) {
+		int y2 = (int64_t)row_pairs * (i + 1) / n_bands * 2;
+		bands[i] = (struct y4m_band){
+			.data = (unsigned char *)pixman_image_get_data(image),
+			.stride = pixman_image_get_stride(image),
+			.width = width,
+			.height = height,
+			.y1 = (int64_t)row_pairs * i / n_bands * 2,
+			.y2 = y2 < height ? y2 : height,
+			.planes = { buffer, buffer + luma_size,
+				buffer + luma_size + chroma_size },
+			.chroma_width = chroma_width,
+			.chroma_444 = format->chroma_444,
+			.coeffs = &coeffs,
+		};
+		task_group_submit(&group, convert_y4m_band, &bands[i]);
+	}
+	task_group_wait(&group);
+	free(bands);
+
+	static const char frame_header[] = "FRAME\n";
+	bool ok = fwrite(frame_header, 1, sizeof(frame_header) - 1, stream) ==
+		sizeof(frame_header) - 1;
+	ok = ok && fwrite(buffer, 1, frame_size, stream) == frame_size;
+	free(buffer);
+
+	if (!ok) {
+		fprintf(stderr, "failed to write y4m frame\n");
+		return -1;
+	}
+	return 0;
+}